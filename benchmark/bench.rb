@@ -0,0 +1,130 @@
+#
+# Overhead of GC::Tracer logging for each configuration
+#
+#   $ rake bench
+#   $ ruby -Ilib benchmark/bench.rb [workload ...] > bench.tsv
+#
+# Results are tab separated values on stdout (progress is on stderr):
+#   workload config records sec baseline_sec slowdown_percent ns_per_record
+#
+# ns_per_record is the additional time divided by the number of written
+# records (logged events). Each configuration is run once to warm up,
+# and the setup of logging is not timed (flushing at stop is timed).
+#
+# Environment variables:
+#   BENCH_REPEAT:      repetitions of each measurement (the fastest one is taken, default: 5)
+#   BENCH_MATRIX=full: all combinations of events, tick_type, info and mode
+#                      (default: change one of them from the default configuration)
+#
+
+require 'gc_tracer'
+require 'tmpdir'
+
+WORKLOADS = {
+  small_strings: ->{ 3_000_000.times{ 'x' * 10 } },
+  hash_churn:    ->{ 200.times{ h = {}; 20_000.times{|i| h[i] = i.to_s } } },
+  gc_start:      ->{ 1_000.times{ GC.start(full_mark: false) } },
+}
+
+AXES = {
+  events: {
+    gc:             {events: %i(start end_mark end_sweep)},
+    steps:          {events: %i(start end_mark end_sweep enter exit)},
+    newobj_sampled: {events: %i(start end_mark end_sweep newobj), sample_rate: 1_000},
+  },
+  tick_type: {
+    time:       {tick_type: :time},
+    nano_time:  {tick_type: :nano_time},
+    hw_counter: {tick_type: :hw_counter},
+    tsc_ns:     {tick_type: :tsc_ns},
+  },
+  info: {
+    stat_info: {gc_stat: true, gc_latest_gc_info: true},
+    none:      {gc_stat: false, gc_latest_gc_info: false},
+    rusage:    {gc_stat: true, gc_latest_gc_info: true, rusage: true},
+  },
+  mode: {
+    tsv:          {},
+    buffered:     {buffer_size: 1_024},
+    async:        {async: true, buffer_size: 16_384},
+    binary:       {format: :binary, buffer_size: 1_024},
+    binary_delta: {format: :binary_delta, buffer_size: 1_024},
+  },
+}
+
+REPEAT = Integer(ENV['BENCH_REPEAT'] || 5)
+
+# [[name, options], ...]
+def configs
+  defaults = AXES.map{|axis, values| [axis, values.keys.first]}.to_h
+
+  choices = if ENV['BENCH_MATRIX'] == 'full'
+    AXES.map{|axis, values| values.keys.map{|v| [axis, v]}}.inject{|a, b| a.product(b).map(&:flatten)}
+        .map{|pairs| pairs.each_slice(2).to_h}
+  else
+    [defaults] + AXES.flat_map{|axis, values|
+      values.keys.drop(1).map{|v| defaults.merge(axis => v)}
+    }
+  end
+
+  choices.map{|choice|
+    name = choice.map{|axis, v| "#{axis}=#{v}"}.join(',')
+    [name, choice.map{|axis, v| AXES[axis][v]}.inject(:merge)]
+  }
+end
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def count_records(file, opts)
+  if opts[:format]
+    GC::Tracer::BinaryLog.open(file){|log| log.each_values.count}
+  else
+    File.foreach(file).count{|line| !line.start_with?("type\t")}
+  end
+end
+
+# setup of logging (opening files, TSC calibration and so on) is not timed
+def run(workload, opts)
+  Dir.mktmpdir('gc_tracer_bench'){|dir|
+    file = "#{dir}/log"
+    GC.start
+    GC::Tracer.start_logging(file, **opts) if opts
+    t = now
+    workload.call
+    GC::Tracer.stop_logging if opts
+    [now - t, opts ? count_records(file, opts) : 0]
+  }
+end
+
+# => [sec, records, baseline_sec] of the fastest runs
+# (runs without logging are interleaved, so that both see the same heap)
+def measure(workload, opts)
+  run(workload, opts) # warm up
+  runs = REPEAT.times.map{ [run(workload, nil), run(workload, opts)] }
+  [*runs.map(&:last).min_by(&:first), runs.map(&:first).map(&:first).min]
+end
+
+workloads = ARGV.empty? ? WORKLOADS : WORKLOADS.select{|name, | ARGV.include?(name.to_s)}
+
+puts %w(workload config records sec baseline_sec slowdown_percent ns_per_record).join("\t")
+$stdout.flush
+
+workloads.each{|name, workload|
+  workload.call # warm up
+
+  configs.each{|config, opts|
+    $stderr.puts "#{name} #{config}"
+    begin
+      sec, records, baseline = measure(workload, opts)
+    rescue NotImplementedError => e
+      $stderr.puts "  skipped: #{e.message}"
+      next
+    end
+    slowdown = (sec / baseline - 1) * 100
+    ns = records > 0 ? (sec - baseline) * 1e9 / records : nil
+    puts [name, config, records, sec.round(6), baseline.round(6), slowdown.round(2), ns && ns.round(1)].join("\t")
+    $stdout.flush
+  }
+}
@@ -0,0 +1,11 @@
+#
+# Convert a binary log (format: :binary) into tab separated values.
+#
+#   ruby gc_tracer_binary_convert.rb logfile > logfile.tsv
+#
+
+require_relative '../lib/gc_tracer/binary_log'
+
+GC::Tracer::BinaryLog.open(ARGV.shift || abort("usage: #{$0} logfile")){|log|
+  log.write_tsv($stdout)
+}
@@ -1,14 +1,32 @@
 require 'erb'
 require 'fileutils'
+require_relative '../lib/gc_tracer/objspace_frames'
 
 dir = ARGV.shift || 'objspace_records'
 Dir.mkdir("#{dir}/png") unless File.directory?("#{dir}/png")
 first_gc_count = nil
 last_gc_count = 0
 
-Dir.glob("#{dir}/ppm/*"){|file|
-  cmd = "pnmtopng #{file} > #{dir}/png/#{File.basename(file)}.png"
+color_description = {}
+File.read("#{dir}/color_description.txt").each_line{|line|
+  desc, color = *line.chomp.split(/\t/)
+  color_description[desc] = color
+}
+
+# color index (line number of color_description.txt) <-> RGB
+palette = GC::Tracer::ObjspaceFrames.palette(dir)
+
+GC::Tracer::ObjspaceFrames.each_frame(dir){|file, width, rows, frame|
+  ppm = file
+  if file.end_with?('.diff')
+    # reconstructed from the previous frame
+    ppm = "#{dir}/png/#{File.basename(file, '.diff')}"
+    File.binwrite(ppm, "P6\n#{width} #{rows}\n255\n" + frame.map{|c| palette[c]}.join)
+  end
+
+  cmd = "pnmtopng #{ppm} > #{dir}/png/#{File.basename(ppm)}.png"
   system(cmd)
+  File.unlink(ppm) if ppm != file
   if /(\d{8})\.\d/ =~ file
     c = $1.to_i
     first_gc_count = c if first_gc_count == nil || first_gc_count > c
@@ -16,12 +34,6 @@ Dir.glob("#{dir}/ppm/*"){|file|
   end
 }
 
-color_description = {}
-File.read("#{dir}/color_description.txt").each_line{|line|
-  desc, color = *line.chomp.split(/\t/)
-  color_description[desc] = color
-}
-
 color_description_js = color_description.map{|(k, v)|
   "    {desc: \"#{k}\", \t\"color\": \"#{v}\"}"
 }.join(",\n")
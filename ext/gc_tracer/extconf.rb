@@ -4,6 +4,20 @@ require 'mkmf'
 rusage_members = []
 
 have_func("rb_obj_gc_flags", "ruby/ruby.h");
+have_func("rb_postponed_job_preregister", "ruby/debug.h");
+have_func("rb_gc_location", "ruby/ruby.h");
+have_func("rb_ext_ractor_safe", "ruby/ruby.h");
+have_func("posix_memalign", "stdlib.h");
+
+if have_header('pthread.h') && try_link(%q{
+      int main(int argc, char *argv[]){
+        unsigned long v = 0;
+        __atomic_store_n(&v, __atomic_load_n(&v, __ATOMIC_ACQUIRE) + 1, __ATOMIC_RELEASE);
+        return (int)v;
+      }
+    })
+  $defs << "-DHAVE_GCC_ATOMIC_BUILTINS"
+end
 
 if  try_link(%q{
       #include "ruby/ruby.h"
@@ -42,10 +56,17 @@ if have_header('time.h')
   have_func('clock_gettime')
 end
 
+if have_header('sys/mman.h') && have_func('ftruncate', 'unistd.h')
+  have_func('fopencookie', 'stdio.h') || have_func('funopen', 'stdio.h')
+end
+
+have_header('zlib.h') && have_library('z', 'gzopen')
+have_header('sys/socket.h') && have_header('netdb.h')
+
+# keys of GC.stat and GC.latest_gc_info are taken at runtime,
+# so that the built extension works with other versions of Ruby.
 open("gc_tracer.h", 'w'){|f|
   f.puts '#include "ruby/ruby.h"'
-  f.puts "static VALUE sym_gc_stat[#{GC.stat.keys.size}];"
-  f.puts "static VALUE sym_latest_gc_info[#{GC.latest_gc_info.keys.size}];"
   unless rusage_members.empty?
     f.puts "static VALUE sym_rusage_timeval[2];"
     f.puts "static VALUE sym_rusage[#{rusage_members.length}];" if rusage_members.length > 0
@@ -55,12 +76,6 @@ open("gc_tracer.h", 'w'){|f|
   f.puts "setup_gc_trace_symbols(void)"
   f.puts "{"
     #
-    GC.stat.keys.each.with_index{|k, i|
-      f.puts "    sym_gc_stat[#{i}] = ID2SYM(rb_intern(\"#{k}\"));"
-    }
-    GC.latest_gc_info.keys.each.with_index{|k, i|
-      f.puts "    sym_latest_gc_info[#{i}] = ID2SYM(rb_intern(\"#{k}\"));"
-    }
     unless rusage_members.empty?
       f.puts "    sym_rusage_timeval[0] = ID2SYM(rb_intern(\"ru_utime\"));"
       f.puts "    sym_rusage_timeval[1] = ID2SYM(rb_intern(\"ru_stime\"));"
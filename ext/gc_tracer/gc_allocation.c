@@ -0,0 +1,829 @@
+/*
+ * GC::Tracer.*_allocation_tracing methods
+ *
+ * Aggregate allocations by allocation site (path, line and class)
+ * and ages (number of GCs) of freed objects.
+ *
+ * Live objects are kept in a linear probing table of 16 byte entries
+ * (object, site index and GC count at allocation), and deleted by
+ * backward shifting (without tombstones).
+ *
+ * Hooks do not allocate memory: tables are grown by a postponed job
+ * after GC, and allocation sites and path strings are taken from slabs
+ * and chunks preallocated by the job. Allocations which do not fit
+ * are dropped and counted.
+ */
+
+#include <ruby/ruby.h>
+#include <ruby/debug.h>
+
+#include <string.h>
+
+/* interned path strings */
+struct path_entry {
+    unsigned long hash;
+    long len;
+    char *str; /* in a path chunk */
+};
+
+#define PATH_CHUNK_SIZE (64 * 1024)
+
+struct path_chunk {
+    struct path_chunk *next;
+    size_t used;
+    char buff[PATH_CHUNK_SIZE];
+};
+
+/* ages: 0, 1, 2, 3, 4-7, 8-15, 16-31, 32- */
+#define AGE_BUCKETS 8
+
+/* allocation site */
+struct alloc_site {
+    unsigned int index;
+    const char *path;
+    int line;
+    VALUE klass;
+
+    size_t count;       /* allocated objects */
+    size_t freed_count; /* freed objects */
+    size_t total_age;   /* ages of freed objects */
+    size_t min_age;
+    size_t max_age;
+    size_t ages[AGE_BUCKETS];
+};
+
+#define SITE_SLAB_BITS 10
+#define SITE_SLAB_SIZE (1 << SITE_SLAB_BITS)
+
+struct site_slab {
+    int used;
+    struct alloc_site sites[SITE_SLAB_SIZE];
+};
+
+/* live object */
+struct obj_entry {
+    VALUE obj;           /* OBJ_EMPTY or an object */
+    unsigned int site;   /* index of the allocation site */
+    unsigned int birth;  /* GC count at allocation (modulo 2**32) */
+};
+
+#define OBJ_EMPTY 0
+#define OBJ_REHASH 0x80000000U /* flag of site while rehashing */
+
+/* direct mapped cache: path String object -> interned path */
+#define PATH_CACHE_SIZE 64
+
+struct path_cache_entry {
+    VALUE path;
+    const char *interned;
+};
+
+/* keys of allocation sites */
+enum alloc_key {
+    ALLOC_KEY_PATH  = 0x01,
+    ALLOC_KEY_LINE  = 0x02,
+    ALLOC_KEY_CLASS = 0x04
+};
+
+#define MAX_ALLOC_KEYS 3
+
+/*
+ * Tables are grown by a postponed job after their load factor exceeds 1/2.
+ * Until then hooks keep inserting up to 7/8, and drop (and count)
+ * allocations which do not fit.
+ */
+#define TABLE_GROW(num, capa) ((num) * 2 > (capa))
+#define TABLE_FULL(num, capa) ((num) * 8 >= (capa) * 7)
+
+struct allocation_tracing {
+    int running;
+    int keys[MAX_ALLOC_KEYS]; /* enum alloc_key in order of result keys */
+    int keys_num;
+    int key_flags;
+
+    struct path_entry *paths;
+    unsigned long paths_capa;
+    unsigned long paths_num;
+    struct path_chunk *path_chunks;  /* the current chunk first */
+    struct path_chunk *spare_chunk;
+    struct path_cache_entry path_cache[PATH_CACHE_SIZE];
+
+    struct alloc_site **sites;
+    unsigned long sites_capa;
+    unsigned long sites_num;
+    struct site_slab **slabs; /* site index -> slab */
+    unsigned long slabs_capa;
+    unsigned long slabs_num;
+    struct site_slab *spare_slab;
+
+    struct obj_entry *objs;
+    unsigned long objs_capa;
+    unsigned long objs_num;
+
+    size_t dropped;     /* allocations which are not traced */
+    int grow_scheduled;
+
+    VALUE newobj_hook;
+    VALUE freeobj_hook;
+} allocation_tracing;
+
+static VALUE allocation_tracing_obj; /* to mark classes and paths */
+
+static unsigned long
+hash_mix(unsigned long long h)
+{
+    /* finalizer of splitmix64 */
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (unsigned long)h;
+}
+
+static unsigned long
+hash_str(const char *str, long len)
+{
+    /* FNV-1a */
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    long i;
+    for (i=0; i<len; i++) {
+	h ^= (unsigned char)str[i];
+	h *= 0x100000001b3ULL;
+    }
+    return (unsigned long)h;
+}
+
+static void allocation_tracing_schedule_grow(struct allocation_tracing *at);
+
+/* paths */
+
+/* returns 0 if it can not be allocated (not in hooks) */
+static int
+paths_resize(struct allocation_tracing *at, unsigned long capa)
+{
+    struct path_entry *old = at->paths, *paths;
+    unsigned long old_capa = at->paths_capa, i;
+
+    if ((paths = calloc(capa, sizeof(struct path_entry))) == NULL) return 0;
+    at->paths = paths;
+    at->paths_capa = capa;
+
+    for (i=0; i<old_capa; i++) {
+	if (old[i].str) {
+	    unsigned long j = old[i].hash & (capa - 1);
+	    while (at->paths[j].str) j = (j + 1) & (capa - 1);
+	    at->paths[j] = old[i];
+	}
+    }
+    free(old);
+    return 1;
+}
+
+static char *
+path_chunk_alloc(struct allocation_tracing *at, long len)
+{
+    struct path_chunk *chunk = at->path_chunks;
+    char *str;
+
+    if (len + 1 > PATH_CHUNK_SIZE) return NULL;
+    if (chunk == NULL || chunk->used + len + 1 > PATH_CHUNK_SIZE) {
+	if ((chunk = at->spare_chunk) == NULL) return NULL;
+	at->spare_chunk = NULL;
+	chunk->next = at->path_chunks;
+	at->path_chunks = chunk;
+	allocation_tracing_schedule_grow(at);
+    }
+    str = chunk->buff + chunk->used;
+    chunk->used += len + 1;
+    return str;
+}
+
+/* returns NULL if it can not be interned */
+static const char *
+path_intern(struct allocation_tracing *at, const char *str, long len)
+{
+    unsigned long hash = hash_str(str, len), i;
+    struct path_entry *e;
+
+    for (i = hash & (at->paths_capa - 1); at->paths[i].str; i = (i + 1) & (at->paths_capa - 1)) {
+	e = &at->paths[i];
+	if (e->hash == hash && e->len == len && memcmp(e->str, str, len) == 0) {
+	    return e->str;
+	}
+    }
+
+    if (TABLE_FULL(at->paths_num + 1, at->paths_capa)) return NULL;
+
+    e = &at->paths[i];
+    if ((e->str = path_chunk_alloc(at, len)) == NULL) return NULL;
+    memcpy(e->str, str, len);
+    e->str[len] = '\0';
+    e->hash = hash;
+    e->len = len;
+
+    if (TABLE_GROW(++at->paths_num, at->paths_capa)) allocation_tracing_schedule_grow(at);
+    return e->str;
+}
+
+/* returns 0 if the path can not be interned */
+static int
+path_lookup(struct allocation_tracing *at, VALUE path, const char **interned)
+{
+    struct path_cache_entry *c;
+
+    if (!RB_TYPE_P(path, T_STRING)) {
+	*interned = NULL;
+	return 1;
+    }
+
+    /* cached paths are marked, so that the same object means the same path */
+    c = &at->path_cache[(path >> 3) % PATH_CACHE_SIZE];
+    if (c->path != path) {
+	const char *str = path_intern(at, RSTRING_PTR(path), RSTRING_LEN(path));
+	if (str == NULL) return 0;
+	c->interned = str;
+	c->path = path;
+    }
+    *interned = c->interned;
+    return 1;
+}
+
+/* allocation sites */
+
+static unsigned long
+site_hash(const char *path, int line, VALUE klass)
+{
+    return hash_mix(((unsigned long long)(VALUE)path * 31 + (unsigned long long)line) * 31 + klass);
+}
+
+/* returns NULL if no slab is available */
+static struct alloc_site *
+site_alloc(struct allocation_tracing *at)
+{
+    struct site_slab *slab = at->slabs_num > 0 ? at->slabs[at->slabs_num - 1] : NULL;
+
+    if (slab == NULL || slab->used == SITE_SLAB_SIZE) {
+	if (at->slabs_num == at->slabs_capa || (slab = at->spare_slab) == NULL) return NULL;
+	at->spare_slab = NULL;
+	at->slabs[at->slabs_num++] = slab;
+	allocation_tracing_schedule_grow(at);
+    }
+    slab->sites[slab->used].index = (unsigned int)((at->slabs_num - 1) * SITE_SLAB_SIZE + slab->used);
+    return &slab->sites[slab->used++];
+}
+
+static struct alloc_site *
+site_at(struct allocation_tracing *at, unsigned int index)
+{
+    return &at->slabs[index >> SITE_SLAB_BITS]->sites[index & (SITE_SLAB_SIZE - 1)];
+}
+
+static int
+sites_resize(struct allocation_tracing *at, unsigned long capa)
+{
+    struct alloc_site **old = at->sites, **sites;
+    unsigned long old_capa = at->sites_capa, i;
+
+    if ((sites = calloc(capa, sizeof(struct alloc_site *))) == NULL) return 0;
+    at->sites = sites;
+    at->sites_capa = capa;
+
+    for (i=0; i<old_capa; i++) {
+	struct alloc_site *site = old[i];
+	if (site) {
+	    unsigned long j = site_hash(site->path, site->line, site->klass) & (capa - 1);
+	    while (at->sites[j]) j = (j + 1) & (capa - 1);
+	    at->sites[j] = site;
+	}
+    }
+    free(old);
+    return 1;
+}
+
+/* returns NULL if the table is full */
+static struct alloc_site *
+site_lookup(struct allocation_tracing *at, const char *path, int line, VALUE klass)
+{
+    unsigned long i;
+    struct alloc_site *site;
+
+    for (i = site_hash(path, line, klass) & (at->sites_capa - 1); (site = at->sites[i]) != NULL; i = (i + 1) & (at->sites_capa - 1)) {
+	if (site->path == path && site->line == line && site->klass == klass) {
+	    return site;
+	}
+    }
+
+    if (TABLE_FULL(at->sites_num + 1, at->sites_capa) || (site = site_alloc(at)) == NULL) return NULL;
+    at->sites[i] = site;
+    site->path = path;
+    site->line = line;
+    site->klass = klass;
+
+    if (TABLE_GROW(++at->sites_num, at->sites_capa)) allocation_tracing_schedule_grow(at);
+    return site;
+}
+
+/* live objects */
+
+static unsigned long
+obj_hash(VALUE obj)
+{
+    return hash_mix(obj);
+}
+
+static int
+objs_resize(struct allocation_tracing *at, unsigned long capa)
+{
+    struct obj_entry *old = at->objs, *objs;
+    unsigned long old_capa = at->objs_capa, i;
+
+    if ((objs = calloc(capa, sizeof(struct obj_entry))) == NULL) return 0;
+    at->objs = objs;
+    at->objs_capa = capa;
+
+    for (i=0; i<old_capa; i++) {
+	if (old[i].obj != OBJ_EMPTY) {
+	    unsigned long j = obj_hash(old[i].obj) & (capa - 1);
+	    while (at->objs[j].obj != OBJ_EMPTY) j = (j + 1) & (capa - 1);
+	    at->objs[j] = old[i];
+	}
+    }
+    free(old);
+    return 1;
+}
+
+/*
+ * Rehash entries in place after objects are moved (in GC, without memory).
+ * An entry is moved to the first empty slot or a slot of a not yet
+ * rehashed entry from its home, and the displaced entry continues.
+ * Rehashed entries only pass other rehashed entries, which stay.
+ */
+static void
+objs_rehash(struct allocation_tracing *at)
+{
+    unsigned long mask = at->objs_capa - 1, i;
+
+    for (i=0; i<at->objs_capa; i++) {
+	if (at->objs[i].obj != OBJ_EMPTY) at->objs[i].site |= OBJ_REHASH;
+    }
+    for (i=0; i<at->objs_capa; i++) {
+	struct obj_entry e;
+
+	if (at->objs[i].obj == OBJ_EMPTY || !(at->objs[i].site & OBJ_REHASH)) continue;
+	e = at->objs[i];
+	at->objs[i].obj = OBJ_EMPTY;
+
+	while (1) {
+	    unsigned long j = obj_hash(e.obj) & mask;
+	    struct obj_entry displaced;
+
+	    while (at->objs[j].obj != OBJ_EMPTY && !(at->objs[j].site & OBJ_REHASH)) j = (j + 1) & mask;
+	    displaced = at->objs[j];
+	    e.site &= ~OBJ_REHASH;
+	    at->objs[j] = e;
+	    if (displaced.obj == OBJ_EMPTY) break;
+	    e = displaced;
+	}
+    }
+}
+
+/* returns 0 if the table is full */
+static int
+objs_insert(struct allocation_tracing *at, VALUE obj, struct alloc_site *site, size_t birth)
+{
+    unsigned long i;
+
+    for (i = obj_hash(obj) & (at->objs_capa - 1); at->objs[i].obj != OBJ_EMPTY; i = (i + 1) & (at->objs_capa - 1)) {
+	if (at->objs[i].obj == obj) break; /* freed without freeobj event */
+    }
+    if (at->objs[i].obj == OBJ_EMPTY) {
+	if (TABLE_FULL(at->objs_num + 1, at->objs_capa)) return 0;
+	if (TABLE_GROW(++at->objs_num, at->objs_capa)) allocation_tracing_schedule_grow(at);
+    }
+
+    at->objs[i].obj = obj;
+    at->objs[i].site = site->index;
+    at->objs[i].birth = (unsigned int)birth;
+    return 1;
+}
+
+static struct obj_entry *
+objs_lookup(struct allocation_tracing *at, VALUE obj)
+{
+    unsigned long i;
+
+    for (i = obj_hash(obj) & (at->objs_capa - 1); at->objs[i].obj != OBJ_EMPTY; i = (i + 1) & (at->objs_capa - 1)) {
+	if (at->objs[i].obj == obj) return &at->objs[i];
+    }
+    return NULL;
+}
+
+/* shift following entries back into the hole, instead of leaving a tombstone */
+static void
+objs_delete(struct allocation_tracing *at, struct obj_entry *e)
+{
+    unsigned long mask = at->objs_capa - 1;
+    unsigned long hole = e - at->objs, i = hole;
+
+    for (;;) {
+	unsigned long home;
+
+	i = (i + 1) & mask;
+	if (at->objs[i].obj == OBJ_EMPTY) break;
+
+	/* move the entry if its home is not in (hole, i] (cyclically) */
+	home = obj_hash(at->objs[i].obj) & mask;
+	if (((i - home) & mask) >= ((i - hole) & mask)) {
+	    at->objs[hole] = at->objs[i];
+	    hole = i;
+	}
+    }
+    at->objs[hole].obj = OBJ_EMPTY;
+    at->objs_num--;
+}
+
+static int
+age_bucket(size_t age)
+{
+    int b = 0;
+    if (age < 4) return (int)age;
+    while (age >>= 1) b++;
+    /* 4-7: 2 -> 4 */
+    b += 2;
+    return b < AGE_BUCKETS ? b : AGE_BUCKETS - 1;
+}
+
+/* growing tables (out of hooks) */
+
+/* returns 0 if some of them can not be allocated */
+static int
+allocation_tracing_grow(struct allocation_tracing *at)
+{
+    int ok = 1;
+
+    if (TABLE_GROW(at->paths_num, at->paths_capa)) ok &= paths_resize(at, at->paths_capa * 2);
+    if (TABLE_GROW(at->sites_num, at->sites_capa)) ok &= sites_resize(at, at->sites_capa * 2);
+    if (TABLE_GROW(at->objs_num, at->objs_capa)) ok &= objs_resize(at, at->objs_capa * 2);
+
+    if (at->slabs_num == at->slabs_capa) {
+	unsigned long capa = at->slabs_capa == 0 ? 16 : at->slabs_capa * 2;
+	struct site_slab **slabs = realloc(at->slabs, capa * sizeof(struct site_slab *));
+	if (slabs) {
+	    at->slabs = slabs;
+	    at->slabs_capa = capa;
+	}
+	else ok = 0;
+    }
+    if (at->spare_slab == NULL && (at->spare_slab = calloc(1, sizeof(struct site_slab))) == NULL) ok = 0;
+    if (at->spare_chunk == NULL) {
+	if ((at->spare_chunk = malloc(sizeof(struct path_chunk))) != NULL) at->spare_chunk->used = 0;
+	else ok = 0;
+    }
+    return ok;
+}
+
+static void
+allocation_tracing_grow_job(void *data)
+{
+    struct allocation_tracing *at = (struct allocation_tracing *)data;
+
+    at->grow_scheduled = 0;
+    /* failures are retried at the next schedule, and allocations are dropped until then */
+    if (at->running) allocation_tracing_grow(at);
+}
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t allocation_tracing_grow_job_handle;
+#endif
+
+static void
+allocation_tracing_schedule_grow(struct allocation_tracing *at)
+{
+    if (at->grow_scheduled) return;
+    at->grow_scheduled = 1;
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    rb_postponed_job_trigger(allocation_tracing_grow_job_handle);
+#else
+    rb_postponed_job_register_one(0, allocation_tracing_grow_job, at);
+#endif
+}
+
+/* hooks */
+
+static void
+newobj_i(VALUE tpval, void *data)
+{
+    struct allocation_tracing *at = (struct allocation_tracing *)data;
+    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
+    VALUE obj = rb_tracearg_object(tparg);
+    const char *path = NULL;
+    int line = 0;
+    VALUE klass = Qnil;
+    struct alloc_site *site;
+
+    if ((at->key_flags & ALLOC_KEY_PATH) && !path_lookup(at, rb_tracearg_path(tparg), &path)) {
+	at->dropped++;
+	return;
+    }
+    if (at->key_flags & ALLOC_KEY_LINE) line = FIX2INT(rb_tracearg_lineno(tparg));
+    if (at->key_flags & ALLOC_KEY_CLASS) {
+	klass = RBASIC_CLASS(obj);
+	if (klass == 0) klass = Qnil; /* hidden objects */
+    }
+
+    if ((site = site_lookup(at, path, line, klass)) == NULL) {
+	at->dropped++;
+	return;
+    }
+    site->count++;
+    if (!objs_insert(at, obj, site, rb_gc_count())) {
+	/* counted, but the age is not traced */
+	at->dropped++;
+    }
+}
+
+static void
+freeobj_i(VALUE tpval, void *data)
+{
+    struct allocation_tracing *at = (struct allocation_tracing *)data;
+    VALUE obj = rb_tracearg_object(rb_tracearg_from_tracepoint(tpval));
+    struct obj_entry *e = objs_lookup(at, obj);
+
+    if (e) {
+	struct alloc_site *site = site_at(at, e->site);
+	size_t age = (unsigned int)((unsigned int)rb_gc_count() - e->birth);
+
+	if (site->freed_count == 0 || age < site->min_age) site->min_age = age;
+	if (age > site->max_age) site->max_age = age;
+	site->total_age += age;
+	site->ages[age_bucket(age)]++;
+	site->freed_count++;
+	objs_delete(at, e);
+    }
+}
+
+/* data object to mark classes and paths */
+
+static void
+allocation_tracing_mark(void *ptr)
+{
+    struct allocation_tracing *at = (struct allocation_tracing *)ptr;
+    unsigned long j;
+    int i;
+
+    for (i=0; i<PATH_CACHE_SIZE; i++) {
+	if (at->path_cache[i].path) rb_gc_mark(at->path_cache[i].path);
+    }
+    for (j=0; j<at->slabs_num; j++) {
+	struct site_slab *slab = at->slabs[j];
+	for (i=0; i<slab->used; i++) {
+	    rb_gc_mark(slab->sites[i].klass);
+	}
+    }
+}
+
+#ifdef HAVE_RB_GC_LOCATION
+/* objects are not marked by the tracer, but they can be moved */
+static void
+allocation_tracing_compact(void *ptr)
+{
+    struct allocation_tracing *at = (struct allocation_tracing *)ptr;
+    unsigned long i;
+    int moved = 0;
+
+    for (i=0; i<at->objs_capa; i++) {
+	VALUE obj = at->objs[i].obj;
+	if (obj != OBJ_EMPTY) {
+	    VALUE new_obj = rb_gc_location(obj);
+	    if (new_obj != obj) {
+		at->objs[i].obj = new_obj;
+		moved = 1;
+	    }
+	}
+    }
+    if (moved) objs_rehash(at);
+}
+#endif
+
+static const rb_data_type_t allocation_tracing_type = {
+    "GC::Tracer::allocation_tracing",
+    {allocation_tracing_mark, NULL, NULL,
+#ifdef HAVE_RB_GC_LOCATION
+     allocation_tracing_compact,
+#else
+     NULL,
+#endif
+     {0}},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+allocation_tracing_free(struct allocation_tracing *at)
+{
+    unsigned long i;
+
+    while (at->path_chunks) {
+	struct path_chunk *chunk = at->path_chunks;
+	at->path_chunks = chunk->next;
+	free(chunk);
+    }
+    free(at->spare_chunk);
+    free(at->paths);
+    free(at->sites);
+    free(at->objs);
+    for (i=0; i<at->slabs_num; i++) free(at->slabs[i]);
+    free(at->slabs);
+    free(at->spare_slab);
+
+    at->paths = NULL;
+    at->paths_capa = at->paths_num = 0;
+    at->spare_chunk = NULL;
+    at->spare_slab = NULL;
+    MEMZERO(at->path_cache, struct path_cache_entry, PATH_CACHE_SIZE);
+    at->sites = NULL;
+    at->sites_capa = at->sites_num = 0;
+    at->slabs = NULL;
+    at->slabs_capa = at->slabs_num = 0;
+    at->objs = NULL;
+    at->objs_capa = at->objs_num = 0;
+}
+
+/* methods */
+
+static VALUE
+key_sym(int key)
+{
+    switch (key) {
+      case ALLOC_KEY_PATH:  return ID2SYM(rb_intern("path"));
+      case ALLOC_KEY_LINE:  return ID2SYM(rb_intern("line"));
+      case ALLOC_KEY_CLASS: return ID2SYM(rb_intern("class"));
+    }
+    return Qnil;
+}
+
+static VALUE
+gc_tracer_setup_allocation_tracing(int argc, VALUE *argv, VALUE self)
+{
+    struct allocation_tracing *at = &allocation_tracing;
+    VALUE keys;
+    int i;
+
+    if (at->running) {
+	rb_raise(rb_eRuntimeError, "can not change keys while allocation tracing.");
+    }
+
+    rb_scan_args(argc, argv, "01", &keys);
+    if (NIL_P(keys)) keys = rb_ary_new3(2, ID2SYM(rb_intern("path")), ID2SYM(rb_intern("line")));
+    keys = rb_check_array_type(keys);
+    if (NIL_P(keys) || RARRAY_LEN(keys) > MAX_ALLOC_KEYS) {
+	rb_raise(rb_eArgError, "keys should be an array of :path, :line and :class.");
+    }
+
+    at->keys_num = 0;
+    at->key_flags = 0;
+    for (i=0; i<RARRAY_LEN(keys); i++) {
+	VALUE sym = RARRAY_AREF(keys, i);
+	int key;
+
+	if (sym == ID2SYM(rb_intern("path"))) key = ALLOC_KEY_PATH;
+	else if (sym == ID2SYM(rb_intern("line"))) key = ALLOC_KEY_LINE;
+	else if (sym == ID2SYM(rb_intern("class"))) key = ALLOC_KEY_CLASS;
+	else rb_raise(rb_eArgError, "unknown key: %"PRIsVALUE, sym);
+
+	if (at->key_flags & key) rb_raise(rb_eArgError, "duplicated key: %"PRIsVALUE, sym);
+	at->key_flags |= key;
+	at->keys[at->keys_num++] = key;
+    }
+
+    return self;
+}
+
+static VALUE
+gc_tracer_header_of_allocation_tracing(VALUE self)
+{
+    struct allocation_tracing *at = &allocation_tracing;
+    VALUE header = rb_ary_new();
+    int i;
+
+    for (i=0; i<at->keys_num; i++) rb_ary_push(header, key_sym(at->keys[i]));
+    rb_ary_push(header, ID2SYM(rb_intern("count")));
+    rb_ary_push(header, ID2SYM(rb_intern("freed_count")));
+    rb_ary_push(header, ID2SYM(rb_intern("total_age")));
+    rb_ary_push(header, ID2SYM(rb_intern("min_age")));
+    rb_ary_push(header, ID2SYM(rb_intern("max_age")));
+    for (i=0; i<AGE_BUCKETS; i++) {
+	static const char *const names[AGE_BUCKETS] = {
+	    "age_0", "age_1", "age_2", "age_3", "age_4_7", "age_8_15", "age_16_31", "age_32_"
+	};
+	rb_ary_push(header, ID2SYM(rb_intern(names[i])));
+    }
+    return header;
+}
+
+static VALUE
+gc_tracer_start_allocation_tracing(VALUE self)
+{
+    struct allocation_tracing *at = &allocation_tracing;
+
+    if (at->running) {
+	rb_raise(rb_eRuntimeError, "allocation tracing is already running.");
+    }
+
+    at->dropped = 0;
+    at->grow_scheduled = 0;
+    if (!paths_resize(at, 64) || !sites_resize(at, 1024) || !objs_resize(at, 1024 * 64) ||
+	!allocation_tracing_grow(at)) {
+	allocation_tracing_free(at);
+	rb_memerror();
+    }
+
+    if (at->newobj_hook == 0) {
+	at->newobj_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, newobj_i, at);
+	at->freeobj_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_FREEOBJ, freeobj_i, at);
+	rb_gc_register_mark_object(at->newobj_hook);
+	rb_gc_register_mark_object(at->freeobj_hook);
+    }
+
+    at->running = 1;
+    rb_tracepoint_enable(at->newobj_hook);
+    rb_tracepoint_enable(at->freeobj_hook);
+
+    return self;
+}
+
+static VALUE
+site_result(struct allocation_tracing *at, struct alloc_site *site, VALUE result)
+{
+    VALUE key = rb_ary_new();
+    VALUE val = rb_ary_new();
+    int i;
+
+    for (i=0; i<at->keys_num; i++) {
+	switch (at->keys[i]) {
+	  case ALLOC_KEY_PATH:
+	    rb_ary_push(key, site->path ? rb_str_new_cstr(site->path) : Qnil);
+	    break;
+	  case ALLOC_KEY_LINE:
+	    rb_ary_push(key, INT2FIX(site->line));
+	    break;
+	  case ALLOC_KEY_CLASS:
+	    rb_ary_push(key, site->klass);
+	    break;
+	}
+    }
+
+    rb_ary_push(val, SIZET2NUM(site->count));
+    rb_ary_push(val, SIZET2NUM(site->freed_count));
+    rb_ary_push(val, SIZET2NUM(site->total_age));
+    rb_ary_push(val, site->freed_count > 0 ? SIZET2NUM(site->min_age) : Qnil);
+    rb_ary_push(val, site->freed_count > 0 ? SIZET2NUM(site->max_age) : Qnil);
+    for (i=0; i<AGE_BUCKETS; i++) rb_ary_push(val, SIZET2NUM(site->ages[i]));
+
+    rb_hash_aset(result, key, val);
+    return result;
+}
+
+static VALUE
+gc_tracer_stop_allocation_tracing(VALUE self)
+{
+    struct allocation_tracing *at = &allocation_tracing;
+    VALUE result;
+    unsigned long i;
+
+    if (at->running == 0) {
+	rb_raise(rb_eRuntimeError, "allocation tracing is not running.");
+    }
+
+    rb_tracepoint_disable(at->newobj_hook);
+    rb_tracepoint_disable(at->freeobj_hook);
+    at->running = 0;
+
+    /* the result hash is allocated without hooks */
+    result = rb_hash_new();
+    for (i=0; i<at->sites_capa; i++) {
+	if (at->sites[i]) site_result(at, at->sites[i], result);
+    }
+
+    if (at->dropped > 0) {
+	rb_warn("gc_tracer: %"PRIuSIZE" allocations were not traced because tables were full.", at->dropped);
+    }
+    allocation_tracing_free(at);
+    return result;
+}
+
+void
+Init_gc_tracer_allocation(VALUE mod)
+{
+    rb_define_module_function(mod, "setup_allocation_tracing", gc_tracer_setup_allocation_tracing, -1);
+    rb_define_module_function(mod, "start_allocation_tracing", gc_tracer_start_allocation_tracing, 0);
+    rb_define_module_function(mod, "stop_allocation_tracing", gc_tracer_stop_allocation_tracing, 0);
+    rb_define_module_function(mod, "header_of_allocation_tracing", gc_tracer_header_of_allocation_tracing, 0);
+
+    allocation_tracing_obj = TypedData_Wrap_Struct(0, &allocation_tracing_type, &allocation_tracing);
+    rb_gc_register_mark_object(allocation_tracing_obj);
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    allocation_tracing_grow_job_handle = rb_postponed_job_preregister(0, allocation_tracing_grow_job, &allocation_tracing);
+#endif
+
+    /* default setup */
+    gc_tracer_setup_allocation_tracing(0, NULL, Qnil);
+}
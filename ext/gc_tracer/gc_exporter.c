@@ -0,0 +1,557 @@
+/*
+ * GC::Tracer.start_exporter_ and stop_exporter methods
+ *
+ * Send aggregated GC metrics to a StatsD server by UDP from a native
+ * thread every interval:
+ *   GC counts by gc_by and major_by (counted by a GC hook),
+ *   pause histograms (if GC::Tracer.start_pause_histogram is called)
+ *   and custom fields.
+ * GC hooks only increment counters and the thread does not use Ruby API,
+ * so exporting never runs on Ruby threads or in GC.
+ */
+
+#include <ruby/ruby.h>
+#include <ruby/debug.h>
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_GCC_ATOMIC_BUILTINS) && defined(HAVE_SYS_SOCKET_H) && defined(HAVE_NETDB_H)
+#define USE_EXPORTER 1
+#include <pthread.h>
+#include <ruby/thread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#else
+#define USE_EXPORTER 0
+#endif
+
+#if USE_EXPORTER
+#ifdef HAVE_CLOCK_GETTIME
+/* in gc_histogram.c */
+int gc_tracer_histogram_buckets(void);
+int gc_tracer_histogram_copy(int kind, unsigned long long *counts, unsigned long long *total);
+unsigned long long gc_tracer_histogram_bucket_max(int index);
+#define EXPORTER_HISTOGRAMS 3
+#endif
+
+/* in gc_logging.c */
+int gc_tracer_custom_field_slot(VALUE name);
+int gc_tracer_custom_field_read(ID name, int *slot, long *value);
+
+#define ATOMIC_LOAD(var)       __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+#define ATOMIC_INC(var)        __atomic_add_fetch(&(var), 1, __ATOMIC_RELAXED)
+
+#define EXPORTER_MAX_SYMS     32
+/* fits in an Ethernet MTU with IP and UDP headers */
+#define EXPORTER_DATAGRAM_SIZE 1432
+
+/* counts of GCs for each value of latest_gc_info (Qfalse is "minor") */
+struct sym_counter {
+    VALUE sym;
+    const char *name;
+    unsigned long long count;
+    unsigned long long exported;
+};
+
+struct sym_counters {
+    struct sym_counter counters[EXPORTER_MAX_SYMS];
+    int num;
+};
+
+static struct exporter {
+    int running;
+    int hook_enabled;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup_cond;
+    int stop;
+
+    int fd;
+    unsigned long interval_msec;
+    char *prefix;
+
+    /* by the GC hook */
+    unsigned long long gc_count;
+    unsigned long long gc_count_exported;
+    struct sym_counters gc_by;
+    struct sym_counters major_by;
+
+    /* fields are resolved by names at each flush (they can be removed) */
+    int custom_fields_num;
+    ID *custom_field_ids;
+    int *custom_field_slots; /* hints */
+    char **custom_field_names;
+
+#ifdef HAVE_CLOCK_GETTIME
+    int histogram_buckets;
+    unsigned long long *histogram_counts; /* current copy */
+    unsigned long long *histogram_exported[EXPORTER_HISTOGRAMS];
+    unsigned long long histogram_exported_total[EXPORTER_HISTOGRAMS];
+#endif
+
+    char datagram[EXPORTER_DATAGRAM_SIZE];
+    size_t len;
+    unsigned long long datagrams;
+    unsigned long long send_errors;
+} exporter;
+
+static VALUE exporter_hook;
+static VALUE sym_gc_by, sym_major_by;
+
+/* without Ruby API except registration of a new symbol */
+static void
+sym_counter_count(struct sym_counters *counters, VALUE sym)
+{
+    int i, n = counters->num;
+
+    for (i=0; i<n; i++) {
+	if (counters->counters[i].sym == sym) {
+	    ATOMIC_INC(counters->counters[i].count);
+	    return;
+	}
+    }
+    if (n < EXPORTER_MAX_SYMS && (sym == Qfalse || STATIC_SYM_P(sym))) {
+	struct sym_counter *counter = &counters->counters[n];
+	counter->sym = sym;
+	counter->name = strdup(sym == Qfalse ? "minor" : rb_id2name(SYM2ID(sym)));
+	counter->count = 1;
+	counter->exported = 0;
+	ATOMIC_STORE(counters->num, n + 1);
+    }
+}
+
+static void
+exporter_end_sweep(VALUE tpval, void *data)
+{
+    struct exporter *ex = (struct exporter *)data;
+    VALUE major_by = rb_gc_latest_gc_info(sym_major_by);
+
+    ATOMIC_INC(ex->gc_count);
+    sym_counter_count(&ex->gc_by, rb_gc_latest_gc_info(sym_gc_by));
+    sym_counter_count(&ex->major_by, NIL_P(major_by) ? Qfalse : major_by);
+}
+
+/* the following functions are called by the exporter thread */
+
+static void
+exporter_send(struct exporter *ex)
+{
+    if (ex->len == 0) return;
+    if (send(ex->fd, ex->datagram, ex->len, 0) < 0) ex->send_errors++;
+    else ex->datagrams++;
+    ex->len = 0;
+}
+
+/* append "prefix.name:value|type" and send the datagram when it is full */
+static void
+exporter_metric(struct exporter *ex, const char *name, const char *value, const char *type)
+{
+    char line[EXPORTER_DATAGRAM_SIZE];
+    int len = snprintf(line, sizeof(line), "%s.%s:%s|%s", ex->prefix, name, value, type);
+
+    if (len < 0 || len >= (int)sizeof(line)) return;
+    if (ex->len > 0 && ex->len + 1 + len > sizeof(ex->datagram)) exporter_send(ex);
+    if (ex->len > 0) ex->datagram[ex->len++] = '\n';
+    memcpy(ex->datagram + ex->len, line, len);
+    ex->len += len;
+}
+
+static void
+exporter_counter(struct exporter *ex, const char *name, unsigned long long v)
+{
+    char value[32];
+    snprintf(value, sizeof(value), "%llu", v);
+    exporter_metric(ex, name, value, "c");
+}
+
+static void
+exporter_gauge(struct exporter *ex, const char *name, long v)
+{
+    char value[32];
+
+    if (v < 0) {
+	/* a signed value changes the gauge */
+	exporter_metric(ex, name, "0", "g");
+    }
+    snprintf(value, sizeof(value), "%ld", v);
+    exporter_metric(ex, name, value, "g");
+}
+
+static void
+exporter_msec(struct exporter *ex, const char *name, const char *type, unsigned long long nsec)
+{
+    char value[32];
+    snprintf(value, sizeof(value), "%.3f", nsec / 1e6);
+    exporter_metric(ex, name, value, type);
+}
+
+static void
+exporter_sym_counters(struct exporter *ex, struct sym_counters *counters, const char *kind)
+{
+    int i, n = ATOMIC_LOAD(counters->num);
+    char name[256];
+
+    for (i=0; i<n; i++) {
+	struct sym_counter *counter = &counters->counters[i];
+	unsigned long long count = ATOMIC_LOAD(counter->count);
+
+	if (count != counter->exported) {
+	    snprintf(name, sizeof(name), "gc.%s.%s", kind, counter->name);
+	    exporter_counter(ex, name, count - counter->exported);
+	    counter->exported = count;
+	}
+    }
+}
+
+#ifdef HAVE_CLOCK_GETTIME
+/* differences from the last export, as a histogram */
+static void
+exporter_histogram(struct exporter *ex, int kind, const char *kind_name)
+{
+    static const double quantiles[] = {0.50, 0.90, 0.99};
+    static const char *const quantile_names[] = {"p50", "p90", "p99"};
+    unsigned long long *counts = ex->histogram_counts;
+    unsigned long long *exported = ex->histogram_exported[kind];
+    unsigned long long total, count = 0, sum = 0;
+    int i, q = 0, reset = 0, last = -1;
+    char name[64];
+
+    if (!gc_tracer_histogram_copy(kind, counts, &total)) return;
+
+    for (i=0; i<ex->histogram_buckets; i++) {
+	if (counts[i] < exported[i]) reset = 1;
+    }
+    if (reset || total < ex->histogram_exported_total[kind]) {
+	/* reset by GC::Tracer.pause_histogram(reset: true) */
+	memset(exported, 0, sizeof(unsigned long long) * ex->histogram_buckets);
+	ex->histogram_exported_total[kind] = 0;
+    }
+    for (i=0; i<ex->histogram_buckets; i++) {
+	unsigned long long c = counts[i];
+	counts[i] -= exported[i];
+	exported[i] = c;
+	count += counts[i];
+	if (counts[i] > 0) last = i;
+    }
+    if (count == 0) return;
+
+    snprintf(name, sizeof(name), "%s.count", kind_name);
+    exporter_counter(ex, name, count);
+    snprintf(name, sizeof(name), "%s.time", kind_name);
+    exporter_msec(ex, name, "c", total - ex->histogram_exported_total[kind]);
+    ex->histogram_exported_total[kind] = total;
+
+    for (i=0; i<ex->histogram_buckets && q < 3; i++) {
+	sum += counts[i];
+	while (q < 3 && sum >= (unsigned long long)(quantiles[q] * count + 0.5)) {
+	    snprintf(name, sizeof(name), "%s.%s", kind_name, quantile_names[q++]);
+	    exporter_msec(ex, name, "g", gc_tracer_histogram_bucket_max(i));
+	}
+    }
+    snprintf(name, sizeof(name), "%s.max", kind_name);
+    exporter_msec(ex, name, "g", gc_tracer_histogram_bucket_max(last));
+}
+#endif
+
+static void
+exporter_flush(struct exporter *ex)
+{
+    unsigned long long gc_count = ATOMIC_LOAD(ex->gc_count);
+    int i;
+
+    if (gc_count != ex->gc_count_exported) {
+	exporter_counter(ex, "gc.count", gc_count - ex->gc_count_exported);
+	ex->gc_count_exported = gc_count;
+    }
+    exporter_sym_counters(ex, &ex->gc_by, "gc_by");
+    exporter_sym_counters(ex, &ex->major_by, "major_by");
+#ifdef HAVE_CLOCK_GETTIME
+    exporter_histogram(ex, 0, "gc.pause");
+    exporter_histogram(ex, 1, "gc.mark");
+    exporter_histogram(ex, 2, "gc.sweep");
+#endif
+    for (i=0; i<ex->custom_fields_num; i++) {
+	char name[256];
+	long value;
+
+	if (gc_tracer_custom_field_read(ex->custom_field_ids[i], &ex->custom_field_slots[i], &value)) {
+	    snprintf(name, sizeof(name), "custom.%s", ex->custom_field_names[i]);
+	    exporter_gauge(ex, name, value);
+	}
+    }
+    exporter_send(ex);
+}
+
+static void *
+exporter_main(void *ptr)
+{
+    struct exporter *ex = (struct exporter *)ptr;
+
+    while (1) {
+	int stop;
+
+	pthread_mutex_lock(&ex->lock);
+	if (!ex->stop) {
+	    struct timeval tv;
+	    struct timespec ts;
+
+	    gettimeofday(&tv, NULL);
+	    ts.tv_sec = tv.tv_sec + ex->interval_msec / 1000;
+	    ts.tv_nsec = (tv.tv_usec + (ex->interval_msec % 1000) * 1000) * 1000;
+	    if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	    }
+	    pthread_cond_timedwait(&ex->wakeup_cond, &ex->lock, &ts);
+	}
+	stop = ex->stop;
+	pthread_mutex_unlock(&ex->lock);
+
+	/* the last flush at stop */
+	exporter_flush(ex);
+	if (stop) break;
+    }
+    return NULL;
+}
+
+/* the following functions are called by Ruby threads */
+
+static void
+exporter_free(struct exporter *ex)
+{
+    int i;
+
+    if (ex->fd >= 0) close(ex->fd);
+    ex->fd = -1;
+    for (i=0; i<ex->custom_fields_num; i++) xfree(ex->custom_field_names[i]);
+    xfree(ex->custom_field_names);
+    xfree(ex->custom_field_ids);
+    xfree(ex->custom_field_slots);
+    ex->custom_field_names = NULL;
+    ex->custom_field_ids = NULL;
+    ex->custom_field_slots = NULL;
+    ex->custom_fields_num = 0;
+    xfree(ex->prefix);
+    ex->prefix = NULL;
+#ifdef HAVE_CLOCK_GETTIME
+    xfree(ex->histogram_counts);
+    ex->histogram_counts = NULL;
+    for (i=0; i<EXPORTER_HISTOGRAMS; i++) {
+	xfree(ex->histogram_exported[i]);
+	ex->histogram_exported[i] = NULL;
+    }
+#endif
+}
+
+static int
+exporter_connect(VALUE host, VALUE port)
+{
+    struct addrinfo hints, *res, *ai;
+    char port_str[16];
+    int fd = -1, err;
+
+    MEMZERO(&hints, struct addrinfo, 1);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(port_str, sizeof(port_str), "%d", NUM2INT(port));
+
+    if ((err = getaddrinfo(StringValueCStr(host), port_str, &hints, &res)) != 0) {
+	rb_raise(rb_eArgError, "getaddrinfo: %s", gai_strerror(err));
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) continue;
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) rb_sys_fail("connect");
+    return fd;
+}
+
+static char *
+exporter_strdup(VALUE str)
+{
+    const char *ptr = StringValueCStr(str);
+    size_t len = strlen(ptr);
+    char *dup = ALLOC_N(char, len + 1);
+
+    memcpy(dup, ptr, len + 1);
+    return dup;
+}
+
+static void
+exporter_setup_custom_fields(struct exporter *ex, VALUE names)
+{
+    long i, n = RARRAY_LEN(names);
+
+    ex->custom_field_ids = ALLOC_N(ID, n);
+    ex->custom_field_slots = ALLOC_N(int, n);
+    ex->custom_field_names = ALLOC_N(char *, n);
+    for (i=0; i<n; i++) {
+	VALUE name = rb_sym2str(rb_to_symbol(RARRAY_AREF(names, i)));
+	ex->custom_field_slots[i] = gc_tracer_custom_field_slot(name);
+	ex->custom_field_ids[i] = rb_to_id(name);
+	ex->custom_field_names[i] = exporter_strdup(name);
+	ex->custom_fields_num = (int)i + 1;
+    }
+}
+
+static VALUE
+exporter_setup(VALUE data)
+{
+    struct exporter *ex = &exporter;
+    VALUE *args = (VALUE *)data;
+    int i;
+
+    ex->prefix = exporter_strdup(args[3]);
+    exporter_setup_custom_fields(ex, rb_convert_type(args[4], T_ARRAY, "Array", "to_ary"));
+
+#ifdef HAVE_CLOCK_GETTIME
+    ex->histogram_buckets = gc_tracer_histogram_buckets();
+    ex->histogram_counts = ALLOC_N(unsigned long long, ex->histogram_buckets);
+    for (i=0; i<EXPORTER_HISTOGRAMS; i++) {
+	ex->histogram_exported[i] = ZALLOC_N(unsigned long long, ex->histogram_buckets);
+	ex->histogram_exported_total[i] = 0;
+	/* export only GCs after start */
+	gc_tracer_histogram_copy(i, ex->histogram_exported[i], &ex->histogram_exported_total[i]);
+    }
+#endif
+    ex->fd = exporter_connect(args[0], args[1]);
+    return Qnil;
+}
+
+static VALUE
+exporter_setup_failed(VALUE data, VALUE err)
+{
+    exporter_free(&exporter);
+    rb_exc_raise(err);
+    return Qnil; /* unreachable */
+}
+
+/* interval: msec, custom_fields: names of custom fields */
+static VALUE
+gc_tracer_start_exporter(VALUE self, VALUE host, VALUE port, VALUE interval, VALUE prefix, VALUE custom_fields)
+{
+    struct exporter *ex = &exporter;
+    VALUE args[5];
+    int i;
+
+    if (ex->running) {
+	rb_raise(rb_eRuntimeError, "GC exporter is already running.");
+    }
+    if (NUM2LONG(interval) <= 0) {
+	rb_raise(rb_eArgError, "interval should be positive: %ld", NUM2LONG(interval));
+    }
+
+    /* left by the parent process */
+    exporter_free(ex);
+
+    args[0] = host; args[1] = port; args[2] = interval; args[3] = prefix; args[4] = custom_fields;
+    rb_rescue2(exporter_setup, (VALUE)args, exporter_setup_failed, Qnil, rb_eException, (VALUE)0);
+
+    ex->interval_msec = NUM2ULONG(interval);
+    ex->len = 0;
+    ex->datagrams = ex->send_errors = 0;
+    ex->gc_count_exported = ATOMIC_LOAD(ex->gc_count);
+    for (i=0; i<ex->gc_by.num; i++) ex->gc_by.counters[i].exported = ex->gc_by.counters[i].count;
+    for (i=0; i<ex->major_by.num; i++) ex->major_by.counters[i].exported = ex->major_by.counters[i].count;
+
+    ex->stop = 0;
+    pthread_mutex_init(&ex->lock, NULL);
+    pthread_cond_init(&ex->wakeup_cond, NULL);
+    if (pthread_create(&ex->thread, NULL, exporter_main, ex) != 0) {
+	pthread_cond_destroy(&ex->wakeup_cond);
+	pthread_mutex_destroy(&ex->lock);
+	exporter_free(ex);
+	rb_sys_fail("pthread_create");
+    }
+    ex->running = 1;
+
+    if (!ex->hook_enabled) {
+	rb_tracepoint_enable(exporter_hook);
+	ex->hook_enabled = 1;
+    }
+    return self;
+}
+
+static void *
+exporter_stop_i(void *ptr)
+{
+    struct exporter *ex = (struct exporter *)ptr;
+
+    pthread_mutex_lock(&ex->lock);
+    ex->stop = 1;
+    pthread_cond_signal(&ex->wakeup_cond);
+    pthread_mutex_unlock(&ex->lock);
+
+    pthread_join(ex->thread, NULL);
+    return NULL;
+}
+
+static VALUE
+gc_tracer_stop_exporter(VALUE self)
+{
+    struct exporter *ex = &exporter;
+
+    if (ex->hook_enabled) {
+	rb_tracepoint_disable(exporter_hook);
+	ex->hook_enabled = 0;
+    }
+    if (ex->running) {
+	rb_thread_call_without_gvl(exporter_stop_i, ex, NULL, NULL);
+	pthread_cond_destroy(&ex->wakeup_cond);
+	pthread_mutex_destroy(&ex->lock);
+	ex->running = 0;
+	exporter_free(ex);
+    }
+    return self;
+}
+
+static VALUE
+gc_tracer_exporter_stats(VALUE self)
+{
+    struct exporter *ex = &exporter;
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("running")), ex->running ? Qtrue : Qfalse);
+    rb_hash_aset(hash, ID2SYM(rb_intern("datagrams")), ULL2NUM(ATOMIC_LOAD(ex->datagrams)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("send_errors")), ULL2NUM(ATOMIC_LOAD(ex->send_errors)));
+    return hash;
+}
+
+/* the thread does not exist in a child process */
+static void
+exporter_atfork_child(void)
+{
+    struct exporter *ex = &exporter;
+
+    if (ex->running) {
+	ex->running = 0;
+	if (ex->fd >= 0) close(ex->fd);
+	ex->fd = -1;
+    }
+}
+#endif /* USE_EXPORTER */
+
+void
+Init_gc_tracer_exporter(VALUE mod)
+{
+#if USE_EXPORTER
+    rb_define_module_function(mod, "start_exporter_", gc_tracer_start_exporter, 5);
+    rb_define_module_function(mod, "stop_exporter", gc_tracer_stop_exporter, 0);
+    rb_define_module_function(mod, "exporter_stats", gc_tracer_exporter_stats, 0);
+
+    sym_gc_by = ID2SYM(rb_intern("gc_by"));
+    sym_major_by = ID2SYM(rb_intern("major_by"));
+    exporter.fd = -1;
+    exporter_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_END_SWEEP, exporter_end_sweep, &exporter);
+    rb_gc_register_mark_object(exporter_hook);
+    pthread_atfork(NULL, NULL, exporter_atfork_child);
+#endif
+}
@@ -0,0 +1,329 @@
+/*
+ * GC::Tracer.*_pause_histogram methods
+ *
+ * Aggregate GC pause time, marking time and sweeping time into
+ * log-bucketed histograms (similar to HDR histogram) without logging.
+ */
+
+#include <ruby/ruby.h>
+#include <ruby/debug.h>
+
+#include <time.h>
+
+#ifdef HAVE_CLOCK_GETTIME
+typedef unsigned long long nsec_t;
+
+static nsec_t
+now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (nsec_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Values less than HIST_SUB_BUCKETS are counted exactly.
+ * Other values are counted in HIST_SUB_BUCKETS buckets per power of two,
+ * so relative error is less than 1/HIST_SUB_BUCKETS.
+ */
+#define HIST_SUB_BITS    4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long count;
+    nsec_t total;
+    nsec_t min;
+    nsec_t max;
+};
+
+static int
+msb(nsec_t v)
+{
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(v);
+#else
+    int i = 0;
+    while (v >>= 1) i++;
+    return i;
+#endif
+}
+
+static int
+hist_index(nsec_t v)
+{
+    int m;
+
+    if (v < HIST_SUB_BUCKETS) return (int)v;
+    m = msb(v);
+    return (m - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + (int)((v >> (m - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* the highest value counted in the bucket */
+static nsec_t
+hist_bucket_max(int index)
+{
+    int group = index / HIST_SUB_BUCKETS;
+    int sub = index % HIST_SUB_BUCKETS;
+
+    if (group == 0) return sub;
+    return (((nsec_t)HIST_SUB_BUCKETS + sub) << (group - 1)) + (((nsec_t)1 << (group - 1)) - 1);
+}
+
+static void
+hist_add(struct histogram *hist, nsec_t v)
+{
+    hist->counts[hist_index(v)]++;
+    if (hist->count == 0 || v < hist->min) hist->min = v;
+    if (v > hist->max) hist->max = v;
+    hist->count++;
+    hist->total += v;
+}
+
+static nsec_t
+hist_percentile(const struct histogram *hist, double q)
+{
+    unsigned long long target = (unsigned long long)(q * hist->count + 0.5), sum = 0;
+    int i;
+
+    if (target == 0) target = 1;
+    for (i=0; i<HIST_BUCKETS; i++) {
+	sum += hist->counts[i];
+	if (sum >= target) {
+	    nsec_t v = hist_bucket_max(i);
+	    return v > hist->max ? hist->max : v;
+	}
+    }
+    return hist->max;
+}
+
+enum gc_phase {
+    PHASE_NONE,
+    PHASE_MARKING,
+    PHASE_SWEEPING
+};
+
+struct pause_histogram {
+    int enabled;
+
+    struct histogram pause; /* time of each GC step (or each GC without enter/exit events) */
+    struct histogram mark;  /* time of marking phase of each GC */
+    struct histogram sweep; /* time of sweeping phase of each GC */
+
+    enum gc_phase phase;
+    nsec_t gc_start;
+    nsec_t phase_start; /* last boundary in the current GC step */
+    nsec_t phase_time;  /* accumulated time of the current phase */
+} pause_histogram;
+
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+#define HIST_HOOKS 5
+#else
+#define HIST_HOOKS 3
+#endif
+
+static VALUE histogram_hooks[HIST_HOOKS];
+
+/*
+ * With enter/exit events, only time between enter and exit is counted,
+ * so incremental marking and lazy sweeping steps are summed for each phase.
+ * Without them, phase time is wall-clock time between events.
+ */
+
+static void
+hist_start(VALUE tpval, void *data)
+{
+    struct pause_histogram *ph = (struct pause_histogram *)data;
+    nsec_t now = now_nsec();
+
+    ph->phase = PHASE_MARKING;
+    ph->gc_start = ph->phase_start = now;
+    ph->phase_time = 0;
+}
+
+static void
+hist_end_mark(VALUE tpval, void *data)
+{
+    struct pause_histogram *ph = (struct pause_histogram *)data;
+    nsec_t now = now_nsec();
+
+    /* ignore GC started before enabling */
+    if (ph->phase == PHASE_MARKING) {
+	hist_add(&ph->mark, ph->phase_time + (now - ph->phase_start));
+	ph->phase = PHASE_SWEEPING;
+	ph->phase_start = now;
+	ph->phase_time = 0;
+    }
+}
+
+static void
+hist_end_sweep(VALUE tpval, void *data)
+{
+    struct pause_histogram *ph = (struct pause_histogram *)data;
+    nsec_t now = now_nsec();
+
+    if (ph->phase == PHASE_SWEEPING) {
+	hist_add(&ph->sweep, ph->phase_time + (now - ph->phase_start));
+#ifndef RUBY_INTERNAL_EVENT_GC_ENTER
+	hist_add(&ph->pause, now - ph->gc_start);
+#endif
+    }
+    ph->phase = PHASE_NONE;
+}
+
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+static nsec_t step_start;
+
+static void
+hist_enter(VALUE tpval, void *data)
+{
+    struct pause_histogram *ph = (struct pause_histogram *)data;
+    step_start = ph->phase_start = now_nsec();
+}
+
+static void
+hist_exit(VALUE tpval, void *data)
+{
+    struct pause_histogram *ph = (struct pause_histogram *)data;
+    nsec_t now = now_nsec();
+
+    hist_add(&ph->pause, now - step_start);
+    if (ph->phase != PHASE_NONE) {
+	ph->phase_time += now - ph->phase_start;
+    }
+}
+#endif
+
+static void
+create_histogram_hooks(void)
+{
+    struct pause_histogram *ph = &pause_histogram;
+    int i;
+
+    histogram_hooks[0] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_START,     hist_start,     ph);
+    histogram_hooks[1] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_END_MARK,  hist_end_mark,  ph);
+    histogram_hooks[2] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_END_SWEEP, hist_end_sweep, ph);
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+    histogram_hooks[3] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_ENTER,     hist_enter,     ph);
+    histogram_hooks[4] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_EXIT,      hist_exit,      ph);
+#endif
+
+    /* mark for GC */
+    for (i=0; i<HIST_HOOKS; i++) rb_gc_register_mark_object(histogram_hooks[i]);
+}
+
+static void
+reset_histograms(struct pause_histogram *ph)
+{
+    MEMZERO(&ph->pause, struct histogram, 1);
+    MEMZERO(&ph->mark, struct histogram, 1);
+    MEMZERO(&ph->sweep, struct histogram, 1);
+}
+
+static VALUE
+histogram_to_hash(const struct histogram *hist)
+{
+    VALUE hash = rb_hash_new();
+
+#define SET(name, v) rb_hash_aset(hash, ID2SYM(rb_intern(name)), ULL2NUM(v))
+    SET("count", hist->count);
+    SET("total", hist->total);
+    SET("min", hist->min);
+    SET("max", hist->max);
+    SET("p50", hist_percentile(hist, 0.50));
+    SET("p90", hist_percentile(hist, 0.90));
+    SET("p99", hist_percentile(hist, 0.99));
+    SET("p999", hist_percentile(hist, 0.999));
+#undef SET
+
+    return hash;
+}
+
+static VALUE
+gc_tracer_start_pause_histogram(VALUE self)
+{
+    struct pause_histogram *ph = &pause_histogram;
+    int i;
+
+    if (ph->enabled == 0) {
+	ph->enabled = 1;
+	ph->phase = PHASE_NONE;
+	reset_histograms(ph);
+	for (i=0; i<HIST_HOOKS; i++) rb_tracepoint_enable(histogram_hooks[i]);
+    }
+    return self;
+}
+
+static VALUE
+gc_tracer_stop_pause_histogram(VALUE self)
+{
+    struct pause_histogram *ph = &pause_histogram;
+    int i;
+
+    if (ph->enabled) {
+	for (i=0; i<HIST_HOOKS; i++) rb_tracepoint_disable(histogram_hooks[i]);
+	ph->enabled = 0;
+    }
+    return self;
+}
+
+static VALUE
+gc_tracer_pause_histogram(VALUE self, VALUE reset)
+{
+    struct pause_histogram *ph = &pause_histogram;
+    VALUE result = rb_hash_new();
+
+    if (ph->enabled == 0) {
+	rb_raise(rb_eRuntimeError, "GC pause histogram is not enabled.");
+    }
+
+    rb_hash_aset(result, ID2SYM(rb_intern("pause")), histogram_to_hash(&ph->pause));
+    rb_hash_aset(result, ID2SYM(rb_intern("mark")), histogram_to_hash(&ph->mark));
+    rb_hash_aset(result, ID2SYM(rb_intern("sweep")), histogram_to_hash(&ph->sweep));
+
+    if (RTEST(reset)) reset_histograms(ph);
+    return result;
+}
+
+/*
+ * For the exporter thread (in gc_exporter.c): counts are copied without
+ * Ruby API and locks, so a value can be off by an event in progress.
+ */
+int
+gc_tracer_histogram_buckets(void)
+{
+    return HIST_BUCKETS;
+}
+
+/* kind: 0 (pause), 1 (mark) or 2 (sweep). returns 0 if not enabled */
+int
+gc_tracer_histogram_copy(int kind, unsigned long long *counts, unsigned long long *total)
+{
+    struct pause_histogram *ph = &pause_histogram;
+    const struct histogram *hist = kind == 0 ? &ph->pause : kind == 1 ? &ph->mark : &ph->sweep;
+
+    if (ph->enabled == 0) return 0;
+    MEMCPY(counts, hist->counts, unsigned long long, HIST_BUCKETS);
+    *total = hist->total;
+    return 1;
+}
+
+unsigned long long
+gc_tracer_histogram_bucket_max(int index)
+{
+    return hist_bucket_max(index);
+}
+#endif /* HAVE_CLOCK_GETTIME */
+
+void
+Init_gc_tracer_histogram(VALUE mod)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    rb_define_module_function(mod, "start_pause_histogram_", gc_tracer_start_pause_histogram, 0);
+    rb_define_module_function(mod, "stop_pause_histogram_", gc_tracer_stop_pause_histogram, 0);
+    rb_define_module_function(mod, "pause_histogram_", gc_tracer_pause_histogram, 1);
+
+    create_histogram_hooks();
+#endif
+}
@@ -6,12 +6,60 @@
 #include <ruby/debug.h>
 
 #include <time.h>
+#include <math.h>
 
 #ifdef HAVE_GETRUSAGE
 #include <sys/time.h>
 #include <sys/resource.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_GCC_ATOMIC_BUILTINS)
+#define USE_ASYNC_LOGGING 1
+#include <pthread.h>
+#include <ruby/thread.h>
+#include <sys/time.h>
+#define ATOMIC_LOAD(var)       __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(var, val)   __atomic_add_fetch(&(var), (val), __ATOMIC_RELAXED)
+#define ATOMIC_EXCHANGE(var, val) __atomic_exchange_n(&(var), (val), __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS(var, oldp, val) __atomic_compare_exchange_n(&(var), (oldp), (val), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define USE_ASYNC_LOGGING 0
+#define ATOMIC_LOAD(var)       (var)
+#define ATOMIC_STORE(var, val) ((var) = (val))
+#define ATOMIC_ADD(var, val)   ((var) += (val))
+#define ATOMIC_EXCHANGE(var, val) atomic_exchange_long(&(var), (val))
+#define ATOMIC_CAS(var, oldp, val) ((var) = (val), 1)
+static inline long atomic_exchange_long(long *p, long v) { long old = *p; *p = v; return old; }
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_FTRUNCATE) && (defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN))
+#define USE_MMAP_OUTPUT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define USE_MMAP_OUTPUT 0
+#endif
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+#define USE_LOG_ROTATION 1
+#include <fcntl.h>
+#include <unistd.h>
+#if USE_ASYNC_LOGGING && defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define USE_LOG_COMPRESSION 1
+#include <zlib.h>
+#else
+#define USE_LOG_COMPRESSION 0
+#endif
+#else
+#define USE_LOG_ROTATION 0
+#define USE_LOG_COMPRESSION 0
+#endif
+
 #include "gc_tracer.h"
 
 #if defined(__GNUC__) && defined(__i386__)
@@ -38,6 +86,19 @@ tick(void)
     return ((unsigned long long)lo)|( ((unsigned long long)hi)<<32);
 }
 
+#elif defined(__GNUC__) && defined(__aarch64__)
+typedef unsigned long long tick_t;
+#define PRItick "llu"
+
+/* the virtual counter of the generic timer (constant frequency) */
+static __inline__ tick_t
+tick(void)
+{
+    unsigned long long v;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+}
+
 #elif defined(_WIN32) && defined(_MSC_VER)
 #include <intrin.h>
 typedef unsigned __int64 tick_t;
@@ -66,39 +127,373 @@ tick(void)
 #define MAX_HOOKS 5
 #endif
 
-#define MAX_CUSTOM_FIELDS 128
+/*
+ * Custom fields are slots in blocks which are never moved, so that
+ * handles (and other Ractors) can refer to values while fields are added.
+ * Slots of removed fields are reused.
+ */
+#define CUSTOM_FIELD_BLOCK_SIZE 64
+#define CUSTOM_FIELD_MAX_BLOCKS 1024
+#define MAX_CUSTOM_FIELDS (CUSTOM_FIELD_BLOCK_SIZE * CUSTOM_FIELD_MAX_BLOCKS)
 
 static VALUE tracer_hooks[MAX_HOOKS];
 static VALUE tracer_acceptable_events[MAX_HOOKS];
 
-typedef void (*out_time_func_t)(FILE *);
+typedef unsigned long long time_value_t;
+typedef time_value_t (*get_time_func_t)(void);
+
+/*
+ * A record keeps raw values of one event.
+ * Values are formatted into the output only in out_record().
+ */
+struct record {
+    const char *event;
+    time_value_t tick;
+    size_t values[]; /* gc_stat, latest_gc_info, rusage and custom fields */
+};
+
+/*
+ * Numbers of values in each record. They are fixed at start_logging
+ * to keep buffered records consistent with configuration changes.
+ */
+struct record_layout {
+    int gc_stat_num;
+    int gc_latest_gc_info_num;
+    int gc_stat_heap_num;       /* gc_stat_heap_keys_num * gc_stat_heap_pools_num */
+    int gc_stat_heap_keys_num;
+    int rusage_num;
+    /* indexes of selected keys in sym_gc_stat, sym_latest_gc_info and sym_rusage_columns */
+    int *gc_stat_index;
+    int *gc_latest_gc_info_index;
+    int *gc_stat_heap_index;    /* indexes in sym_gc_stat_heap */
+    int *rusage_index;
+    int gc_stat_all;            /* all keys are selected in order */
+    int gc_latest_gc_info_all;
+    int sample_weight_num;      /* 1 if newobj/freeobj events are sampled */
+    int phase_times_num;        /* PHASE_TIMES_NUM if phase_times is enabled */
+    int rates_num;              /* RATES_NUM if rates is enabled */
+    int custom_fields_num;
+    int *custom_field_slots;    /* slots of custom fields in the order of columns */
+    int custom_fields_reset_num; /* number of max and sum fields (reset after each GC) */
+    int values_num;
+    size_t record_size;
+};
+
+/*
+ * Ring buffer of records.
+ * GC hooks push records and a flusher (or the async writer thread) pops them.
+ * Positions increase monotonically and are used modulo capacity.
+ */
+struct record_buffer {
+    char *records;
+    size_t capacity;
+    size_t push_pos; /* updated only by a pusher */
+    size_t pop_pos;  /* updated only by a popper */
+    size_t dropped;  /* number of records dropped because of overflow */
+};
+
+#if USE_ASYNC_LOGGING
+struct async_writer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup_cond;  /* to wake up the writer */
+    pthread_cond_t flushed_cond; /* to notify flushed_pos */
+    size_t flushed_pos;
+    int stop;
+};
+#endif
+
+#if USE_MMAP_OUTPUT
+/*
+ * mmap output: the file is preallocated as
+ *
+ *   [data (capa bytes)][trailer (64 bytes)]
+ *
+ * capa is the mmap: size rounded up to a multiple of 8. Records are
+ * copied into the mapped data region. The trailer has
+ * "GCTRMMAP" u64:capa u64:tail (native byte order). tail (bytes of
+ * written data) is published with a release store after each record,
+ * so that readers can map the file and read data[0, tail) without syscalls.
+ * Records which do not fit are dropped.
+ * The file is truncated to tail at the end, so that it becomes a normal log.
+ */
+#define MMAP_OUTPUT_MAGIC "GCTRMMAP"
+#define MMAP_OUTPUT_DEFAULT_SIZE (64 * 1024 * 1024)
+#define MMAP_OUTPUT_STDIO_BUFFER_SIZE (64 * 1024)
+
+struct mmap_trailer {
+    char magic[8];
+    unsigned long long capa;
+    unsigned long long tail;
+    char reserved[40];
+};
+
+struct mmap_output {
+    FILE *file; /* underlying file */
+    char *map;
+    size_t capa;
+    size_t tail;
+    size_t dropped; /* number of dropped writes */
+};
+#endif
+
+#if USE_LOG_ROTATION
+/*
+ * Rotation: when the current file reaches max_size bytes (checked at
+ * record boundaries), it is renamed to filename.N (N = 1, 2, ...) and a
+ * new file starts with the header. Files are not renamed in GC: the
+ * writer thread or a postponed job after GC rotates pending rotations.
+ * Only the last max_files segments are kept.
+ * With compression, filename.N is compressed into filename.N.gz
+ * by a native thread.
+ */
+struct rotating_output {
+    int fd;         /* current segment (-1: can not open) */
+    size_t written; /* bytes written into the current segment */
+    int seq;        /* number of the last rotated segment */
+    char *header;   /* rendered header of each segment */
+    size_t header_len;
+    char *buffer;   /* stdio buffer */
+    int pending;    /* reached max_size */
+#if USE_LOG_COMPRESSION
+    int compressing; /* number of running compressions */
+    pthread_mutex_t compress_lock;
+    pthread_cond_t compress_cond; /* signaled when compressing becomes 0 */
+#endif
+};
+#endif
+
+enum log_format {
+    LOG_FORMAT_TSV,
+    LOG_FORMAT_BINARY,
+    LOG_FORMAT_BINARY_DELTA
+};
+
+/*
+ * Binary format (all numbers are little-endian):
+ *
+ *   header:  "GCTRACER" u32:version u32:columns
+ *            columns * (u8:column_kind u16:length name)
+ *   chunks:  'E' u32:id u16:length name  (definition of an event name)
+ *            'S' u32:id u16:length name  (definition of a symbol)
+ *            'R' u32:event_id u64:tick columns * u64:value  (record)
+ *
+ * Values of BINARY_COLUMN_VALUE columns are (num << 1) or (symbol_id << 1 | 1).
+ *
+ * Delta format (version 2) uses the following chunks instead of 'R'.
+ * Numbers in payloads are BER compressed integers (pack('w')).
+ *
+ *   'K' u32:length ber:event_id ber:tick columns * ber:value  (keyframe)
+ *   'D' u32:length ber:event_id zigzag(tick - prev_tick)
+ *                  columns * zigzag(value - prev_value)       (delta from the previous record)
+ *
+ * Differences are computed modulo 2**64.
+ */
+#define BINARY_FORMAT_MAGIC   "GCTRACER"
+#define BINARY_FORMAT_VERSION 1
+#define BINARY_DELTA_FORMAT_VERSION 2
+#define BINARY_DEFAULT_KEYFRAME_INTERVAL 64
+
+enum binary_column_kind {
+    BINARY_COLUMN_UNSIGNED,
+    BINARY_COLUMN_VALUE,
+    BINARY_COLUMN_SIGNED
+};
+
+/*
+ * Binary output state. It is used in GC events and by the async writer,
+ * so it uses only malloc() and does not use Ruby API.
+ */
+struct binary_output {
+    struct binary_event_id {
+	const char *event;
+	unsigned long id;
+    } *event_ids;              /* open addressing hash: event name pointer -> id */
+    unsigned long event_ids_capa;
+    unsigned long event_ids_num;
+    int syms_num;              /* number of defined symbols */
+
+    /* for delta format */
+    unsigned long long *prev_values; /* tick and columns of the previous record */
+    unsigned char *chunk;
+    int keyframe_interval;
+    int records_from_keyframe;
+};
+
+/*
+ * Kinds of custom fields:
+ * - counter: incremented, decremented or set by users.
+ * - max: the largest set value since the previous GC (0 if not set).
+ * - sum: the sum of set values (e.g. durations) since the previous GC.
+ * max and sum fields are reset at end_sweep, after its record is filled.
+ * - last: the last set value.
+ */
+enum custom_field_kind {
+    CUSTOM_FIELD_COUNTER,
+    CUSTOM_FIELD_MAX,
+    CUSTOM_FIELD_SUM,
+    CUSTOM_FIELD_LAST
+};
+
+/* a TSV record in building */
+struct line_buffer {
+    char *ptr;
+    size_t len;
+    size_t capa;
+};
+
+/* aligned to cache lines */
+struct custom_field_block {
+    long values[CUSTOM_FIELD_BLOCK_SIZE]; /* updated atomically */
+    ID names[CUSTOM_FIELD_BLOCK_SIZE];    /* 0: unused slot */
+    unsigned char kinds[CUSTOM_FIELD_BLOCK_SIZE]; /* enum custom_field_kind */
+};
+
+struct custom_fields {
+    struct custom_field_block *blocks[CUSTOM_FIELD_MAX_BLOCKS];
+    int slots_num;    /* used slots including free slots */
+    int *free_slots;
+    int free_num, free_capa;
+    int *columns;     /* slots in the order of columns */
+    int num, capa;
+    st_table *index;  /* name (ID) -> slot */
+};
+
+#define CUSTOM_FIELD_BLOCK(cf, slot) ((cf)->blocks[(slot) / CUSTOM_FIELD_BLOCK_SIZE])
+#define CUSTOM_FIELD_VALUE(cf, slot) (CUSTOM_FIELD_BLOCK(cf, slot)->values[(slot) % CUSTOM_FIELD_BLOCK_SIZE])
+#define CUSTOM_FIELD_NAME(cf, slot)  (CUSTOM_FIELD_BLOCK(cf, slot)->names[(slot) % CUSTOM_FIELD_BLOCK_SIZE])
+#define CUSTOM_FIELD_KIND(cf, slot)  (CUSTOM_FIELD_BLOCK(cf, slot)->kinds[(slot) % CUSTOM_FIELD_BLOCK_SIZE])
 
 struct gc_logging {
     struct config {
-	out_time_func_t out_time_func;
+	get_time_func_t get_time_func;
 	int log_gc_stat;
 	int log_gc_latest_gc_info;
 	int log_rusage;
-	int log_custom_fields_count;
+	int log_gc_stat_heap;
+	/* Array of keys to log or Qnil (all keys) */
+	VALUE gc_stat_keys;
+	VALUE gc_latest_gc_info_keys;
+	VALUE rusage_keys;
+	VALUE gc_stat_heap_keys;
+	int buffer_size; /* 0: no buffering */
+	int async;
+	enum log_format format;
+	int keyframe_interval;
+	int sample_rate; /* log 1 in sample_rate newobj/freeobj events (0 or 1: all) */
+	int sample_poisson; /* random intervals instead of fixed ones */
+	size_t mmap_size; /* 0: stdio output */
+	size_t max_size;  /* 0: no rotation */
+	int max_files;    /* 0: keep all segments */
+	int compress;
+	int phase_times;
+	double rates_window; /* seconds, 0: rates are disabled */
+	size_t flight_records;     /* 0: flight recorder is disabled */
+	time_value_t flight_pause; /* nsec */
+	size_t flight_after;
     } config;
 
     int enabled;
-    VALUE enable_hooks[MAX_HOOKS]; /* Symbols */
-    int enable_hooks_num; /* 0 to MAX_HOOKS */
+    int event_bits; /* bits of tracer_hooks to log */
+    int hook_bits;  /* bits of enabled tracer_hooks (with hooks only for phase_times) */
 
-    ID custom_field_names[MAX_CUSTOM_FIELDS];
-    long  custom_field_values[MAX_CUSTOM_FIELDS];
+    struct custom_fields custom_fields;
 
     FILE *out;
+    char *out_filename; /* NULL: stderr */
     const char *event;
 
-#if HAVE_GETRUSAGE
-    int filled_rusage;
-    struct rusage rusage;
+    struct record_layout layout;
+    struct record *scratch; /* for logging without buffering */
+    struct record_buffer buffer;
+    int gc_stat_bulk;           /* fetch GC.stat by a hash */
+    int gc_latest_gc_info_bulk; /* fetch GC.latest_gc_info by a hash */
+#if USE_ASYNC_LOGGING
+    struct async_writer writer;
+#endif
+    int async; /* async writer is running */
+    int forked; /* in a child process until after_fork_ (outputs are of the parent) */
+    enum log_format format; /* format of the current output */
+    struct binary_output binary;
+    struct line_buffer line; /* for TSV records */
+    st_table *event_names; /* custom event names (async mode) */
+#if USE_MMAP_OUTPUT
+    struct mmap_output mmap; /* map is NULL if not used */
 #endif
+#if USE_LOG_ROTATION
+    struct rotating_output rotating;
+    int rotate; /* rotating output is used */
+#endif
+
+    /* sampling of newobj/freeobj events */
+    struct sampler {
+	long countdown;
+	size_t interval;
+    } newobj_sampler, freeobj_sampler;
+    double sample_log_q; /* log(1 - 1/sample_rate) */
+    unsigned long long sample_rand;
+    size_t sample_weight; /* number of events represented by the current record */
+
+    /* phase_times: state of the current GC (in ticks) */
+    struct phase_state {
+	enum gc_phase {
+	    PHASE_NONE,
+	    PHASE_MARKING,
+	    PHASE_SWEEPING
+	} phase;
+	time_value_t now;         /* tick of the current event (used by fill_record) */
+	int has_now;
+	time_value_t gc_start;
+	time_value_t phase_start; /* last boundary in the current GC step */
+	time_value_t phase_time;  /* accumulated time of the current phase */
+	time_value_t step_start;
+	time_value_t pause;       /* accumulated time of GC steps */
+	time_value_t mark_time;
+	time_value_t last_gc_end;
+	time_value_t values[4];   /* columns of the completed GC (only for its end_sweep record) */
+	int completed;
+    } phase;
+
+    /* rates: allocation rate at start and promotion at end_sweep */
+    struct rate_state {
+	time_value_t last_start;   /* nsec */
+	size_t last_allocated;
+	time_value_t last_minor_end;
+	size_t start_old_objects;
+	size_t major_gc_count;     /* at start */
+	int started;               /* start of the current GC is seen */
+	size_t values[2];          /* columns of the current event (0: not computed) */
+	double allocation_rate;    /* EWMA of objects per second */
+	double promotion;          /* EWMA of promoted objects per minor GC */
+	unsigned long allocation_samples;
+	unsigned long promotion_samples;
+    } rates;
+
+    /* flight recorder: records are kept in the buffer until a slow GC */
+    int flight_recording;
+    struct flight_state {
+	time_value_t gc_start;    /* nsec, 0: not in GC */
+	time_value_t step_start;
+	time_value_t pause;
+	size_t release_pos;       /* buffered records before it are written */
+	size_t remaining;         /* records to be written after the last trigger */
+	size_t triggers;
+    } flight;
 } trace_logging;
 
+#define RATES_NUM 2
+static VALUE sym_rates[RATES_NUM];
+static time_value_t rates_now(void);
+static void rates_start(struct gc_logging *logging);
+static void rates_end_sweep(struct gc_logging *logging);
+
+#define PHASE_TIMES_NUM 4
+static VALUE sym_phase_times[PHASE_TIMES_NUM];
+
 static void logging_start_i(VALUE tpval, struct gc_logging *logging);
+static void gc_stat_heap_schedule(struct gc_logging *logging);
+static void buffer_schedule_flush(struct gc_logging *logging);
+static void flight_event(struct gc_logging *logging, int bit);
 
 #define TRACE_FUNC(name) trace_func_##name
 
@@ -109,282 +504,2372 @@ static void logging_start_i(VALUE tpval, struct gc_logging *logging);
       logging_start_i(tpval, logging);\
   }
 
-DEFINE_TRACE_FUNC(start);
-DEFINE_TRACE_FUNC(end_mark);
-DEFINE_TRACE_FUNC(end_sweep);
-DEFINE_TRACE_FUNC(newobj);
-DEFINE_TRACE_FUNC(freeobj);
-#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
-DEFINE_TRACE_FUNC(enter);
-DEFINE_TRACE_FUNC(exit);
-#endif
-
-/* the following code is only for internal tuning. */
-
-/* Source code to use RDTSC is quoted and modified from
- * http://www.mcs.anl.gov/~kazutomo/rdtsc.html
- * written by Kazutomo Yoshii <kazutomo@mcs.anl.gov>
+/*
+ * phase_times: mark_time, sweep_time, total_pause and time_since_last_gc
+ * of each GC are computed in hooks and written on its end_sweep record
+ * (0 on other records).
+ *
+ * With enter/exit events, only time between enter and exit is counted,
+ * so incremental marking and lazy sweeping steps are summed for each
+ * phase (the last step is counted until end_sweep).
+ * Without them, phase times are wall-clock time between events.
+ * time_since_last_gc is time from end_sweep of the previous GC to start.
  */
-
-static void
-out_str(FILE *out, const char *str)
+static time_value_t
+phase_now(struct gc_logging *logging)
 {
-    fprintf(out, "%s\t", str);
+    struct phase_state *ps = &logging->phase;
+
+    ps->now = (logging->config.get_time_func)();
+    ps->has_now = 1;
+    return ps->now;
 }
 
 static void
-out_terminate(FILE *out)
+phase_start(struct gc_logging *logging)
 {
-    fprintf(out, "\n");
+    struct phase_state *ps = &logging->phase;
+    time_value_t now = phase_now(logging);
+
+    ps->values[3] = ps->last_gc_end ? now - ps->last_gc_end : 0;
+    ps->phase = PHASE_MARKING;
+    ps->gc_start = ps->phase_start = now;
+    ps->phase_time = 0;
+    ps->pause = 0;
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+    /* enabled while GC (enter was ignored) */
+    if (ps->step_start == 0) ps->step_start = now;
+#endif
 }
 
 static void
-out_flush(FILE *out)
+phase_end_mark(struct gc_logging *logging)
 {
-    fflush(out);
+    struct phase_state *ps = &logging->phase;
+    time_value_t now = phase_now(logging);
+
+    /* ignore GC started before enabling */
+    if (ps->phase == PHASE_MARKING) {
+	ps->mark_time = ps->phase_time + (now - ps->phase_start);
+	ps->phase = PHASE_SWEEPING;
+	ps->phase_start = now;
+	ps->phase_time = 0;
+    }
 }
 
 static void
-out_sizet(FILE *out, size_t size)
+phase_end_sweep(struct gc_logging *logging)
 {
-    fprintf(out, "%lu\t", (unsigned long)size);
+    struct phase_state *ps = &logging->phase;
+    time_value_t now = phase_now(logging);
+
+    if (ps->phase == PHASE_SWEEPING) {
+	ps->values[0] = ps->mark_time;
+	ps->values[1] = ps->phase_time + (now - ps->phase_start);
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+	ps->values[2] = ps->pause + (now - ps->step_start);
+#else
+	ps->values[2] = now - ps->gc_start;
+#endif
+	ps->completed = 1;
+    }
+    ps->phase = PHASE_NONE;
+    ps->last_gc_end = now;
 }
 
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
 static void
-out_long(FILE *out, long l)
+phase_enter(struct gc_logging *logging)
 {
-    fprintf(out, "%ld\t", l);
+    struct phase_state *ps = &logging->phase;
+    ps->step_start = ps->phase_start = phase_now(logging);
 }
 
-static double
-timeval2double(struct timeval *tv)
-{
-    return tv->tv_sec * 1000000LL + tv->tv_usec;
-}
-#if HAVE_GETRUSAGE
 static void
-fill_rusage(struct gc_logging *logging)
+phase_exit(struct gc_logging *logging)
 {
-    if (logging->filled_rusage == 0) {
-	logging->filled_rusage = 1;
-	getrusage(RUSAGE_SELF, &logging->rusage);
+    struct phase_state *ps = &logging->phase;
+    time_value_t now = phase_now(logging);
+
+    if (ps->phase != PHASE_NONE) {
+	ps->pause += now - ps->step_start;
+	ps->phase_time += now - ps->phase_start;
     }
+    ps->step_start = 0;
 }
 #endif
-static void
-out_time_none(FILE *out)
-{
-    out_sizet(out, 0);
-}
 
 static void
-out_time_hw_counter(FILE *out)
+phase_reset(struct gc_logging *logging)
 {
-    out_sizet(out, (size_t)tick());
+    MEMZERO(&logging->phase, struct phase_state, 1);
 }
 
+/* other threads do not run in GC, so plain stores are enough */
 static void
-out_time_time(FILE *out)
+custom_fields_reset(struct gc_logging *logging)
 {
-    struct timeval tv = {0, 0};
-    gettimeofday(&tv, NULL);
+    struct custom_fields *cf = &logging->custom_fields;
+    int i;
 
-    if (tv.tv_sec != 0) {
-	fprintf(out, "%lu%06lu\t", (unsigned long)tv.tv_sec, (unsigned long)tv.tv_usec);
-    }
-    else {
-	fprintf(out, "%lu\t", (unsigned long)tv.tv_usec);
+    for (i=0; i<logging->layout.custom_fields_num; i++) {
+	int slot = logging->layout.custom_field_slots[i];
+	int kind = CUSTOM_FIELD_KIND(cf, slot);
+	if (kind == CUSTOM_FIELD_MAX || kind == CUSTOM_FIELD_SUM) ATOMIC_STORE(CUSTOM_FIELD_VALUE(cf, slot), 0);
     }
 }
 
-#ifdef HAVE_CLOCK_GETTIME
-static void
-out_time_nano_time(FILE *out)
+/* GC events also update phase_times even if they are not logged */
+#define DEFINE_GC_TRACE_FUNC(name, bit) \
+  static void TRACE_FUNC(name)(VALUE tpval, void *data) { \
+      struct gc_logging *logging = (struct gc_logging *)data; \
+      if (logging->layout.phase_times_num > 0) phase_##name(logging); \
+      if ((bit) == EVENT_BIT_END_SWEEP && logging->layout.gc_stat_heap_num > 0) gc_stat_heap_schedule(logging); \
+      if ((bit) == EVENT_BIT_START && logging->layout.rates_num > 0) rates_start(logging); \
+      if ((bit) == EVENT_BIT_END_SWEEP && logging->layout.rates_num > 0) rates_end_sweep(logging); \
+      if (logging->event_bits & (bit)) { \
+	  logging->event = #name; \
+	  logging_start_i(tpval, logging); \
+      } \
+      if (logging->flight_recording) flight_event(logging, (bit)); \
+      if ((bit) == EVENT_BIT_END_SWEEP && logging->layout.custom_fields_reset_num > 0) custom_fields_reset(logging); \
+      logging->phase.has_now = logging->phase.completed = 0; \
+      logging->rates.values[0] = logging->rates.values[1] = 0; \
+  }
+
+/*
+ * Intervals between sampled events are sample_rate (fixed),
+ * or geometrically distributed with mean sample_rate (poisson).
+ * Each sampled record has the length of the interval as "sample_weight",
+ * so the sum of weights is the number of events.
+ */
+static size_t
+sampler_interval(struct gc_logging *logging)
 {
-    struct timespec ts = {0, 0};
-    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long x;
+    double u;
 
-    if (ts.tv_sec != 0) {
-	fprintf(out, "%lu%09lu\t", (unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec);
-    }
-    else {
-	fprintf(out, "%lu\t", (unsigned long)ts.tv_nsec);
-    }
+    if (logging->config.sample_rate <= 1) return 1;
+    if (!logging->config.sample_poisson) return logging->config.sample_rate;
+
+    /* xorshift64* */
+    x = logging->sample_rand;
+    x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    logging->sample_rand = x;
+    u = ((x * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0); /* [0, 1) */
+
+    return 1 + (size_t)(log(1.0 - u) / logging->sample_log_q);
 }
-#endif
 
 static void
-out_obj(FILE *out, VALUE obj)
+sampler_reset(struct gc_logging *logging, struct sampler *sampler)
 {
-    if (NIL_P(obj) || obj == Qfalse) {
-	out_sizet(out, 0);
-    }
-    else if (obj == Qtrue) {
-	out_sizet(out, 1);
-    }
-    else if (SYMBOL_P(obj)) {
-	out_str(out, rb_id2name(SYM2ID(obj)));
-    }
-    else if (FIXNUM_P(obj)) {
-	out_sizet(out, FIX2INT(obj));
-    }
-    else {
-	rb_bug("out_obj: unknown object to output");
-    }
+    sampler->interval = sampler_interval(logging);
+    sampler->countdown = (long)sampler->interval;
 }
 
 static void
-out_gc_stat(struct gc_logging *logging)
+sampler_setup(struct gc_logging *logging)
 {
-    int i;
-    for (i=0; i<(int)(sizeof(sym_gc_stat)/sizeof(VALUE)); i++) {
-	VALUE sym = sym_gc_stat[i];
-	out_sizet(logging->out, rb_gc_stat(sym));
-    }
+    int rate = logging->config.sample_rate;
+
+    logging->sample_log_q = rate > 1 ? log(1.0 - 1.0 / rate) : 0.0;
+    logging->sample_rand = ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)getpid() ^ 0x9e3779b97f4a7c15ULL;
+    logging->sample_weight = 1;
+    sampler_reset(logging, &logging->newobj_sampler);
+    sampler_reset(logging, &logging->freeobj_sampler);
 }
 
+#define DEFINE_SAMPLED_TRACE_FUNC(name) \
+  static void TRACE_FUNC(name)(VALUE tpval, void *data) { \
+      struct gc_logging *logging = (struct gc_logging *)data; \
+      struct sampler *sampler = &logging->name##_sampler; \
+      if (--sampler->countdown > 0) return; \
+      logging->sample_weight = sampler->interval; \
+      sampler_reset(logging, sampler); \
+      logging->event = #name; \
+      logging_start_i(tpval, logging); \
+      logging->sample_weight = 1; \
+  }
+
+/* bits of tracer_hooks */
+#define EVENT_BIT_START     0x01
+#define EVENT_BIT_END_MARK  0x02
+#define EVENT_BIT_END_SWEEP 0x04
+#define EVENT_BIT_ENTER     0x20
+#define EVENT_BIT_EXIT      0x40
+
+/*
+ * Flight recorder: the buffer keeps the last config.flight_records
+ * records without writing them. When the pause of a GC (the sum of its
+ * steps as total_pause of phase_times, in nsec) exceeds config.flight_pause,
+ * the buffered records (with the end_sweep record of the GC) and the next
+ * config.flight_after records are written.
+ */
 static void
-out_gc_latest_gc_info(struct gc_logging *logging)
+flight_trigger(struct gc_logging *logging)
 {
-    int i;
-    for (i=0; i<(int)(sizeof(sym_latest_gc_info)/sizeof(VALUE)); i++) {
-	VALUE sym = sym_latest_gc_info[i];
-	out_obj(logging->out, rb_gc_latest_gc_info(sym));
-    }
+    struct flight_state *fs = &logging->flight;
+
+    fs->release_pos = logging->buffer.push_pos;
+    fs->remaining = logging->config.flight_after;
+    fs->triggers++;
+    buffer_schedule_flush(logging);
 }
 
-#if HAVE_GETRUSAGE
 static void
-out_rusage(struct gc_logging *logging)
+flight_event(struct gc_logging *logging, int bit)
 {
-    fill_rusage(logging);
+    struct flight_state *fs = &logging->flight;
+    time_value_t now = rates_now();
+    time_value_t pause;
 
-    out_sizet(logging->out, (size_t)timeval2double(&logging->rusage.ru_utime));
-    out_sizet(logging->out, (size_t)timeval2double(&logging->rusage.ru_stime));
-
-#if HAVE_ST_RU_MAXRSS
-    out_sizet(logging->out, logging->rusage.ru_maxrss);
-#endif
-#if HAVE_ST_RU_IXRSS
-    out_sizet(logging->out, logging->rusage.ru_ixrss);
-#endif
-#if HAVE_ST_RU_IDRSS
-    out_sizet(logging->out, logging->rusage.ru_idrss);
-#endif
-#if HAVE_ST_RU_ISRSS
-    out_sizet(logging->out, logging->rusage.ru_isrss);
-#endif
-#if HAVE_ST_RU_MINFLT
-    out_sizet(logging->out, logging->rusage.ru_minflt);
-#endif
-#if HAVE_ST_RU_MAJFLT
-    out_sizet(logging->out, logging->rusage.ru_majflt);
-#endif
-#if HAVE_ST_RU_NSWAP
-    out_sizet(logging->out, logging->rusage.ru_nswap);
-#endif
-#if HAVE_ST_RU_INBLOCK
-    out_sizet(logging->out, logging->rusage.ru_inblock);
-#endif
-#if HAVE_ST_RU_OUBLOCK
-    out_sizet(logging->out, logging->rusage.ru_oublock);
-#endif
-#if HAVE_ST_RU_MSGSND
-    out_sizet(logging->out, logging->rusage.ru_msgsnd);
-#endif
-#if HAVE_ST_RU_MSGRCV
-    out_sizet(logging->out, logging->rusage.ru_msgrcv);
-#endif
-#if HAVE_ST_RU_NSIGNALS
-    out_sizet(logging->out, logging->rusage.ru_nsignals);
-#endif
-#if HAVE_ST_RU_NVCSW
-    out_sizet(logging->out, logging->rusage.ru_nvcsw);
+    switch (bit) {
+      case EVENT_BIT_START:
+	fs->gc_start = now;
+	fs->pause = 0;
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+	/* enabled while GC (enter was ignored) */
+	if (fs->step_start == 0) fs->step_start = now;
 #endif
-#if HAVE_ST_RU_NIVCSW
-    out_sizet(logging->out, logging->rusage.ru_nivcsw);
+	break;
+      case EVENT_BIT_ENTER:
+	fs->step_start = now;
+	break;
+      case EVENT_BIT_EXIT:
+	if (fs->gc_start) fs->pause += now - fs->step_start;
+	fs->step_start = 0;
+	break;
+      case EVENT_BIT_END_SWEEP:
+	/* ignore GC started before enabling */
+	if (fs->gc_start == 0) break;
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+	pause = fs->pause + (now - fs->step_start);
+#else
+	pause = now - fs->gc_start;
 #endif
-
+	fs->gc_start = 0;
+	if (pause > logging->config.flight_pause && !logging->forked) flight_trigger(logging);
+	break;
+    }
 }
-#endif
 
-static void
-out_stat(struct gc_logging *logging, const char *event)
-{
-#if HAVE_GETRUSAGE
-    logging->filled_rusage = 0;
+DEFINE_GC_TRACE_FUNC(start, EVENT_BIT_START);
+DEFINE_GC_TRACE_FUNC(end_mark, EVENT_BIT_END_MARK);
+DEFINE_GC_TRACE_FUNC(end_sweep, EVENT_BIT_END_SWEEP);
+DEFINE_SAMPLED_TRACE_FUNC(newobj);
+DEFINE_SAMPLED_TRACE_FUNC(freeobj);
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+DEFINE_GC_TRACE_FUNC(enter, EVENT_BIT_ENTER);
+DEFINE_GC_TRACE_FUNC(exit, EVENT_BIT_EXIT);
+#define PHASE_EVENT_BITS (EVENT_BIT_START | EVENT_BIT_END_MARK | EVENT_BIT_END_SWEEP | EVENT_BIT_ENTER | EVENT_BIT_EXIT)
+#else
+#define PHASE_EVENT_BITS (EVENT_BIT_START | EVENT_BIT_END_MARK | EVENT_BIT_END_SWEEP)
 #endif
 
-    out_str(logging->out, event);
-    (logging->config.out_time_func)(logging->out);
+/* the following code is only for internal tuning. */
 
-    if (logging->config.log_gc_stat) out_gc_stat(logging);
-    if (logging->config.log_gc_latest_gc_info) out_gc_latest_gc_info(logging);
-#if HAVE_GETRUSAGE
-    if (logging->config.log_rusage) out_rusage(logging);
-#endif
-    if (logging->config.log_custom_fields_count > 0) {
-	int i;
-	for (i=0; i<logging->config.log_custom_fields_count; i++) {
-	    out_long(logging->out, logging->custom_field_values[i]);
-	}
-    }
+/* Source code to use RDTSC is quoted and modified from
+ * http://www.mcs.anl.gov/~kazutomo/rdtsc.html
+ * written by Kazutomo Yoshii <kazutomo@mcs.anl.gov>
+ */
 
-    out_terminate(logging->out);
+static void
+out_str(FILE *out, const char *str)
+{
+    fprintf(out, "%s\t", str);
 }
 
 static void
-logging_start_i(VALUE tpval, struct gc_logging *logging)
+out_terminate(FILE *out)
 {
-    out_stat(logging, logging->event);
+    fprintf(out, "\n");
 }
 
 static void
-out_header_each(struct gc_logging *logging, VALUE *syms, int n)
+out_flush(FILE *out)
 {
-    int i;
-    for (i=0; i<n; i++) {
-	out_obj(logging->out, syms[i]);
-    }
+    fflush(out);
 }
 
 static void
-out_header(struct gc_logging *logging)
+out_sizet(FILE *out, size_t size)
 {
-    out_str(logging->out, "type");
-    out_str(logging->out, "tick");
-
-    if (logging->config.log_gc_stat)           out_header_each(logging, sym_gc_stat, sizeof(sym_gc_stat)/sizeof(VALUE));
-    if (logging->config.log_gc_latest_gc_info) out_header_each(logging, sym_latest_gc_info, sizeof(sym_latest_gc_info)/sizeof(VALUE));
-#if HAVE_GETRUSAGE
-    if (logging->config.log_rusage) {
-	out_header_each(logging, sym_rusage_timeval, sizeof(sym_rusage_timeval)/sizeof(VALUE));
-	out_header_each(logging, sym_rusage, sizeof(sym_rusage)/sizeof(VALUE));
-    }
-#endif
-    if (logging->config.log_custom_fields_count > 0) {
-	int i;
-	for (i=0; i<logging->config.log_custom_fields_count; i++) {
-	    out_str(logging->out, rb_id2name(logging->custom_field_names[i]));
-	}
-    }
-    out_terminate(logging->out);
+    fprintf(out, "%lu\t", (unsigned long)size);
 }
 
-static void
-close_output(FILE *out)
+static double
+timeval2double(struct timeval *tv)
 {
-    fflush(out);
-    if (out != stderr) {
-	fclose(out);
-    }
+    return tv->tv_sec * 1000000LL + tv->tv_usec;
 }
 
-static void
-create_gc_hooks(void)
+/* time values are printed as concatenated digits of (sec, usec) or (sec, nsec) */
+
+static time_value_t
+get_time_none(void)
 {
-    int i = 0;
-    struct gc_logging *logging = &trace_logging;
+    return 0;
+}
+
+static time_value_t
+get_time_hw_counter(void)
+{
+    return (time_value_t)(size_t)tick();
+}
+
+static time_value_t
+get_time_time(void)
+{
+    struct timeval tv = {0, 0};
+    gettimeofday(&tv, NULL);
+    return (time_value_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+#ifdef HAVE_CLOCK_GETTIME
+static time_value_t
+get_time_nano_time(void)
+{
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (time_value_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * tick_type: :tsc_ns
+ *
+ * Nanoseconds from the hardware counter (TSC on x86, the generic timer on
+ * aarch64), converted with the frequency measured against CLOCK_MONOTONIC
+ * (or read from cntfrq_el0) at the first use. Values start at
+ * CLOCK_MONOTONIC, so they are comparable with :nano_time.
+ * Without an invariant counter, :nano_time (CLOCK_MONOTONIC) is used.
+ */
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))) && defined(__SIZEOF_INT128__)
+#define USE_TSC_NS 1
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#else
+#define USE_TSC_NS 0
+#endif
+
+static struct tsc_calibration {
+    int calibrated;
+    int available;          /* invariant counter is available */
+    double frequency;       /* ticks per second */
+    unsigned long long mult; /* nsec = ticks * mult >> TSC_NS_SHIFT */
+    unsigned long long base_tick;
+    time_value_t base_nsec;
+} tsc_calibration;
+
+#define TSC_NS_SHIFT 32
+#define TSC_CALIBRATION_NSEC (20 * 1000 * 1000)
+
+#if USE_TSC_NS
+/* not reordered before preceding loads (like rdtscp) */
+static inline unsigned long long
+tsc_read(void)
+{
+#if defined(__x86_64__)
+    unsigned long hi, lo;
+    __asm__ __volatile__ ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((unsigned long long)lo)|( ((unsigned long long)hi)<<32);
+#else
+    unsigned long long v;
+    __asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+#endif
+}
+
+static int
+tsc_invariant_p(void)
+{
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    /* CPUID.80000007H:EDX[8] invariant TSC */
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007) return 0;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 8)) != 0;
+#else
+    return 1;
+#endif
+}
+
+static double
+tsc_measure_frequency(void)
+{
+#if defined(__x86_64__)
+    time_value_t t0, t1;
+    unsigned long long c0, c1;
+
+    t0 = get_time_nano_time();
+    c0 = tsc_read();
+    do {
+	t1 = get_time_nano_time();
+	c1 = tsc_read();
+    } while (t1 - t0 < TSC_CALIBRATION_NSEC);
+    return (double)(c1 - c0) * 1e9 / (double)(t1 - t0);
+#else
+    unsigned long long freq;
+    __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r"(freq));
+    return (double)freq;
+#endif
+}
+
+static time_value_t
+get_time_tsc_ns(void)
+{
+    const struct tsc_calibration *tc = &tsc_calibration;
+    unsigned long long d = tsc_read() - tc->base_tick;
+    return tc->base_nsec + (time_value_t)(((unsigned __int128)d * tc->mult) >> TSC_NS_SHIFT);
+}
+#endif
+
+/* it takes TSC_CALIBRATION_NSEC on x86 */
+static get_time_func_t
+tsc_calibrate(void)
+{
+    struct tsc_calibration *tc = &tsc_calibration;
+
+    if (!tc->calibrated) {
+	tc->calibrated = 1;
+#if USE_TSC_NS
+	if (tsc_invariant_p() && (tc->frequency = tsc_measure_frequency()) > 0) {
+	    tc->available = 1;
+	    tc->mult = (unsigned long long)(1e9 * (double)(1ULL << TSC_NS_SHIFT) / tc->frequency);
+	    tc->base_nsec = get_time_nano_time();
+	    tc->base_tick = tsc_read();
+	}
+#endif
+    }
+#if USE_TSC_NS
+    if (tc->available) return get_time_tsc_ns;
+#endif
+    return get_time_nano_time;
+}
+
+static VALUE
+gc_tracer_tsc_calibration(VALUE self)
+{
+    struct tsc_calibration *tc = &tsc_calibration;
+    VALUE hash = rb_hash_new();
+
+    tsc_calibrate();
+    rb_hash_aset(hash, ID2SYM(rb_intern("available")), tc->available ? Qtrue : Qfalse);
+    rb_hash_aset(hash, ID2SYM(rb_intern("frequency")), tc->available ? DBL2NUM(tc->frequency) : Qnil);
+    return hash;
+}
+#endif
+
+/*
+ * rates: "allocation_rate" is objects allocated per second from the
+ * previous start (on start records) and "promotion" is objects promoted
+ * to the old generation by a minor GC (on end_sweep records).
+ * GC::Tracer.rates returns exponentially weighted moving averages of them
+ * with the time constant of config.rates_window.
+ */
+static VALUE sym_total_allocated_objects, sym_old_objects, sym_major_gc_count;
+
+static time_value_t
+rates_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    return get_time_nano_time();
+#else
+    return get_time_time() * 1000;
+#endif
+}
+
+/* weight of a new sample dt nsec after the previous one */
+static double
+rates_alpha(struct gc_logging *logging, time_value_t dt)
+{
+    return 1.0 - exp(-(double)dt / (logging->config.rates_window * 1e9));
+}
+
+static void
+rates_start(struct gc_logging *logging)
+{
+    struct rate_state *rs = &logging->rates;
+    time_value_t now = rates_now();
+    size_t allocated = rb_gc_stat(sym_total_allocated_objects);
+
+    if (rs->last_start > 0 && now > rs->last_start) {
+	double rate = (double)(allocated - rs->last_allocated) * 1e9 / (double)(now - rs->last_start);
+
+	if (rs->allocation_samples++ == 0) rs->allocation_rate = rate;
+	else rs->allocation_rate += rates_alpha(logging, now - rs->last_start) * (rate - rs->allocation_rate);
+	rs->values[0] = (size_t)rate;
+    }
+    rs->last_start = now;
+    rs->last_allocated = allocated;
+
+    /* major_gc_count is incremented after the start event */
+    rs->major_gc_count = rb_gc_stat(sym_major_gc_count);
+    rs->start_old_objects = rb_gc_stat(sym_old_objects);
+    rs->started = 1;
+}
+
+static void
+rates_end_sweep(struct gc_logging *logging)
+{
+    struct rate_state *rs = &logging->rates;
+    time_value_t now;
+    size_t old_objects;
+
+    /* ignore GC started before enabling and major GC */
+    if (!rs->started) return;
+    rs->started = 0;
+    if (rb_gc_stat(sym_major_gc_count) != rs->major_gc_count) return;
+
+    now = rates_now();
+    old_objects = rb_gc_stat(sym_old_objects);
+    if (old_objects >= rs->start_old_objects) {
+	double promotion = (double)(old_objects - rs->start_old_objects);
+
+	if (rs->promotion_samples++ == 0) rs->promotion = promotion;
+	else rs->promotion += rates_alpha(logging, now - rs->last_minor_end) * (promotion - rs->promotion);
+	rs->values[1] = old_objects - rs->start_old_objects;
+    }
+    rs->last_minor_end = now;
+}
+
+static void
+rates_reset(struct gc_logging *logging)
+{
+    MEMZERO(&logging->rates, struct rate_state, 1);
+}
+
+static VALUE
+gc_tracer_rates(VALUE self)
+{
+    struct gc_logging *logging = &trace_logging;
+    struct rate_state *rs = &logging->rates;
+    VALUE hash = rb_hash_new();
+
+    if (logging->enabled == 0 || logging->layout.rates_num == 0) {
+	rb_raise(rb_eRuntimeError, "GC tracer is not enabled with rates.");
+    }
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("allocation_rate")), rs->allocation_samples ? DBL2NUM(rs->allocation_rate) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("promotion")), rs->promotion_samples ? DBL2NUM(rs->promotion) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("allocation_samples")), ULONG2NUM(rs->allocation_samples));
+    rb_hash_aset(hash, ID2SYM(rb_intern("promotion_samples")), ULONG2NUM(rs->promotion_samples));
+    rb_hash_aset(hash, ID2SYM(rb_intern("window")), DBL2NUM(logging->config.rates_window));
+    return hash;
+}
+
+/*
+ * Names of symbols which appear in latest_gc_info values.
+ * Known values are registered at start up, and unknown ones by GC hooks
+ * (names are copied without allocation). They are referred by
+ * line_value() without Ruby API because line_value() can be called
+ * from the async writer thread.
+ */
+#define MAX_VALUE_SYMS 64
+#define VALUE_SYM_NAME_SIZE 32
+
+static struct value_sym {
+    VALUE sym;
+    char name[VALUE_SYM_NAME_SIZE];
+} value_syms[MAX_VALUE_SYMS];
+static int value_syms_num;
+static int value_syms_overflow; /* some symbols are written as "?" */
+
+static void
+value_sym_register(VALUE sym)
+{
+    int i, n = value_syms_num;
+
+    for (i=0; i<n; i++) {
+	if (value_syms[i].sym == sym) return;
+    }
+    if (n < MAX_VALUE_SYMS) {
+	value_syms[n].sym = sym;
+	snprintf(value_syms[n].name, VALUE_SYM_NAME_SIZE, "%s", rb_id2name(SYM2ID(sym)));
+	ATOMIC_STORE(value_syms_num, n + 1);
+    }
+    else {
+	value_syms_overflow = 1;
+    }
+}
+
+static void
+setup_value_syms(void)
+{
+    /* values of gc_by, major_by, need_major_by and state */
+    static const char *const names[] = {
+	"newobj", "malloc", "method", "capi", "stress",
+	"nofree", "oldgen", "shady", "force", "oldmalloc",
+	"none", "marking", "sweeping", "compacting",
+    };
+    int i;
+
+    for (i=0; i<(int)(sizeof(names)/sizeof(names[0])); i++) {
+	value_sym_register(ID2SYM(rb_intern(names[i])));
+    }
+}
+
+static int
+value_sym_index(VALUE sym)
+{
+    int i, n = ATOMIC_LOAD(value_syms_num);
+
+    for (i=0; i<n; i++) {
+	if (value_syms[i].sym == sym) return i;
+    }
+    return -1;
+}
+
+static const char *
+value_sym_name(VALUE sym)
+{
+    int i, n = ATOMIC_LOAD(value_syms_num);
+
+    for (i=0; i<n; i++) {
+	if (value_syms[i].sym == sym) return value_syms[i].name;
+    }
+    return "?";
+}
+
+static void
+out_obj(FILE *out, VALUE obj)
+{
+    if (NIL_P(obj) || obj == Qfalse) {
+	out_sizet(out, 0);
+    }
+    else if (obj == Qtrue) {
+	out_sizet(out, 1);
+    }
+    else if (SYMBOL_P(obj)) {
+	out_str(out, rb_id2name(SYM2ID(obj)));
+    }
+    else if (FIXNUM_P(obj)) {
+	out_sizet(out, FIX2INT(obj));
+    }
+    else {
+	rb_bug("out_obj: unknown object to output");
+    }
+}
+
+/*
+ * rb_gc_stat(sym) and rb_gc_latest_gc_info(sym) scan keys for each call.
+ * Instead, we can fetch all values at once into a reused hash which already
+ * has all keys at the positions of sym_gc_stat/sym_latest_gc_info, so that
+ * filling the hash does not allocate anything in GC.
+ *
+ * The bulk version pays hashing for all keys, so it is not always faster.
+ * start_logging measures both and chooses faster one (see choose_fill_methods()).
+ */
+static VALUE gc_stat_hash;
+static VALUE gc_latest_gc_info_hash;
+
+/*
+ * Keys of GC.stat and GC.latest_gc_info are taken from the running VM
+ * (not from the Ruby which built this extension), in the order of the hash.
+ */
+static VALUE *sym_gc_stat;
+static int sym_gc_stat_num;
+static VALUE *sym_latest_gc_info;
+static int sym_latest_gc_info_num;
+
+static VALUE
+create_stat_hash(VALUE (*func)(VALUE), VALUE **syms_ptr, int *num_ptr)
+{
+    VALUE hash = rb_hash_new();
+    VALUE keys;
+    int i, n;
+
+    func(hash);
+    keys = rb_funcall(hash, rb_intern("keys"), 0);
+    n = (int)RARRAY_LEN(keys);
+    *syms_ptr = ALLOC_N(VALUE, n);
+    for (i=0; i<n; i++) {
+	(*syms_ptr)[i] = RARRAY_AREF(keys, i);
+    }
+    *num_ptr = n;
+
+    rb_obj_hide(hash);
+    rb_gc_register_mark_object(hash);
+    return hash;
+}
+
+static VALUE
+gc_stat_func(VALUE hash)
+{
+    rb_gc_stat(hash);
+    return hash;
+}
+
+struct fill_stat_data {
+    size_t *vp;
+    int rest;
+    int latest_gc_info;
+};
+
+static int
+fill_stat_i(VALUE key, VALUE val, VALUE ptr)
+{
+    struct fill_stat_data *data = (struct fill_stat_data *)ptr;
+
+    if (data->rest-- == 0) return ST_STOP;
+
+    if (data->latest_gc_info) {
+	if (STATIC_SYM_P(val)) value_sym_register(val);
+	*data->vp++ = (size_t)val;
+    }
+    else {
+	*data->vp++ = NUM2SIZET(val);
+    }
+    return ST_CONTINUE;
+}
+
+static size_t *
+fill_stat_bulk(VALUE hash, int n, int latest_gc_info, size_t *vp)
+{
+    struct fill_stat_data data;
+
+    data.vp = vp;
+    data.rest = n;
+    data.latest_gc_info = latest_gc_info;
+
+    if (latest_gc_info) rb_gc_latest_gc_info(hash);
+    else                rb_gc_stat(hash);
+
+    rb_hash_foreach(hash, fill_stat_i, (VALUE)&data);
+    return data.vp;
+}
+
+static size_t *
+fill_gc_stat(struct gc_logging *logging, size_t *vp)
+{
+    int i;
+
+    if (logging->gc_stat_bulk) {
+	if (logging->layout.gc_stat_all) {
+	    return fill_stat_bulk(gc_stat_hash, logging->layout.gc_stat_num, 0, vp);
+	}
+	rb_gc_stat(gc_stat_hash);
+	for (i=0; i<logging->layout.gc_stat_num; i++) {
+	    *vp++ = NUM2SIZET(rb_hash_lookup(gc_stat_hash, sym_gc_stat[logging->layout.gc_stat_index[i]]));
+	}
+	return vp;
+    }
+    for (i=0; i<logging->layout.gc_stat_num; i++) {
+	*vp++ = rb_gc_stat(sym_gc_stat[logging->layout.gc_stat_index[i]]);
+    }
+    return vp;
+}
+
+static size_t *
+fill_gc_latest_gc_info(struct gc_logging *logging, size_t *vp)
+{
+    int i;
+
+    if (logging->gc_latest_gc_info_bulk) {
+	if (logging->layout.gc_latest_gc_info_all) {
+	    return fill_stat_bulk(gc_latest_gc_info_hash, logging->layout.gc_latest_gc_info_num, 1, vp);
+	}
+	rb_gc_latest_gc_info(gc_latest_gc_info_hash);
+    }
+    for (i=0; i<logging->layout.gc_latest_gc_info_num; i++) {
+	VALUE sym = sym_latest_gc_info[logging->layout.gc_latest_gc_info_index[i]];
+	VALUE v = logging->gc_latest_gc_info_bulk ? rb_hash_lookup(gc_latest_gc_info_hash, sym) : rb_gc_latest_gc_info(sym);
+	if (STATIC_SYM_P(v)) value_sym_register(v);
+	*vp++ = (size_t)v;
+    }
+    return vp;
+}
+
+#ifdef HAVE_CLOCK_GETTIME
+#define FILL_METHOD_TRIALS 32
+
+static double
+measure_fill(struct gc_logging *logging, size_t *(*fill)(struct gc_logging *, size_t *))
+{
+    struct timespec t0, t1;
+    size_t *vp = logging->scratch->values;
+    int i;
+
+    fill(logging, vp); /* warm up */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<FILL_METHOD_TRIALS; i++) fill(logging, vp);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+}
+#endif
+
+static void
+choose_fill_methods(struct gc_logging *logging)
+{
+    logging->gc_stat_bulk = logging->gc_latest_gc_info_bulk = 0;
+
+#ifdef HAVE_CLOCK_GETTIME
+    if (logging->layout.gc_stat_num > 0) {
+	double each = measure_fill(logging, fill_gc_stat), bulk;
+	logging->gc_stat_bulk = 1;
+	bulk = measure_fill(logging, fill_gc_stat);
+	logging->gc_stat_bulk = bulk < each;
+    }
+    if (logging->layout.gc_latest_gc_info_num > 0) {
+	double each = measure_fill(logging, fill_gc_latest_gc_info), bulk;
+	logging->gc_latest_gc_info_bulk = 1;
+	bulk = measure_fill(logging, fill_gc_latest_gc_info);
+	logging->gc_latest_gc_info_bulk = bulk < each;
+    }
+#endif
+}
+
+/*
+ * GC.stat_heap (Ruby 3.2+): keys and the number of size pools are
+ * discovered at Init. GC.stat_heap has no C API and calls a method,
+ * so values are fetched just after each GC by a postponed job, which
+ * also logs a "stat_heap" record. Other records have the last values.
+ */
+static VALUE *sym_gc_stat_heap;
+static VALUE *sym_gc_stat_heap_columns; /* :"key_pool" for each pool and key */
+static size_t *gc_stat_heap_values;     /* ditto */
+static int gc_stat_heap_keys_num;
+static int gc_stat_heap_pools_num;
+static VALUE gc_stat_heap_hash;
+static ID id_stat_heap;
+
+static void
+setup_gc_stat_heap(void)
+{
+    VALUE all, keys;
+    int i, j;
+
+    id_stat_heap = rb_intern("stat_heap");
+    if (!rb_respond_to(rb_mGC, id_stat_heap)) return;
+
+    all = rb_funcall(rb_mGC, id_stat_heap, 0);
+    keys = rb_funcall(rb_hash_aref(all, INT2FIX(0)), rb_intern("keys"), 0);
+    gc_stat_heap_pools_num = (int)RHASH_SIZE(all);
+    gc_stat_heap_keys_num = (int)RARRAY_LEN(keys);
+
+    sym_gc_stat_heap = ALLOC_N(VALUE, gc_stat_heap_keys_num);
+    sym_gc_stat_heap_columns = ALLOC_N(VALUE, gc_stat_heap_keys_num * gc_stat_heap_pools_num);
+    gc_stat_heap_values = ZALLOC_N(size_t, gc_stat_heap_keys_num * gc_stat_heap_pools_num);
+
+    for (j=0; j<gc_stat_heap_keys_num; j++) {
+	sym_gc_stat_heap[j] = rb_to_symbol(RARRAY_AREF(keys, j));
+    }
+    for (i=0; i<gc_stat_heap_pools_num; i++) {
+	for (j=0; j<gc_stat_heap_keys_num; j++) {
+	    sym_gc_stat_heap_columns[i * gc_stat_heap_keys_num + j] =
+	      ID2SYM(rb_intern_str(rb_sprintf("%"PRIsVALUE"_%d", rb_sym2str(sym_gc_stat_heap[j]), i)));
+	}
+    }
+
+    gc_stat_heap_hash = rb_hash_new();
+    rb_gc_register_mark_object(gc_stat_heap_hash);
+}
+
+/* not in GC */
+static void
+gc_stat_heap_refresh(void)
+{
+    int i, j;
+
+    for (i=0; i<gc_stat_heap_pools_num; i++) {
+	rb_funcall(rb_mGC, id_stat_heap, 2, INT2FIX(i), gc_stat_heap_hash);
+	for (j=0; j<gc_stat_heap_keys_num; j++) {
+	    VALUE v = rb_hash_lookup2(gc_stat_heap_hash, sym_gc_stat_heap[j], INT2FIX(0));
+	    gc_stat_heap_values[i * gc_stat_heap_keys_num + j] = FIXNUM_P(v) || RB_TYPE_P(v, T_BIGNUM) ? NUM2SIZET(v) : 0;
+	}
+    }
+}
+
+static size_t *
+fill_gc_stat_heap(struct gc_logging *logging, size_t *vp)
+{
+    const struct record_layout *layout = &logging->layout;
+    int i, j;
+
+    for (i=0; i<gc_stat_heap_pools_num; i++) {
+	const size_t *values = &gc_stat_heap_values[i * gc_stat_heap_keys_num];
+	for (j=0; j<layout->gc_stat_heap_keys_num; j++) {
+	    *vp++ = values[layout->gc_stat_heap_index[j]];
+	}
+    }
+    return vp;
+}
+
+static void out_stat(struct gc_logging *logging, const char *event);
+
+static void
+gc_stat_heap_job(void *data)
+{
+    struct gc_logging *logging = (struct gc_logging *)data;
+
+    if (logging->enabled && !logging->forked && logging->layout.gc_stat_heap_num > 0) {
+	gc_stat_heap_refresh();
+	out_stat(logging, "stat_heap");
+    }
+}
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t gc_stat_heap_job_handle;
+#endif
+
+static void
+gc_stat_heap_schedule(struct gc_logging *logging)
+{
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    rb_postponed_job_trigger(gc_stat_heap_job_handle);
+#else
+    rb_postponed_job_register_one(0, gc_stat_heap_job, logging);
+#endif
+}
+
+#if HAVE_GETRUSAGE
+#define RUSAGE_COLUMNS_NUM ((int)(sizeof(sym_rusage_timeval)/sizeof(VALUE) + sizeof(sym_rusage)/sizeof(VALUE)))
+static VALUE sym_rusage_columns[RUSAGE_COLUMNS_NUM];
+
+static void
+setup_rusage_columns(void)
+{
+    int i, n = (int)(sizeof(sym_rusage_timeval)/sizeof(VALUE));
+
+    for (i=0; i<n; i++) sym_rusage_columns[i] = sym_rusage_timeval[i];
+    for (; i<RUSAGE_COLUMNS_NUM; i++) sym_rusage_columns[i] = sym_rusage[i - n];
+}
+
+static size_t *
+fill_rusage_all(size_t *vp)
+{
+    struct rusage rusage;
+    getrusage(RUSAGE_SELF, &rusage);
+
+    *vp++ = (size_t)timeval2double(&rusage.ru_utime);
+    *vp++ = (size_t)timeval2double(&rusage.ru_stime);
+
+#if HAVE_ST_RU_MAXRSS
+    *vp++ = rusage.ru_maxrss;
+#endif
+#if HAVE_ST_RU_IXRSS
+    *vp++ = rusage.ru_ixrss;
+#endif
+#if HAVE_ST_RU_IDRSS
+    *vp++ = rusage.ru_idrss;
+#endif
+#if HAVE_ST_RU_ISRSS
+    *vp++ = rusage.ru_isrss;
+#endif
+#if HAVE_ST_RU_MINFLT
+    *vp++ = rusage.ru_minflt;
+#endif
+#if HAVE_ST_RU_MAJFLT
+    *vp++ = rusage.ru_majflt;
+#endif
+#if HAVE_ST_RU_NSWAP
+    *vp++ = rusage.ru_nswap;
+#endif
+#if HAVE_ST_RU_INBLOCK
+    *vp++ = rusage.ru_inblock;
+#endif
+#if HAVE_ST_RU_OUBLOCK
+    *vp++ = rusage.ru_oublock;
+#endif
+#if HAVE_ST_RU_MSGSND
+    *vp++ = rusage.ru_msgsnd;
+#endif
+#if HAVE_ST_RU_MSGRCV
+    *vp++ = rusage.ru_msgrcv;
+#endif
+#if HAVE_ST_RU_NSIGNALS
+    *vp++ = rusage.ru_nsignals;
+#endif
+#if HAVE_ST_RU_NVCSW
+    *vp++ = rusage.ru_nvcsw;
+#endif
+#if HAVE_ST_RU_NIVCSW
+    *vp++ = rusage.ru_nivcsw;
+#endif
+
+    return vp;
+}
+
+static size_t *
+fill_rusage(struct gc_logging *logging, size_t *vp)
+{
+    size_t values[RUSAGE_COLUMNS_NUM];
+    int i;
+
+    fill_rusage_all(values);
+    for (i=0; i<logging->layout.rusage_num; i++) {
+	*vp++ = values[logging->layout.rusage_index[i]];
+    }
+    return vp;
+}
+#endif
+
+static void
+fill_record(struct gc_logging *logging, struct record *rec, const char *event)
+{
+    size_t *vp = rec->values;
+    int i;
+
+    rec->event = event;
+    /* same tick as phase_times of the event */
+    rec->tick = logging->phase.has_now ? logging->phase.now : (logging->config.get_time_func)();
+
+    vp = fill_gc_stat(logging, vp);
+    vp = fill_gc_latest_gc_info(logging, vp);
+    if (logging->layout.gc_stat_heap_num > 0) vp = fill_gc_stat_heap(logging, vp);
+#if HAVE_GETRUSAGE
+    if (logging->layout.rusage_num > 0) vp = fill_rusage(logging, vp);
+#endif
+    if (logging->layout.sample_weight_num > 0) *vp++ = logging->sample_weight;
+    for (i=0; i<logging->layout.phase_times_num; i++) {
+	*vp++ = logging->phase.completed ? (size_t)logging->phase.values[i] : 0;
+    }
+    for (i=0; i<logging->layout.rates_num; i++) *vp++ = logging->rates.values[i];
+    for (i=0; i<logging->layout.custom_fields_num; i++) {
+	struct custom_fields *cf = &logging->custom_fields;
+	int slot = logging->layout.custom_field_slots[i];
+
+	*vp++ = (size_t)ATOMIC_LOAD(CUSTOM_FIELD_VALUE(cf, slot));
+    }
+}
+
+static void
+out_binary_u8(FILE *out, int v)
+{
+    putc(v, out);
+}
+
+static void
+out_binary_u16(FILE *out, unsigned int v)
+{
+    unsigned char buf[2];
+    buf[0] = v & 0xff;
+    buf[1] = (v >> 8) & 0xff;
+    fwrite(buf, 2, 1, out);
+}
+
+static void
+out_binary_u32(FILE *out, unsigned long v)
+{
+    unsigned char buf[4];
+    int i;
+    for (i=0; i<4; i++) buf[i] = (v >> (i * 8)) & 0xff;
+    fwrite(buf, 4, 1, out);
+}
+
+static void
+out_binary_u64(FILE *out, unsigned long long v)
+{
+    unsigned char buf[8];
+    int i;
+    for (i=0; i<8; i++) buf[i] = (v >> (i * 8)) & 0xff;
+    fwrite(buf, 8, 1, out);
+}
+
+static void
+out_binary_name(FILE *out, int tag, unsigned long id, const char *name)
+{
+    size_t len = strlen(name);
+    if (len > 0xffff) len = 0xffff;
+
+    out_binary_u8(out, tag);
+    out_binary_u32(out, id);
+    out_binary_u16(out, (unsigned int)len);
+    fwrite(name, len, 1, out);
+}
+
+static struct binary_event_id *
+binary_event_id_entry(struct binary_event_id *entries, unsigned long capa, const char *event)
+{
+    unsigned long i = ((size_t)event >> 3) & (capa - 1);
+
+    while (entries[i].event != NULL && entries[i].event != event) {
+	i = (i + 1) & (capa - 1);
+    }
+    return &entries[i];
+}
+
+static void
+binary_event_ids_grow(struct binary_output *binary)
+{
+    unsigned long i, capa = binary->event_ids_capa ? binary->event_ids_capa * 2 : 64;
+    struct binary_event_id *entries = (struct binary_event_id *)calloc(capa, sizeof(struct binary_event_id));
+
+    if (entries == NULL) {
+	fprintf(stderr, "gc_tracer: can not allocate event ids\n");
+	abort();
+    }
+    for (i=0; i<binary->event_ids_capa; i++) {
+	if (binary->event_ids[i].event) {
+	    *binary_event_id_entry(entries, capa, binary->event_ids[i].event) = binary->event_ids[i];
+	}
+    }
+    free(binary->event_ids);
+    binary->event_ids = entries;
+    binary->event_ids_capa = capa;
+}
+
+static unsigned long
+binary_event_id(struct gc_logging *logging, const char *event)
+{
+    struct binary_output *binary = &logging->binary;
+    struct binary_event_id *entry;
+
+    if ((binary->event_ids_num + 1) * 2 > binary->event_ids_capa) {
+	binary_event_ids_grow(binary);
+    }
+    entry = binary_event_id_entry(binary->event_ids, binary->event_ids_capa, event);
+
+    if (entry->event == NULL) {
+	entry->event = event;
+	entry->id = binary->event_ids_num++;
+	out_binary_name(logging->out, 'E', entry->id, event);
+    }
+    return entry->id;
+}
+
+static unsigned long long
+binary_value(VALUE v)
+{
+    if (STATIC_SYM_P(v)) {
+	return ((unsigned long long)value_sym_index(v) << 1) | 1;
+    }
+    else if (FIXNUM_P(v)) {
+	return (unsigned long long)FIX2LONG(v) << 1;
+    }
+    else {
+	return (v == Qtrue ? 1 : 0) << 1;
+    }
+}
+
+static unsigned char *
+fill_ber(unsigned char *p, unsigned long long v)
+{
+    unsigned char tmp[10];
+    int n = 0;
+
+    do {
+	tmp[n++] = v & 0x7f;
+	v >>= 7;
+    } while (v);
+
+    while (n > 1) *p++ = tmp[--n] | 0x80;
+    *p++ = tmp[0];
+    return p;
+}
+
+static unsigned long long
+zigzag(unsigned long long diff)
+{
+    return (diff << 1) ^ (unsigned long long)((long long)diff >> 63);
+}
+
+static void
+out_record_binary_delta(struct gc_logging *logging, const struct record *rec, unsigned long event_id)
+{
+    const struct record_layout *layout = &logging->layout;
+    struct binary_output *binary = &logging->binary;
+    const size_t *vp = rec->values;
+    unsigned long long *prev = binary->prev_values;
+    unsigned char *p = binary->chunk;
+    int keyframe = binary->records_from_keyframe == 0;
+    int i, n = 0;
+    unsigned long long v;
+
+#define PUT_VALUE(expr) do { \
+    v = (expr); \
+    p = fill_ber(p, keyframe ? v : zigzag(v - prev[n])); \
+    prev[n++] = v; \
+} while (0)
+
+    p = fill_ber(p, event_id);
+    PUT_VALUE(rec->tick);
+    for (i=0; i<layout->gc_stat_num; i++)            PUT_VALUE(*vp++);
+    for (i=0; i<layout->gc_latest_gc_info_num; i++)  PUT_VALUE(binary_value((VALUE)*vp++));
+    for (i=0; i<layout->gc_stat_heap_num; i++)       PUT_VALUE(*vp++);
+    for (i=0; i<layout->rusage_num; i++)             PUT_VALUE(*vp++);
+    for (i=0; i<layout->sample_weight_num; i++)      PUT_VALUE(*vp++);
+    for (i=0; i<layout->phase_times_num; i++)        PUT_VALUE(*vp++);
+    for (i=0; i<layout->rates_num; i++)              PUT_VALUE(*vp++);
+    for (i=0; i<layout->custom_fields_num; i++)      PUT_VALUE((unsigned long long)(long long)(long)*vp++);
+#undef PUT_VALUE
+
+    out_binary_u8(logging->out, keyframe ? 'K' : 'D');
+    out_binary_u32(logging->out, (unsigned long)(p - binary->chunk));
+    fwrite(binary->chunk, p - binary->chunk, 1, logging->out);
+
+    if (++binary->records_from_keyframe >= binary->keyframe_interval) {
+	binary->records_from_keyframe = 0;
+    }
+}
+
+static void
+binary_setup(struct gc_logging *logging)
+{
+    struct binary_output *binary = &logging->binary;
+    int n = logging->layout.values_num + 1;
+
+    binary->syms_num = 0;
+    binary->records_from_keyframe = 0;
+    binary->keyframe_interval = logging->config.keyframe_interval;
+
+    if (logging->format == LOG_FORMAT_BINARY_DELTA) {
+	binary->prev_values = ALLOC_N(unsigned long long, n);
+	/* event id + (tick and columns) + terminator */
+	binary->chunk = ALLOC_N(unsigned char, 10 * (n + 1));
+    }
+}
+
+static void
+binary_free(struct gc_logging *logging)
+{
+    struct binary_output *binary = &logging->binary;
+
+    free(binary->event_ids);
+    binary->event_ids = NULL;
+    binary->event_ids_capa = binary->event_ids_num = 0;
+    xfree(binary->prev_values);
+    binary->prev_values = NULL;
+    xfree(binary->chunk);
+    binary->chunk = NULL;
+}
+
+static void
+out_record_binary(struct gc_logging *logging, const struct record *rec)
+{
+    const struct record_layout *layout = &logging->layout;
+    struct binary_output *binary = &logging->binary;
+    const size_t *vp = rec->values;
+    unsigned long event_id = binary_event_id(logging, rec->event);
+    int i, syms_num = ATOMIC_LOAD(value_syms_num);
+
+    for (; binary->syms_num < syms_num; binary->syms_num++) {
+	out_binary_name(logging->out, 'S', binary->syms_num, value_syms[binary->syms_num].name);
+    }
+
+    if (logging->format == LOG_FORMAT_BINARY_DELTA) {
+	out_record_binary_delta(logging, rec, event_id);
+	return;
+    }
+
+    out_binary_u8(logging->out, 'R');
+    out_binary_u32(logging->out, event_id);
+    out_binary_u64(logging->out, rec->tick);
+
+    for (i=0; i<layout->gc_stat_num; i++)            out_binary_u64(logging->out, *vp++);
+    for (i=0; i<layout->gc_latest_gc_info_num; i++)  out_binary_u64(logging->out, binary_value((VALUE)*vp++));
+    for (i=0; i<layout->gc_stat_heap_num; i++)       out_binary_u64(logging->out, *vp++);
+    for (i=0; i<layout->rusage_num; i++)             out_binary_u64(logging->out, *vp++);
+    for (i=0; i<layout->sample_weight_num; i++)      out_binary_u64(logging->out, *vp++);
+    for (i=0; i<layout->phase_times_num; i++)        out_binary_u64(logging->out, *vp++);
+    for (i=0; i<layout->rates_num; i++)              out_binary_u64(logging->out, *vp++);
+    for (i=0; i<layout->custom_fields_num; i++)      out_binary_u64(logging->out, (unsigned long long)(long long)(long)*vp++);
+}
+
+/*
+ * TSV records are built into logging->line and written by one fwrite(),
+ * instead of fprintf() for each value (same output as out_sizet() and so on).
+ */
+static const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/* libc realloc: it is called in GC hooks */
+static char *
+line_reserve(struct line_buffer *lb, size_t n)
+{
+    if (lb->len + n > lb->capa) {
+	size_t capa = lb->capa ? lb->capa * 2 : 256;
+	char *ptr;
+	while (capa < lb->len + n) capa *= 2;
+	if ((ptr = realloc(lb->ptr, capa)) == NULL) {
+	    fprintf(stderr, "gc_tracer: can not allocate a line buffer\n");
+	    abort();
+	}
+	lb->ptr = ptr;
+	lb->capa = capa;
+    }
+    return lb->ptr + lb->len;
+}
+
+/* "%llu\t" */
+static void
+line_ull(struct line_buffer *lb, unsigned long long v)
+{
+    char tmp[24], *p = tmp + sizeof(tmp);
+    size_t n;
+
+    *--p = '\t';
+    while (v >= 100) {
+	const char *d = &digit_pairs[(v % 100) * 2];
+	v /= 100;
+	*--p = d[1];
+	*--p = d[0];
+    }
+    if (v >= 10) {
+	const char *d = &digit_pairs[v * 2];
+	*--p = d[1];
+	*--p = d[0];
+    }
+    else {
+	*--p = (char)('0' + v);
+    }
+
+    n = tmp + sizeof(tmp) - p;
+    memcpy(line_reserve(lb, n), p, n);
+    lb->len += n;
+}
+
+/* "%ld\t" */
+static void
+line_long(struct line_buffer *lb, long l)
+{
+    if (l < 0) {
+	*line_reserve(lb, 1) = '-';
+	lb->len++;
+	line_ull(lb, -(unsigned long long)l);
+    }
+    else {
+	line_ull(lb, (unsigned long long)l);
+    }
+}
+
+/* "%s\t" */
+static void
+line_str(struct line_buffer *lb, const char *str)
+{
+    size_t n = strlen(str);
+    char *p = line_reserve(lb, n + 1);
+    memcpy(p, str, n);
+    p[n] = '\t';
+    lb->len += n + 1;
+}
+
+/* same as out_obj(), but does not use Ruby API */
+static void
+line_value(struct line_buffer *lb, VALUE obj)
+{
+    if (STATIC_SYM_P(obj)) {
+	line_str(lb, value_sym_name(obj));
+    }
+    else if (FIXNUM_P(obj)) {
+	line_ull(lb, (unsigned long)FIX2LONG(obj));
+    }
+    else {
+	line_ull(lb, obj == Qtrue ? 1 : 0);
+    }
+}
+
+static void
+out_record(struct gc_logging *logging, const struct record *rec)
+{
+    const struct record_layout *layout = &logging->layout;
+    const size_t *vp = rec->values;
+    int i;
+
+    if (logging->format != LOG_FORMAT_TSV) {
+	out_record_binary(logging, rec);
+    }
+    else {
+	struct line_buffer *lb = &logging->line;
+
+	lb->len = 0;
+	line_str(lb, rec->event);
+	line_ull(lb, rec->tick);
+
+	for (i=0; i<layout->gc_stat_num; i++)            line_ull(lb, (unsigned long)*vp++);
+	for (i=0; i<layout->gc_latest_gc_info_num; i++)  line_value(lb, (VALUE)*vp++);
+	for (i=0; i<layout->gc_stat_heap_num; i++)       line_ull(lb, (unsigned long)*vp++);
+	for (i=0; i<layout->rusage_num; i++)             line_ull(lb, (unsigned long)*vp++);
+	for (i=0; i<layout->sample_weight_num; i++)      line_ull(lb, (unsigned long)*vp++);
+	for (i=0; i<layout->phase_times_num; i++)        line_ull(lb, (unsigned long)*vp++);
+	for (i=0; i<layout->rates_num; i++)              line_ull(lb, (unsigned long)*vp++);
+	for (i=0; i<layout->custom_fields_num; i++)      line_long(lb, (long)*vp++);
+
+	*line_reserve(lb, 1) = '\n';
+	lb->len++;
+	fwrite(lb->ptr, lb->len, 1, logging->out);
+    }
+
+#if USE_MMAP_OUTPUT
+    /* publish each record */
+    if (logging->mmap.map) fflush(logging->out);
+#endif
+#if USE_LOG_ROTATION
+    if (logging->rotate && !logging->rotating.pending && logging->rotating.written >= logging->config.max_size) {
+	/* rotate_output_pending() rotates it outside of GC */
+	logging->rotating.pending = 1;
+	if (!logging->async) buffer_schedule_flush(logging);
+    }
+#endif
+}
+
+static int
+key_index(VALUE key, const VALUE *syms, int n)
+{
+    int i;
+    for (i=0; i<n; i++) {
+	if (syms[i] == key) return i;
+    }
+    return -1;
+}
+
+/* returns indexes of selected keys (all keys if keys is nil) */
+static int *
+select_keys(int enabled, VALUE keys, const VALUE *syms, int n, int *num_ptr, int *all_ptr)
+{
+    int i, num = 0;
+    int *index;
+
+    if (!enabled) {
+	num = 0;
+	index = NULL;
+    }
+    else if (NIL_P(keys)) {
+	num = n;
+	index = ALLOC_N(int, n);
+	for (i=0; i<n; i++) index[i] = i;
+    }
+    else {
+	num = (int)RARRAY_LEN(keys);
+	index = ALLOC_N(int, num);
+	for (i=0; i<num; i++) index[i] = key_index(RARRAY_AREF(keys, i), syms, n);
+    }
+
+    *num_ptr = num;
+    if (all_ptr) *all_ptr = enabled && NIL_P(keys);
+    return index;
+}
+
+static void
+free_record_layout(struct gc_logging *logging)
+{
+    struct record_layout *layout = &logging->layout;
+
+    xfree(layout->gc_stat_index);
+    xfree(layout->gc_latest_gc_info_index);
+    xfree(layout->gc_stat_heap_index);
+    xfree(layout->rusage_index);
+    xfree(layout->custom_field_slots);
+    layout->gc_stat_index = layout->gc_latest_gc_info_index = layout->gc_stat_heap_index = layout->rusage_index = NULL;
+    layout->custom_field_slots = NULL;
+}
+
+static void
+setup_record_layout(struct gc_logging *logging)
+{
+    struct record_layout *layout = &logging->layout;
+    int i;
+
+    layout->gc_stat_index = select_keys(logging->config.log_gc_stat, logging->config.gc_stat_keys,
+					sym_gc_stat, sym_gc_stat_num,
+					&layout->gc_stat_num, &layout->gc_stat_all);
+    layout->gc_latest_gc_info_index = select_keys(logging->config.log_gc_latest_gc_info, logging->config.gc_latest_gc_info_keys,
+						  sym_latest_gc_info, sym_latest_gc_info_num,
+						  &layout->gc_latest_gc_info_num, &layout->gc_latest_gc_info_all);
+    layout->gc_stat_heap_index = select_keys(logging->config.log_gc_stat_heap, logging->config.gc_stat_heap_keys,
+					     sym_gc_stat_heap, gc_stat_heap_keys_num,
+					     &layout->gc_stat_heap_keys_num, NULL);
+    layout->gc_stat_heap_num = layout->gc_stat_heap_keys_num * gc_stat_heap_pools_num;
+#if HAVE_GETRUSAGE
+    layout->rusage_index = select_keys(logging->config.log_rusage, logging->config.rusage_keys,
+				       sym_rusage_columns, RUSAGE_COLUMNS_NUM,
+				       &layout->rusage_num, NULL);
+#else
+    layout->rusage_index = NULL;
+    layout->rusage_num = 0;
+#endif
+    layout->sample_weight_num = logging->config.sample_rate > 1 ? 1 : 0;
+    layout->phase_times_num = logging->config.phase_times ? PHASE_TIMES_NUM : 0;
+    layout->rates_num = logging->config.rates_window > 0 ? RATES_NUM : 0;
+    layout->custom_fields_num = logging->custom_fields.num;
+    layout->custom_field_slots = ALLOC_N(int, layout->custom_fields_num + 1);
+    if (layout->custom_fields_num > 0) MEMCPY(layout->custom_field_slots, logging->custom_fields.columns, int, layout->custom_fields_num);
+    layout->custom_fields_reset_num = 0;
+    for (i=0; i<layout->custom_fields_num; i++) {
+	int kind = CUSTOM_FIELD_KIND(&logging->custom_fields, layout->custom_field_slots[i]);
+	if (kind == CUSTOM_FIELD_MAX || kind == CUSTOM_FIELD_SUM) layout->custom_fields_reset_num++;
+    }
+    layout->values_num = layout->gc_stat_num + layout->gc_latest_gc_info_num + layout->gc_stat_heap_num + layout->rusage_num +
+      layout->sample_weight_num + layout->phase_times_num + layout->rates_num + layout->custom_fields_num;
+    layout->record_size = sizeof(struct record) + sizeof(size_t) * layout->values_num;
+}
+
+static struct record *
+buffer_record(struct record_buffer *buffer, const struct record_layout *layout, size_t pos)
+{
+    return (struct record *)(buffer->records + layout->record_size * (pos % buffer->capacity));
+}
+
+/* records before it can be written (the flight recorder keeps others) */
+static size_t
+buffer_release_pos(struct gc_logging *logging)
+{
+    return logging->flight_recording ? logging->flight.release_pos : logging->buffer.push_pos;
+}
+
+static void
+buffer_flush(struct gc_logging *logging)
+{
+    struct record_buffer *buffer = &logging->buffer;
+    size_t release_pos = buffer_release_pos(logging);
+    size_t pos;
+
+    for (pos = buffer->pop_pos; pos != release_pos; pos++) {
+	out_record(logging, buffer_record(buffer, &logging->layout, pos));
+    }
+    buffer->pop_pos = pos;
+}
+
+#if USE_LOG_ROTATION
+static void rotate_output_pending(struct gc_logging *logging);
+#endif
+
+static void
+buffer_flush_job(void *data)
+{
+    struct gc_logging *logging = (struct gc_logging *)data;
+
+    if (logging->enabled && !logging->async && !logging->forked) {
+	if (logging->buffer.capacity > 0) buffer_flush(logging);
+#if USE_LOG_ROTATION
+	rotate_output_pending(logging);
+#endif
+    }
+}
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t buffer_flush_job_handle;
+#endif
+
+static void
+buffer_schedule_flush(struct gc_logging *logging)
+{
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    rb_postponed_job_trigger(buffer_flush_job_handle);
+#else
+    rb_postponed_job_register_one(0, buffer_flush_job, logging);
+#endif
+}
+
+#if USE_ASYNC_LOGGING
+static void
+async_writer_wakeup(struct gc_logging *logging)
+{
+    /* do not take a lock: the writer also wakes up periodically */
+    pthread_cond_signal(&logging->writer.wakeup_cond);
+}
+#endif
+
+static void
+buffer_push(struct gc_logging *logging, const char *event)
+{
+    struct record_buffer *buffer = &logging->buffer;
+    size_t push_pos = buffer->push_pos;
+
+#if USE_ASYNC_LOGGING
+    if (logging->async) {
+	size_t pop_pos = ATOMIC_LOAD(buffer->pop_pos);
+
+	if (push_pos - pop_pos == buffer->capacity) {
+	    /* never wait for the writer */
+	    buffer->dropped++;
+	}
+	else {
+	    fill_record(logging, buffer_record(buffer, &logging->layout, push_pos), event);
+	    ATOMIC_STORE(buffer->push_pos, push_pos + 1);
+	    if (push_pos == pop_pos) async_writer_wakeup(logging);
+	}
+	return;
+    }
+#endif
+
+    if (push_pos - buffer->pop_pos == buffer->capacity) {
+	if (logging->flight_recording && buffer->pop_pos == logging->flight.release_pos) {
+	    /* forget the oldest record */
+	    buffer->pop_pos = ++logging->flight.release_pos;
+	}
+	else {
+	    /* no space: never write them out in GC */
+	    buffer->dropped++;
+	    return;
+	}
+    }
+
+    fill_record(logging, buffer_record(buffer, &logging->layout, push_pos), event);
+    buffer->push_pos = push_pos + 1;
+
+    if (logging->flight_recording && logging->flight.remaining > 0) {
+	/* records after a slow GC */
+	logging->flight.release_pos = buffer->push_pos;
+	if (--logging->flight.remaining == 0) buffer_schedule_flush(logging);
+    }
+
+    /* write out buffered records after this GC */
+    if ((buffer_release_pos(logging) - buffer->pop_pos) * 2 >= buffer->capacity) {
+	buffer_schedule_flush(logging);
+    }
+}
+
+#if USE_ASYNC_LOGGING
+#define ASYNC_WRITER_INTERVAL_MSEC 10
+#define ASYNC_DEFAULT_BUFFER_SIZE  4096
+
+/* the writer thread owns logging->out while it is running */
+static void *
+async_writer_main(void *ptr)
+{
+    struct gc_logging *logging = (struct gc_logging *)ptr;
+    struct record_buffer *buffer = &logging->buffer;
+    struct async_writer *writer = &logging->writer;
+
+    while (1) {
+	size_t push_pos = ATOMIC_LOAD(buffer->push_pos);
+	size_t pos = buffer->pop_pos;
+	int stop = ATOMIC_LOAD(writer->stop);
+
+	if (pos != push_pos) {
+	    for (; pos != push_pos; pos++) {
+		out_record(logging, buffer_record(buffer, &logging->layout, pos));
+#if USE_LOG_ROTATION
+		rotate_output_pending(logging);
+#endif
+	    }
+	    ATOMIC_STORE(buffer->pop_pos, pos);
+	    continue;
+	}
+
+	out_flush(logging->out);
+
+	pthread_mutex_lock(&writer->lock);
+	{
+	    writer->flushed_pos = pos;
+	    pthread_cond_broadcast(&writer->flushed_cond);
+
+	    if (stop) {
+		pthread_mutex_unlock(&writer->lock);
+		break;
+	    }
+	    else {
+		struct timeval tv;
+		struct timespec ts;
+
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = (tv.tv_usec + ASYNC_WRITER_INTERVAL_MSEC * 1000) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+		    ts.tv_sec++;
+		    ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&writer->wakeup_cond, &writer->lock, &ts);
+	    }
+	}
+	pthread_mutex_unlock(&writer->lock);
+    }
+
+    return NULL;
+}
+
+static int
+async_writer_create(struct gc_logging *logging)
+{
+    struct async_writer *writer = &logging->writer;
+
+    writer->stop = 0;
+    writer->flushed_pos = ATOMIC_LOAD(logging->buffer.pop_pos);
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wakeup_cond, NULL);
+    pthread_cond_init(&writer->flushed_cond, NULL);
+
+    return pthread_create(&writer->thread, NULL, async_writer_main, logging);
+}
+
+static void
+async_writer_start(struct gc_logging *logging)
+{
+    if (async_writer_create(logging) != 0) {
+	rb_sys_fail("pthread_create");
+    }
+}
+
+static void *
+async_writer_wait_flushed_i(void *ptr)
+{
+    struct gc_logging *logging = (struct gc_logging *)ptr;
+    struct async_writer *writer = &logging->writer;
+    size_t target_pos = ATOMIC_LOAD(logging->buffer.push_pos);
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->flushed_pos < target_pos) {
+	pthread_cond_signal(&writer->wakeup_cond);
+	pthread_cond_wait(&writer->flushed_cond, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+static void
+async_writer_wait_flushed(struct gc_logging *logging)
+{
+    rb_thread_call_without_gvl(async_writer_wait_flushed_i, logging, NULL, NULL);
+}
+
+static void *
+async_writer_stop_i(void *ptr)
+{
+    struct gc_logging *logging = (struct gc_logging *)ptr;
+    struct async_writer *writer = &logging->writer;
+
+    pthread_mutex_lock(&writer->lock);
+    ATOMIC_STORE(writer->stop, 1);
+    pthread_cond_signal(&writer->wakeup_cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    return NULL;
+}
+
+static void
+async_writer_destroy(struct gc_logging *logging)
+{
+    struct async_writer *writer = &logging->writer;
+
+    pthread_cond_destroy(&writer->flushed_cond);
+    pthread_cond_destroy(&writer->wakeup_cond);
+    pthread_mutex_destroy(&writer->lock);
+}
+
+static void
+async_writer_stop(struct gc_logging *logging)
+{
+    rb_thread_call_without_gvl(async_writer_stop_i, logging, NULL, NULL);
+    async_writer_destroy(logging);
+}
+#endif
+
+/* layout and records (empty) */
+static void
+buffer_setup_records(struct gc_logging *logging)
+{
+    struct record_buffer *buffer = &logging->buffer;
+
+    setup_record_layout(logging);
+    logging->scratch = (struct record *)xmalloc(logging->layout.record_size);
+    choose_fill_methods(logging);
+
+    buffer->capacity = logging->config.buffer_size;
+    logging->flight_recording = logging->config.flight_records > 0;
+    if (logging->flight_recording) buffer->capacity = logging->config.flight_records;
+    logging->flight.release_pos = 0;
+#if USE_ASYNC_LOGGING
+    if (logging->config.async && buffer->capacity == 0) buffer->capacity = ASYNC_DEFAULT_BUFFER_SIZE;
+#endif
+    buffer->push_pos = buffer->pop_pos = 0;
+    buffer->records = buffer->capacity > 0 ? (char *)xmalloc2(buffer->capacity, logging->layout.record_size) : NULL;
+}
+
+static void
+buffer_setup(struct gc_logging *logging)
+{
+    struct record_buffer *buffer = &logging->buffer;
+
+    buffer->dropped = 0;
+    MEMZERO(&logging->flight, struct flight_state, 1);
+    buffer_setup_records(logging);
+}
+
+static int
+free_event_name_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    free((char *)key);
+    return ST_DELETE;
+}
+
+static void
+buffer_free_records(struct gc_logging *logging)
+{
+    struct record_buffer *buffer = &logging->buffer;
+
+    xfree(logging->scratch);
+    logging->scratch = NULL;
+    free_record_layout(logging);
+    xfree(buffer->records);
+    buffer->records = NULL;
+    buffer->capacity = 0;
+}
+
+static void
+buffer_free(struct gc_logging *logging)
+{
+    buffer_free_records(logging);
+    free(logging->line.ptr);
+    logging->line.ptr = NULL;
+    logging->line.len = logging->line.capa = 0;
+
+    if (logging->event_names) {
+	st_foreach(logging->event_names, free_event_name_i, 0);
+	st_free_table(logging->event_names);
+	logging->event_names = NULL;
+    }
+}
+
+/* custom event names should live until they are output (async mode) or
+ * while they are used as keys of binary event ids */
+static const char *
+intern_event_name(struct gc_logging *logging, const char *event)
+{
+    st_data_t key;
+
+    if (logging->event_names == NULL) {
+	logging->event_names = st_init_strtable();
+    }
+    if (st_lookup(logging->event_names, (st_data_t)event, &key)) {
+	return (const char *)key;
+    }
+    else {
+	char *name = strdup(event);
+	st_insert(logging->event_names, (st_data_t)name, (st_data_t)name);
+	return name;
+    }
+}
+
+static void
+logging_flush(struct gc_logging *logging)
+{
+#if USE_ASYNC_LOGGING
+    if (logging->async) {
+	async_writer_wait_flushed(logging);
+	return;
+    }
+#endif
+    if (logging->buffer.capacity > 0) buffer_flush(logging);
+#if USE_LOG_ROTATION
+    rotate_output_pending(logging);
+#endif
+    out_flush(logging->out);
+}
+
+static void
+out_stat(struct gc_logging *logging, const char *event)
+{
+    if (logging->async || logging->flight_recording) {
+	buffer_push(logging, event);
+	return;
+    }
+    if (logging->buffer.capacity > 0) {
+	/* keep order of records */
+	buffer_flush(logging);
+    }
+    fill_record(logging, logging->scratch, event);
+    out_record(logging, logging->scratch);
+}
+
+static void
+logging_start_i(VALUE tpval, struct gc_logging *logging)
+{
+    if (logging->forked) return;
+
+    if (logging->buffer.capacity > 0) {
+	buffer_push(logging, logging->event);
+    }
+    else {
+	out_stat(logging, logging->event);
+    }
+}
+
+static void
+out_header_each(struct gc_logging *logging, const VALUE *syms, const int *index, int n)
+{
+    int i;
+    for (i=0; i<n; i++) {
+	out_obj(logging->out, syms[index[i]]);
+    }
+}
+
+static void
+out_header_binary_each(struct gc_logging *logging, int kind, const VALUE *syms, const int *index, int n)
+{
+    int i;
+    for (i=0; i<n; i++) {
+	const char *name = rb_id2name(SYM2ID(index ? syms[index[i]] : syms[i]));
+	size_t len = strlen(name);
+	out_binary_u8(logging->out, kind);
+	out_binary_u16(logging->out, (unsigned int)len);
+	fwrite(name, len, 1, logging->out);
+    }
+}
+
+static void
+out_header_binary(struct gc_logging *logging)
+{
+    const struct record_layout *layout = &logging->layout;
+    int i;
+
+    fwrite(BINARY_FORMAT_MAGIC, 8, 1, logging->out);
+    out_binary_u32(logging->out, logging->format == LOG_FORMAT_BINARY_DELTA ? BINARY_DELTA_FORMAT_VERSION : BINARY_FORMAT_VERSION);
+    out_binary_u32(logging->out, layout->values_num);
+
+    out_header_binary_each(logging, BINARY_COLUMN_UNSIGNED, sym_gc_stat, layout->gc_stat_index, layout->gc_stat_num);
+    out_header_binary_each(logging, BINARY_COLUMN_VALUE, sym_latest_gc_info, layout->gc_latest_gc_info_index, layout->gc_latest_gc_info_num);
+    for (i=0; i<gc_stat_heap_pools_num && layout->gc_stat_heap_num > 0; i++) {
+	out_header_binary_each(logging, BINARY_COLUMN_UNSIGNED, &sym_gc_stat_heap_columns[i * gc_stat_heap_keys_num],
+			       layout->gc_stat_heap_index, layout->gc_stat_heap_keys_num);
+    }
+#if HAVE_GETRUSAGE
+    out_header_binary_each(logging, BINARY_COLUMN_UNSIGNED, sym_rusage_columns, layout->rusage_index, layout->rusage_num);
+#endif
+    if (layout->sample_weight_num > 0) {
+	VALUE sym = ID2SYM(rb_intern("sample_weight"));
+	out_header_binary_each(logging, BINARY_COLUMN_UNSIGNED, &sym, NULL, 1);
+    }
+    out_header_binary_each(logging, BINARY_COLUMN_UNSIGNED, sym_phase_times, NULL, layout->phase_times_num);
+    out_header_binary_each(logging, BINARY_COLUMN_UNSIGNED, sym_rates, NULL, layout->rates_num);
+    for (i=0; i<layout->custom_fields_num; i++) {
+	VALUE sym = ID2SYM(CUSTOM_FIELD_NAME(&logging->custom_fields, layout->custom_field_slots[i]));
+	out_header_binary_each(logging, BINARY_COLUMN_SIGNED, &sym, NULL, 1);
+    }
+}
+
+static void
+out_header(struct gc_logging *logging)
+{
+    if (logging->format != LOG_FORMAT_TSV) {
+	out_header_binary(logging);
+	return;
+    }
+
+    out_str(logging->out, "type");
+    out_str(logging->out, "tick");
+
+    out_header_each(logging, sym_gc_stat, logging->layout.gc_stat_index, logging->layout.gc_stat_num);
+    out_header_each(logging, sym_latest_gc_info, logging->layout.gc_latest_gc_info_index, logging->layout.gc_latest_gc_info_num);
+    if (logging->layout.gc_stat_heap_num > 0) {
+	int i;
+	for (i=0; i<gc_stat_heap_pools_num; i++) {
+	    out_header_each(logging, &sym_gc_stat_heap_columns[i * gc_stat_heap_keys_num],
+			    logging->layout.gc_stat_heap_index, logging->layout.gc_stat_heap_keys_num);
+	}
+    }
+#if HAVE_GETRUSAGE
+    out_header_each(logging, sym_rusage_columns, logging->layout.rusage_index, logging->layout.rusage_num);
+#endif
+    if (logging->layout.sample_weight_num > 0) {
+	out_str(logging->out, "sample_weight");
+    }
+    if (logging->layout.phase_times_num > 0) {
+	int i;
+	for (i=0; i<logging->layout.phase_times_num; i++) out_obj(logging->out, sym_phase_times[i]);
+    }
+    if (logging->layout.rates_num > 0) {
+	int i;
+	for (i=0; i<logging->layout.rates_num; i++) out_obj(logging->out, sym_rates[i]);
+    }
+    if (logging->layout.custom_fields_num > 0) {
+	int i;
+	for (i=0; i<logging->layout.custom_fields_num; i++) {
+	    out_str(logging->out, rb_id2name(CUSTOM_FIELD_NAME(&logging->custom_fields, logging->layout.custom_field_slots[i])));
+	}
+    }
+    out_terminate(logging->out);
+}
+
+#if USE_MMAP_OUTPUT
+static struct mmap_trailer *
+mmap_trailer(struct mmap_output *mo)
+{
+    return (struct mmap_trailer *)(mo->map + mo->capa);
+}
+
+#if defined(HAVE_FOPENCOOKIE)
+static ssize_t
+mmap_output_write(void *cookie, const char *buf, size_t size)
+#else
+static int
+mmap_output_write(void *cookie, const char *buf, int size)
+#endif
+{
+    struct mmap_output *mo = (struct mmap_output *)cookie;
+
+    /* stdio writes a whole record at once (flushed for each record) */
+    if (mo->tail + size > mo->capa) {
+	mo->dropped++;
+    }
+    else {
+	memcpy(mo->map + mo->tail, buf, size);
+	mo->tail += size;
+	ATOMIC_STORE(mmap_trailer(mo)->tail, (unsigned long long)mo->tail);
+    }
+    return size;
+}
+
+static int
+mmap_output_close(void *cookie)
+{
+    struct mmap_output *mo = (struct mmap_output *)cookie;
+    int fd = fileno(mo->file);
+
+    /* map is NULL if it was detached in a child process */
+    if (mo->map) {
+	munmap(mo->map, mo->capa + sizeof(struct mmap_trailer));
+	mo->map = NULL;
+	if (ftruncate(fd, (off_t)mo->tail) != 0) {
+	    /* ignore */
+	}
+    }
+    return fclose(mo->file);
+}
+
+static void
+mmap_output_open(struct gc_logging *logging)
+{
+    struct mmap_output *mo = &logging->mmap;
+    /* align the trailer for atomic stores of u64 */
+    size_t capa = (logging->config.mmap_size + sizeof(unsigned long long) - 1) & ~(sizeof(unsigned long long) - 1);
+    struct mmap_trailer *trailer;
+    int fd;
+    FILE *out;
+
+    if (logging->out_filename == NULL) {
+	rb_raise(rb_eArgError, "mmap output requires a file.");
+    }
+
+    /* reopen to read and write (required by mmap) */
+    if ((mo->file = freopen(logging->out_filename, "w+", logging->out)) == NULL) {
+	logging->out = stderr;
+	rb_sys_fail(logging->out_filename);
+    }
+    logging->out = mo->file;
+    fd = fileno(mo->file);
+    if (ftruncate(fd, (off_t)(capa + sizeof(struct mmap_trailer))) != 0) {
+	rb_sys_fail("ftruncate");
+    }
+    mo->map = mmap(NULL, capa + sizeof(struct mmap_trailer), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mo->map == MAP_FAILED) {
+	mo->map = NULL;
+	rb_sys_fail("mmap");
+    }
+    mo->capa = capa;
+    mo->tail = 0;
+    mo->dropped = 0;
+
+    trailer = mmap_trailer(mo);
+    memcpy(trailer->magic, MMAP_OUTPUT_MAGIC, 8);
+    trailer->capa = capa;
+    ATOMIC_STORE(trailer->tail, 0);
+
+#if defined(HAVE_FOPENCOOKIE)
+    {
+	cookie_io_functions_t funcs = {NULL, mmap_output_write, NULL, mmap_output_close};
+	out = fopencookie(mo, "w", funcs);
+    }
+#else
+    out = funopen(mo, NULL, mmap_output_write, NULL, mmap_output_close);
+#endif
+    if (out == NULL) {
+	munmap(mo->map, capa + sizeof(struct mmap_trailer));
+	mo->map = NULL;
+	rb_sys_fail("mmap output");
+    }
+    setvbuf(out, NULL, _IOFBF, MMAP_OUTPUT_STDIO_BUFFER_SIZE);
+    logging->out = out;
+}
+#endif
+
+#if USE_LOG_ROTATION
+#if defined(HAVE_FOPENCOOKIE)
+static ssize_t
+rotating_output_write(void *cookie, const char *buf, size_t size)
+#else
+static int
+rotating_output_write(void *cookie, const char *buf, int size)
+#endif
+{
+    struct rotating_output *ro = (struct rotating_output *)cookie;
+    size_t rest = size;
+
+    if (ro->fd < 0) return size; /* a segment can not be opened: drop */
+
+    while (rest > 0) {
+	ssize_t n = write(ro->fd, buf, rest);
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    if (rest == (size_t)size) return -1;
+	    break;
+	}
+	buf += n;
+	rest -= n;
+	ro->written += n;
+    }
+    return size - rest;
+}
+
+static int
+rotating_output_close(void *cookie)
+{
+    struct rotating_output *ro = (struct rotating_output *)cookie;
+    int r = ro->fd >= 0 ? close(ro->fd) : 0;
+    ro->fd = -1;
+    return r;
+}
+
+static void
+segment_name(char *buff, size_t size, const char *filename, int seq, const char *suffix)
+{
+    snprintf(buff, size, "%s.%d%s", filename, seq, suffix);
+}
+
+#if USE_LOG_COMPRESSION
+struct compress_job {
+    struct gc_logging *logging;
+    char filename[FILENAME_MAX];
+    int seq;
+};
+
+static void
+compress_segment_done(struct gc_logging *logging)
+{
+    struct rotating_output *ro = &logging->rotating;
+
+    pthread_mutex_lock(&ro->compress_lock);
+    if (--ro->compressing == 0) pthread_cond_broadcast(&ro->compress_cond);
+    pthread_mutex_unlock(&ro->compress_lock);
+}
+
+static void *
+compress_segment_main(void *ptr)
+{
+    struct compress_job *job = (struct compress_job *)ptr;
+    struct gc_logging *logging = job->logging;
+    char gz_name[FILENAME_MAX], tmp_name[FILENAME_MAX];
+    char buff[64 * 1024];
+    FILE *in;
+    gzFile gz;
+    size_t n;
+
+    snprintf(gz_name, sizeof(gz_name), "%s.gz", job->filename);
+    snprintf(tmp_name, sizeof(tmp_name), "%s.gz.tmp", job->filename);
+
+    if ((in = fopen(job->filename, "rb")) != NULL) {
+	if ((gz = gzopen(tmp_name, "wb")) != NULL) {
+	    while ((n = fread(buff, 1, sizeof(buff), in)) > 0) {
+		gzwrite(gz, buff, (unsigned)n);
+	    }
+	    if (gzclose(gz) == Z_OK && rename(tmp_name, gz_name) == 0) {
+		unlink(job->filename);
+	    }
+	}
+	fclose(in);
+
+	/* removed while compressing */
+	if (logging->config.max_files > 0 && job->seq <= ATOMIC_LOAD(logging->rotating.seq) - logging->config.max_files) {
+	    unlink(gz_name);
+	}
+    }
+
+    compress_segment_done(logging);
+    free(job);
+    return NULL;
+}
+
+static void
+compress_segment(struct gc_logging *logging, const char *filename, int seq)
+{
+    struct compress_job *job = malloc(sizeof(struct compress_job));
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (job == NULL) return;
+    job->logging = logging;
+    job->seq = seq;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+
+    pthread_mutex_lock(&logging->rotating.compress_lock);
+    logging->rotating.compressing++;
+    pthread_mutex_unlock(&logging->rotating.compress_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, compress_segment_main, job) != 0) {
+	compress_segment_done(logging);
+	free(job);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void *
+compress_wait_i(void *ptr)
+{
+    struct rotating_output *ro = &((struct gc_logging *)ptr)->rotating;
+
+    pthread_mutex_lock(&ro->compress_lock);
+    while (ro->compressing > 0) {
+	pthread_cond_wait(&ro->compress_cond, &ro->compress_lock);
+    }
+    pthread_mutex_unlock(&ro->compress_lock);
+    return NULL;
+}
+#endif
+
+/* re-define events and symbols in a new segment of binary formats */
+static void
+binary_restart(struct gc_logging *logging)
+{
+    struct binary_output *binary = &logging->binary;
+    unsigned long i;
+    int j;
+
+    for (i=0; i<binary->event_ids_capa; i++) {
+	if (binary->event_ids[i].event) {
+	    out_binary_name(logging->out, 'E', binary->event_ids[i].id, binary->event_ids[i].event);
+	}
+    }
+    for (j=0; j<binary->syms_num; j++) {
+	out_binary_name(logging->out, 'S', j, value_syms[j].name);
+    }
+    binary->records_from_keyframe = 0;
+}
+
+/* called at a record boundary (by the writer thread, or out of GC) */
+static void
+rotate_output_pending(struct gc_logging *logging)
+{
+    struct rotating_output *ro = &logging->rotating;
+    char name[FILENAME_MAX];
+    int seq = ro->seq + 1;
+
+    if (!logging->rotate || !ro->pending) return;
+    ro->pending = 0;
+
+    fflush(logging->out);
+    if (ro->fd >= 0) close(ro->fd);
+
+    segment_name(name, sizeof(name), logging->out_filename, seq, "");
+    rename(logging->out_filename, name);
+    ATOMIC_STORE(ro->seq, seq);
+
+    if (logging->config.max_files > 0 && seq - logging->config.max_files > 0) {
+	char old[FILENAME_MAX];
+	segment_name(old, sizeof(old), logging->out_filename, seq - logging->config.max_files, "");
+	unlink(old);
+	segment_name(old, sizeof(old), logging->out_filename, seq - logging->config.max_files, ".gz");
+	unlink(old);
+    }
+
+    ro->fd = open(logging->out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    ro->written = 0;
+    fwrite(ro->header, ro->header_len, 1, logging->out);
+    if (logging->format != LOG_FORMAT_TSV) binary_restart(logging);
+
+#if USE_LOG_COMPRESSION
+    if (logging->config.compress) compress_segment(logging, name, seq);
+#endif
+}
+
+static void out_header(struct gc_logging *logging);
+
+/* render the header only once, because it uses the Ruby API */
+static void
+rotating_output_render_header(struct gc_logging *logging)
+{
+    struct rotating_output *ro = &logging->rotating;
+    FILE *tmp, *out = logging->out;
+    long len;
+
+    if ((tmp = tmpfile()) == NULL) rb_sys_fail("tmpfile");
+    logging->out = tmp;
+    out_header(logging);
+    logging->out = out;
+    fflush(tmp);
+    len = ftell(tmp);
+    rewind(tmp);
+    free(ro->header);
+    ro->header = malloc(len > 0 ? len : 1);
+    ro->header_len = ro->header ? fread(ro->header, 1, len, tmp) : 0;
+    fclose(tmp);
+}
+
+static void
+rotating_output_open(struct gc_logging *logging)
+{
+    struct rotating_output *ro = &logging->rotating;
+    FILE *out = logging->out;
+
+    if (logging->out_filename == NULL) {
+	rb_raise(rb_eArgError, "rotation requires a file.");
+    }
+
+    ro->header = NULL;
+    rotating_output_render_header(logging);
+
+    fflush(out);
+    if ((ro->fd = dup(fileno(out))) < 0) rb_sys_fail("dup");
+    fclose(out);
+    ro->written = 0;
+    ro->seq = 0;
+    ro->pending = 0;
+    ro->buffer = NULL;
+
+#if defined(HAVE_FOPENCOOKIE)
+    {
+	cookie_io_functions_t funcs = {NULL, rotating_output_write, NULL, rotating_output_close};
+	out = fopencookie(ro, "w", funcs);
+    }
+#else
+    out = funopen(ro, NULL, rotating_output_write, NULL, rotating_output_close);
+#endif
+    if (out == NULL) {
+	close(ro->fd);
+	logging->out = stderr;
+	rb_sys_fail("rotating output");
+    }
+    /* written is counted at flush, so keep buffered bytes small against max_size */
+    {
+	size_t bufsize = logging->config.max_size / 16;
+	if (bufsize < 256) bufsize = 256;
+	if (bufsize > 64 * 1024) bufsize = 64 * 1024;
+	if ((ro->buffer = malloc(bufsize)) != NULL) setvbuf(out, ro->buffer, _IOFBF, bufsize);
+    }
+    logging->out = out;
+    logging->rotate = 1;
+}
+
+static void
+rotating_output_free(struct gc_logging *logging)
+{
+#if USE_LOG_COMPRESSION
+    rb_thread_call_without_gvl(compress_wait_i, logging, RUBY_UBF_IO, NULL);
+#endif
+    free(logging->rotating.header);
+    free(logging->rotating.buffer);
+    logging->rotating.header = NULL;
+    logging->rotating.buffer = NULL;
+    logging->rotate = 0;
+}
+#endif
+
+static void
+close_output(FILE *out)
+{
+    fflush(out);
+    if (out != stderr) {
+	fclose(out);
+    }
+}
+
+static void
+create_gc_hooks(void)
+{
+    int i = 0;
+    struct gc_logging *logging = &trace_logging;
 
     tracer_hooks[0] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_START,     TRACE_FUNC(start),     logging);
     tracer_hooks[1] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_END_MARK,  TRACE_FUNC(end_mark),  logging);
@@ -415,8 +2900,14 @@ static void
 enable_gc_hooks(struct gc_logging *logging)
 {
     int i;
-    for (i=0; i<logging->enable_hooks_num; i++) {
-	rb_tracepoint_enable(logging->enable_hooks[i]);
+
+    logging->hook_bits = logging->event_bits | (logging->layout.phase_times_num > 0 ? PHASE_EVENT_BITS : 0) |
+      (logging->layout.gc_stat_heap_num > 0 ? EVENT_BIT_END_SWEEP : 0) |
+      (logging->layout.rates_num > 0 ? (EVENT_BIT_START | EVENT_BIT_END_SWEEP) : 0) |
+      (logging->layout.custom_fields_reset_num > 0 ? EVENT_BIT_END_SWEEP : 0) |
+      (logging->flight_recording ? PHASE_EVENT_BITS : 0);
+    for (i=0; i<MAX_HOOKS; i++) {
+	if (logging->hook_bits & (0x01 << i)) rb_tracepoint_enable(tracer_hooks[i]);
     }
 }
 
@@ -424,9 +2915,10 @@ static void
 disable_gc_hooks(struct gc_logging *logging)
 {
     int i;
-    for (i=0; i<logging->enable_hooks_num; i++) {
-	rb_tracepoint_disable(logging->enable_hooks[i]);
+    for (i=0; i<MAX_HOOKS; i++) {
+	if (logging->hook_bits & (0x01 << i)) rb_tracepoint_disable(tracer_hooks[i]);
     }
+    logging->hook_bits = 0;
 }
 
 static VALUE
@@ -434,6 +2926,9 @@ gc_tracer_setup_logging_out(VALUE self, VALUE filename)
 {
     struct gc_logging *logging = &trace_logging;
 
+    free(logging->out_filename);
+    logging->out_filename = NULL;
+
     if (NIL_P(filename)) {
 	logging->out = stderr;
     }
@@ -447,6 +2942,7 @@ gc_tracer_setup_logging_out(VALUE self, VALUE filename)
 		rb_raise(rb_eRuntimeError, "can not open file: %s\n", fname);
 	    }
 	    logging->out = out;
+	    logging->out_filename = strdup(fname);
 	}
     }
 
@@ -457,7 +2953,7 @@ static VALUE
 gc_tracer_setup_logging_events(int argc, VALUE *argv, VALUE self)
 {
     struct gc_logging *logging = &trace_logging;
-    int i, n;
+    int i;
     int event_bits = 0;
 
     if (argc == 0) {
@@ -480,12 +2976,7 @@ gc_tracer_setup_logging_events(int argc, VALUE *argv, VALUE self)
 	}
     }
 
-    for (n=0, i=0; i<MAX_HOOKS; i++) {
-	if (event_bits & (0x01 << i)) {
-	    logging->enable_hooks[n++] = tracer_hooks[i];
-	}
-    }
-    logging->enable_hooks_num = n;
+    logging->event_bits = event_bits;
 
     return self;
 }
@@ -500,23 +2991,29 @@ gc_tracer_setup_logging_tick_type(VALUE self, VALUE sym)
 	"time"
 #ifdef HAVE_CLOCK_GETTIME
 	  ,
-	"nano_time"
+	"nano_time",
+	"tsc_ns"
 #endif
     };
-    static const out_time_func_t funcs[] = {
-	out_time_none,
-	out_time_hw_counter,
-	out_time_time
+    static const get_time_func_t funcs[] = {
+	get_time_none,
+	get_time_hw_counter,
+	get_time_time
 #ifdef HAVE_CLOCK_GETTIME
 	  ,
-	out_time_nano_time
+	get_time_nano_time,
+	NULL /* tsc_ns: calibrated */
 #endif
     };
     int i;
 
-    for (i=0; i<(int)(sizeof(funcs)/sizeof(out_time_func_t)); i++) {
+    for (i=0; i<(int)(sizeof(funcs)/sizeof(get_time_func_t)); i++) {
 	if (sym == ID2SYM(rb_intern(names[i]))) {
-	    logging->config.out_time_func = funcs[i];
+#ifdef HAVE_CLOCK_GETTIME
+	    logging->config.get_time_func = funcs[i] ? funcs[i] : tsc_calibrate();
+#else
+	    logging->config.get_time_func = funcs[i];
+#endif
 	    return self;
 	}
     }
@@ -525,117 +3022,599 @@ gc_tracer_setup_logging_tick_type(VALUE self, VALUE sym)
     return self; /* unreachable */
 }
 
+/* b: true, false or Array of keys */
+static void
+setup_logging_keys(VALUE b, int *enabled_ptr, VALUE *keys_ptr, const VALUE *syms, int n, const char *kind)
+{
+    VALUE ary = rb_check_array_type(b);
+
+    if (!NIL_P(ary)) {
+	long i;
+	ary = rb_ary_dup(ary);
+	for (i=0; i<RARRAY_LEN(ary); i++) {
+	    VALUE key = RARRAY_AREF(ary, i);
+	    if (key_index(key, syms, n) < 0) {
+		rb_raise(rb_eArgError, "unknown %s key: %"PRIsVALUE, kind, key);
+	    }
+	}
+	rb_obj_freeze(ary);
+	*enabled_ptr = Qtrue;
+	*keys_ptr = ary;
+    }
+    else {
+	*enabled_ptr = RTEST(b) ? Qtrue : Qfalse;
+	*keys_ptr = Qnil;
+    }
+}
+
 static VALUE
 gc_tracer_setup_logging_gc_stat(VALUE self, VALUE b)
 {
     struct gc_logging *logging = &trace_logging;
 
+    setup_logging_keys(b, &logging->config.log_gc_stat, &logging->config.gc_stat_keys,
+		       sym_gc_stat, sym_gc_stat_num, "gc_stat");
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_gc_latest_gc_info(VALUE self, VALUE b)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    setup_logging_keys(b, &logging->config.log_gc_latest_gc_info, &logging->config.gc_latest_gc_info_keys,
+		       sym_latest_gc_info, sym_latest_gc_info_num, "gc_latest_gc_info");
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_gc_stat_heap(VALUE self, VALUE b)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    setup_logging_keys(b, &logging->config.log_gc_stat_heap, &logging->config.gc_stat_heap_keys,
+		       sym_gc_stat_heap, gc_stat_heap_keys_num, "gc_stat_heap");
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_rusage(VALUE self, VALUE b)
+{
+    struct gc_logging *logging = &trace_logging;
+
+#if HAVE_GETRUSAGE
+    setup_logging_keys(b, &logging->config.log_rusage, &logging->config.rusage_keys,
+		       sym_rusage_columns, RUSAGE_COLUMNS_NUM, "rusage");
+#else
+    logging->config.log_rusage = RTEST(b) ? Qtrue : Qfalse;
+#endif
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_buffer_size(VALUE self, VALUE size)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (NIL_P(size)) {
+	logging->config.buffer_size = 0;
+    }
+    else {
+	int n = NUM2INT(size);
+	if (n < 0) {
+	    rb_raise(rb_eArgError, "negative buffer size: %d", n);
+	}
+	logging->config.buffer_size = n;
+    }
+
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_async(VALUE self, VALUE b)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (RTEST(b)) {
+#if USE_ASYNC_LOGGING
+	logging->config.async = Qtrue;
+#else
+	rb_raise(rb_eNotImpError, "async logging is not supported on this platform");
+#endif
+    }
+    else {
+	logging->config.async = Qfalse;
+    }
+
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_format(VALUE self, VALUE sym)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (sym == ID2SYM(rb_intern("tsv"))) {
+	logging->config.format = LOG_FORMAT_TSV;
+    }
+    else if (sym == ID2SYM(rb_intern("binary"))) {
+	logging->config.format = LOG_FORMAT_BINARY;
+    }
+    else if (sym == ID2SYM(rb_intern("binary_delta"))) {
+	logging->config.format = LOG_FORMAT_BINARY_DELTA;
+    }
+    else {
+	rb_raise(rb_eArgError, "unknown logging format: %"PRIsVALUE, sym);
+    }
+
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_keyframe_interval(VALUE self, VALUE n)
+{
+    struct gc_logging *logging = &trace_logging;
+    int interval = NIL_P(n) ? BINARY_DEFAULT_KEYFRAME_INTERVAL : NUM2INT(n);
+
+    if (interval <= 0) {
+	rb_raise(rb_eArgError, "keyframe interval should be positive: %d", interval);
+    }
+    logging->config.keyframe_interval = interval;
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_sample_rate(VALUE self, VALUE n)
+{
+    struct gc_logging *logging = &trace_logging;
+    int rate = NIL_P(n) ? 0 : NUM2INT(n);
+
+    if (rate < 0) {
+	rb_raise(rb_eArgError, "sample rate should not be negative: %d", rate);
+    }
+    logging->config.sample_rate = rate;
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_sampling(VALUE self, VALUE sym)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (sym == ID2SYM(rb_intern("fixed"))) {
+	logging->config.sample_poisson = 0;
+    }
+    else if (sym == ID2SYM(rb_intern("poisson"))) {
+	logging->config.sample_poisson = 1;
+    }
+    else {
+	rb_raise(rb_eArgError, "unknown sampling: %"PRIsVALUE, sym);
+    }
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_phase_times(VALUE self, VALUE b)
+{
+    struct gc_logging *logging = &trace_logging;
+    logging->config.phase_times = RTEST(b);
+    return self;
+}
+
+#define RATES_DEFAULT_WINDOW 60.0
+
+/* v: true (RATES_DEFAULT_WINDOW), false or window in seconds */
+static VALUE
+gc_tracer_setup_logging_rates(VALUE self, VALUE v)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (v == Qtrue) {
+	logging->config.rates_window = RATES_DEFAULT_WINDOW;
+    }
+    else if (!RTEST(v)) {
+	logging->config.rates_window = 0;
+    }
+    else {
+	double window = NUM2DBL(v);
+	if (window <= 0) {
+	    rb_raise(rb_eArgError, "rates window should be positive: %f", window);
+	}
+	logging->config.rates_window = window;
+    }
+    return self;
+}
+
+/* records: number of records kept (nil: disabled), pause: msec, after: number of records */
+static VALUE
+gc_tracer_setup_logging_flight_recorder(VALUE self, VALUE records, VALUE pause, VALUE after)
+{
+    struct gc_logging *logging = &trace_logging;
+    long n, m;
+    double msec;
+
+    if (NIL_P(records)) {
+	logging->config.flight_records = 0;
+	return self;
+    }
+
+    n = NUM2LONG(records);
+    if (n <= 0) {
+	rb_raise(rb_eArgError, "flight_recorder should be positive: %ld", n);
+    }
+    if (logging->config.async) {
+	rb_raise(rb_eArgError, "flight_recorder can not be used with async logging.");
+    }
+    msec = NUM2DBL(pause);
+    if (msec < 0) {
+	rb_raise(rb_eArgError, "flight_recorder_pause should not be negative: %f", msec);
+    }
+    m = NIL_P(after) ? 0 : NUM2LONG(after);
+    if (m < 0) {
+	rb_raise(rb_eArgError, "flight_recorder_after should not be negative: %ld", m);
+    }
+    logging->config.flight_after = (size_t)m;
+    logging->config.flight_pause = (time_value_t)(msec * 1000 * 1000);
+    logging->config.flight_records = (size_t)n;
+    return self;
+}
+
+static VALUE
+gc_tracer_flight_recorder_triggers(VALUE self)
+{
+    return SIZET2NUM(trace_logging.flight.triggers);
+}
+
+static VALUE
+gc_tracer_setup_logging_mmap(VALUE self, VALUE v)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (!RTEST(v)) {
+	logging->config.mmap_size = 0;
+    }
+    else {
+#if USE_MMAP_OUTPUT
+	long size = v == Qtrue ? MMAP_OUTPUT_DEFAULT_SIZE : NUM2LONG(v);
+	if (size <= 0) {
+	    rb_raise(rb_eArgError, "mmap size should be positive: %ld", size);
+	}
+	logging->config.mmap_size = (size_t)size;
+#else
+	rb_raise(rb_eNotImpError, "mmap output is not supported on this platform.");
+#endif
+    }
+    return self;
+}
+
+static VALUE
+gc_tracer_setup_logging_rotation(VALUE self, VALUE max_size, VALUE max_files, VALUE compress)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (NIL_P(max_size)) {
+	logging->config.max_size = 0;
+    }
+    else {
+#if USE_LOG_ROTATION
+	long size = NUM2LONG(max_size);
+	if (size <= 0) {
+	    rb_raise(rb_eArgError, "max_size should be positive: %ld", size);
+	}
+	if (logging->config.mmap_size > 0) {
+	    rb_raise(rb_eArgError, "max_size can not be used with mmap output.");
+	}
+	logging->config.max_size = (size_t)size;
+#else
+	rb_raise(rb_eNotImpError, "log rotation is not supported on this platform.");
+#endif
+    }
+
+    logging->config.max_files = NIL_P(max_files) ? 0 : NUM2INT(max_files);
+    if (logging->config.max_files < 0) {
+	rb_raise(rb_eArgError, "max_files should not be negative: %d", logging->config.max_files);
+    }
+
+    if (RTEST(compress)) {
+#if USE_LOG_COMPRESSION
+	if (compress != Qtrue && compress != ID2SYM(rb_intern("gzip"))) {
+	    rb_raise(rb_eArgError, "unknown compression: %"PRIsVALUE, compress);
+	}
+	logging->config.compress = 1;
+#else
+	rb_raise(rb_eNotImpError, "log compression is not supported on this platform.");
+#endif
+    }
+    else {
+	logging->config.compress = 0;
+    }
+    return self;
+}
+
+static enum custom_field_kind
+custom_field_kind(VALUE kind)
+{
+    if (NIL_P(kind) || kind == ID2SYM(rb_intern("counter"))) return CUSTOM_FIELD_COUNTER;
+    if (kind == ID2SYM(rb_intern("max")))  return CUSTOM_FIELD_MAX;
+    if (kind == ID2SYM(rb_intern("sum")))  return CUSTOM_FIELD_SUM;
+    if (kind == ID2SYM(rb_intern("last"))) return CUSTOM_FIELD_LAST;
+    rb_raise(rb_eArgError, "unknown custom field kind: %"PRIsVALUE, kind);
+}
+
+static void
+custom_fields_clear(struct custom_fields *cf)
+{
+    int i;
+
+    for (i=0; i<cf->num; i++) {
+	CUSTOM_FIELD_NAME(cf, cf->columns[i]) = 0;
+	ATOMIC_STORE(CUSTOM_FIELD_VALUE(cf, cf->columns[i]), 0);
+    }
+    cf->num = 0;
+    cf->slots_num = 0;
+    cf->free_num = 0;
+    if (cf->index) st_clear(cf->index);
+}
+
+static void
+custom_fields_reset_values(struct custom_fields *cf)
+{
+    int i;
+    for (i=0; i<cf->num; i++) {
+	ATOMIC_STORE(CUSTOM_FIELD_VALUE(cf, cf->columns[i]), 0);
+    }
+}
+
+static int
+custom_fields_alloc_slot(struct custom_fields *cf)
+{
+    int slot;
 
-    if (RTEST(b)) {
-	logging->config.log_gc_stat = Qtrue;
+    if (cf->free_num > 0) {
+	return cf->free_slots[--cf->free_num];
     }
-    else {
-	logging->config.log_gc_stat = Qfalse;
+    if (cf->slots_num >= MAX_CUSTOM_FIELDS) {
+	rb_raise(rb_eRuntimeError, "Number of custome fields exceeds %d", MAX_CUSTOM_FIELDS);
     }
+    slot = cf->slots_num;
 
-    return self;
+    if (CUSTOM_FIELD_BLOCK(cf, slot) == NULL) {
+	void *block;
+#ifdef HAVE_POSIX_MEMALIGN
+	if (posix_memalign(&block, 64, sizeof(struct custom_field_block)) != 0) block = NULL;
+#else
+	block = malloc(sizeof(struct custom_field_block));
+#endif
+	if (block == NULL) rb_memerror();
+	memset(block, 0, sizeof(struct custom_field_block));
+	CUSTOM_FIELD_BLOCK(cf, slot) = (struct custom_field_block *)block;
+    }
+    /* the block is ready before the exporter thread sees the slot */
+    ATOMIC_STORE(cf->slots_num, slot + 1);
+    return slot;
 }
 
-static VALUE
-gc_tracer_setup_logging_gc_latest_gc_info(VALUE self, VALUE b)
+static int
+custom_fields_add(struct custom_fields *cf, ID name, enum custom_field_kind kind)
 {
-    struct gc_logging *logging = &trace_logging;
-
+    int slot;
 
-    if (RTEST(b)) {
-	logging->config.log_gc_latest_gc_info = Qtrue;
+    if (cf->index == NULL) cf->index = st_init_numtable();
+    if (st_lookup(cf->index, (st_data_t)name, NULL)) {
+	rb_raise(rb_eArgError, "custom field %s is already defined.", rb_id2name(name));
     }
-    else {
-	logging->config.log_gc_latest_gc_info = Qfalse;
+
+    slot = custom_fields_alloc_slot(cf);
+    if (cf->num == cf->capa) {
+	cf->capa = cf->capa ? cf->capa * 2 : 16;
+	REALLOC_N(cf->columns, int, cf->capa);
     }
+    cf->columns[cf->num++] = slot;
 
-    return self;
+    CUSTOM_FIELD_NAME(cf, slot) = name;
+    CUSTOM_FIELD_KIND(cf, slot) = (unsigned char)kind;
+    ATOMIC_STORE(CUSTOM_FIELD_VALUE(cf, slot), 0);
+    st_insert(cf->index, (st_data_t)name, (st_data_t)slot);
+    return slot;
 }
 
-static VALUE
-gc_tracer_setup_logging_rusage(VALUE self, VALUE b)
+static void
+custom_fields_remove(struct custom_fields *cf, ID name)
 {
-    struct gc_logging *logging = &trace_logging;
+    st_data_t key = (st_data_t)name, val;
+    int i, slot;
 
-
-    if (RTEST(b)) {
-	logging->config.log_rusage = Qtrue;
+    if (cf->index == NULL || !st_delete(cf->index, &key, &val)) {
+	rb_raise(rb_eArgError, "custom field %s is not defined.", rb_id2name(name));
     }
-    else {
-	logging->config.log_rusage = Qfalse;
+    slot = (int)val;
+
+    for (i=0; i<cf->num; i++) {
+	if (cf->columns[i] == slot) {
+	    MEMMOVE(&cf->columns[i], &cf->columns[i+1], int, cf->num - i - 1);
+	    cf->num--;
+	    break;
+	}
     }
+    CUSTOM_FIELD_NAME(cf, slot) = 0;
 
-    return self;
+    if (cf->free_num == cf->free_capa) {
+	cf->free_capa = cf->free_capa ? cf->free_capa * 2 : 16;
+	REALLOC_N(cf->free_slots, int, cf->free_capa);
+    }
+    cf->free_slots[cf->free_num++] = slot;
 }
 
+static void logging_change_layout(struct gc_logging *logging);
+
 static VALUE
 gc_tracer_setup_logging_custom_fields(VALUE self, VALUE b)
 {
     struct gc_logging *logging = &trace_logging;
+    struct custom_fields *cf = &logging->custom_fields;
+
+    custom_fields_clear(cf);
 
     if (RTEST(b)) {
-	VALUE ary = rb_check_array_type(b);
+	/* [name, ...] or {name => kind, ...} */
+	VALUE ary = RB_TYPE_P(b, T_HASH) ? rb_funcall(b, rb_intern("to_a"), 0) : rb_check_array_type(b);
 	int i;
 
-	logging->config.log_custom_fields_count = RARRAY_LEN(ary);
+	if (NIL_P(ary)) {
+	    rb_raise(rb_eArgError, "custom fields should be an Array or a Hash.");
+	}
 
 	for (i=0; i<RARRAY_LEN(ary); i++) {
 	    VALUE name = RARRAY_AREF(ary, i);
-	    ID field_id = rb_to_id(name);
+	    VALUE kind = Qnil;
 
-	    if (i >= MAX_CUSTOM_FIELDS) {
-		rb_raise(rb_eRuntimeError, "Number of custome fields exceeds %d", MAX_CUSTOM_FIELDS);
+	    if (RB_TYPE_P(name, T_ARRAY) && RARRAY_LEN(name) == 2) {
+		kind = RARRAY_AREF(name, 1);
+		name = RARRAY_AREF(name, 0);
 	    }
-
-	    logging->custom_field_names[i] = field_id;
-	    logging->custom_field_values[i] = 0;
+	    custom_fields_add(cf, rb_to_id(name), custom_field_kind(kind));
 	}
     }
-    else {
-	logging->config.log_custom_fields_count = 0;
-    }
 
+    logging_change_layout(logging);
     return self;
 }
 
-static long *
-custom_field_value_place(VALUE name)
+/* add a field while logging (or into the configuration) */
+static VALUE
+gc_tracer_add_custom_field(int argc, VALUE *argv, VALUE self)
+{
+    struct gc_logging *logging = &trace_logging;
+    VALUE name, kind;
+
+    rb_scan_args(argc, argv, "11", &name, &kind);
+    custom_fields_add(&logging->custom_fields, rb_to_id(name), custom_field_kind(kind));
+    logging_change_layout(logging);
+    return self;
+}
+
+static VALUE
+gc_tracer_remove_custom_field(VALUE self, VALUE name)
 {
     struct gc_logging *logging = &trace_logging;
-    int index;
+
+    custom_fields_remove(&logging->custom_fields, rb_to_id(name));
+    logging_change_layout(logging);
+    return self;
+}
+
+/* a slot of the field specified by name or index (position in columns) */
+static int
+custom_field_slot(VALUE name)
+{
+    struct custom_fields *cf = &trace_logging.custom_fields;
+    st_data_t slot;
 
     if (FIXNUM_P(name)) {
-	index = FIX2INT(name);
-	if (index >= logging->config.log_custom_fields_count) {
+	int index = FIX2INT(name);
+	if (index < 0 || index >= cf->num) {
 	    rb_raise(rb_eRuntimeError, "Only %d custom fields are available, but %d was specified",
-		     logging->config.log_custom_fields_count, index);
+		     cf->num, index);
 	}
+	return cf->columns[index];
     }
     else {
-	int i;
 	ID nid = rb_to_id(name);
-	for (i=0; i<logging->config.log_custom_fields_count; i++) {
-	    if (nid == logging->custom_field_names[i]) {
-		index = i;
-		goto found;
+	if (cf->index == NULL || !st_lookup(cf->index, (st_data_t)nid, &slot)) {
+	    rb_raise(rb_eRuntimeError, "Unkown custom fileds is specified.");
+	}
+	return (int)slot;
+    }
+}
+
+static long *
+custom_field_value_place(VALUE name)
+{
+    return &CUSTOM_FIELD_VALUE(&trace_logging.custom_fields, custom_field_slot(name));
+}
+
+/* for the exporter (in gc_exporter.c) */
+int
+gc_tracer_custom_field_slot(VALUE name)
+{
+    return custom_field_slot(name);
+}
+
+/*
+ * Read the value of the field without the GVL (for the exporter thread).
+ * *slot is a hint which is updated if the field was removed and added
+ * again. Blocks of values are never freed.
+ * Returns 0 if the field does not exist.
+ */
+int
+gc_tracer_custom_field_read(ID name, int *slot, long *value)
+{
+    struct custom_fields *cf = &trace_logging.custom_fields;
+    int i, n = ATOMIC_LOAD(cf->slots_num);
+
+    if (*slot >= n || ATOMIC_LOAD(CUSTOM_FIELD_NAME(cf, *slot)) != name) {
+	for (i=0; i<n; i++) {
+	    if (ATOMIC_LOAD(CUSTOM_FIELD_NAME(cf, i)) == name) break;
+	}
+	if (i == n) return 0;
+	*slot = i;
+    }
+    *value = ATOMIC_LOAD(CUSTOM_FIELD_VALUE(cf, *slot));
+    return 1;
+}
+
+/* set a value of a field of any kind */
+static void
+custom_field_record(int slot, long v)
+{
+    struct custom_fields *cf = &trace_logging.custom_fields;
+    long *valp = &CUSTOM_FIELD_VALUE(cf, slot);
+
+    switch (CUSTOM_FIELD_KIND(cf, slot)) {
+      case CUSTOM_FIELD_MAX:
+	{
+	    long cur = ATOMIC_LOAD(*valp);
+	    while (v > cur && !ATOMIC_CAS(*valp, &cur, v)) {
+		/* retry with the updated cur */
 	    }
 	}
-	rb_raise(rb_eRuntimeError, "Unkown custom fileds is specified.");
+	break;
+      case CUSTOM_FIELD_SUM:
+	ATOMIC_ADD(*valp, v);
+	break;
+      default:
+	ATOMIC_STORE(*valp, v);
     }
-  found:
-    return &logging->custom_field_values[index];
+}
+
+struct custom_field_timer {
+    int slot;
+    time_value_t start;
+};
+
+static VALUE
+custom_field_timer_end(VALUE data)
+{
+    struct custom_field_timer *timer = (struct custom_field_timer *)data;
+    custom_field_record(timer->slot, (long)((trace_logging.config.get_time_func)() - timer->start));
+    return Qnil;
+}
+
+static VALUE
+custom_field_time(int slot)
+{
+    struct custom_field_timer timer;
+
+    timer.slot = slot;
+    timer.start = (trace_logging.config.get_time_func)();
+    return rb_ensure(rb_yield, Qnil, custom_field_timer_end, (VALUE)&timer);
 }
 
 static VALUE
 gc_tracer_custom_field_increment(VALUE self, VALUE name)
 {
     long *valp = custom_field_value_place(name);
-    (*valp)++;
+    ATOMIC_ADD(*valp, 1);
     return self;
 }
 
@@ -643,7 +3622,7 @@ static VALUE
 gc_tracer_custom_field_decrement(VALUE self, VALUE name)
 {
     long *valp = custom_field_value_place(name);
-    (*valp)--;
+    ATOMIC_ADD(*valp, -1);
     return self;
 }
 
@@ -651,18 +3630,233 @@ static VALUE
 gc_tracer_custom_field_get(VALUE self, VALUE name)
 {
     long *valp = custom_field_value_place(name);
-    return LONG2NUM(*valp);
+    return LONG2NUM(ATOMIC_LOAD(*valp));
 }
 
 static VALUE
 gc_tracer_custom_field_set(VALUE self, VALUE name, VALUE val)
 {
-    long *valp = custom_field_value_place(name);
+    int slot = custom_field_slot(name);
+    custom_field_record(slot, NUM2LONG(val));
+    return val;
+}
+
+/*
+ * GC::Tracer::CustomField: a handle of a custom field.
+ * The slot is resolved by GC::Tracer.custom_field(name), and
+ * values are updated atomically, so that frozen handles can be shared
+ * with other Ractors. If the field is removed (and added again),
+ * the slot is resolved again by the name.
+ */
+static VALUE rb_cCustomField;
+
+struct custom_field {
+    int slot;
+    ID name; /* to check removal */
+};
+
+static const rb_data_type_t custom_field_type = {
+    "GC::Tracer::CustomField",
+    {NULL, RUBY_TYPED_DEFAULT_FREE, NULL, NULL, {0}},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+    | RUBY_TYPED_FROZEN_SHAREABLE
+#endif
+};
+
+static int
+custom_field_handle_slot(VALUE self)
+{
+    struct custom_field *field;
+    TypedData_Get_Struct(self, struct custom_field, &custom_field_type, field);
+
+    if (CUSTOM_FIELD_NAME(&trace_logging.custom_fields, field->slot) != field->name) {
+	struct custom_fields *cf = &trace_logging.custom_fields;
+	st_data_t slot;
+
+	if (cf->index == NULL || !st_lookup(cf->index, (st_data_t)field->name, &slot)) {
+	    rb_raise(rb_eRuntimeError, "custom field %s was removed.", rb_id2name(field->name));
+	}
+	field->slot = (int)slot;
+    }
+    return field->slot;
+}
+
+static long *
+custom_field_handle_place(VALUE self)
+{
+    return &CUSTOM_FIELD_VALUE(&trace_logging.custom_fields, custom_field_handle_slot(self));
+}
+
+static VALUE
+gc_tracer_custom_field(VALUE self, VALUE name)
+{
+    struct custom_field *field;
+    VALUE obj = TypedData_Make_Struct(rb_cCustomField, struct custom_field, &custom_field_type, field);
+
+    field->slot = custom_field_slot(name);
+    field->name = CUSTOM_FIELD_NAME(&trace_logging.custom_fields, field->slot);
+    rb_ivar_set(obj, rb_intern("@name"), ID2SYM(field->name));
+    return rb_obj_freeze(obj);
+}
+
+/* position in columns */
+static VALUE
+custom_field_index_m(VALUE self)
+{
+    struct custom_fields *cf = &trace_logging.custom_fields;
+    int i, slot = custom_field_handle_slot(self);
+
+    for (i=0; i<cf->num; i++) {
+	if (cf->columns[i] == slot) return INT2FIX(i);
+    }
+    return Qnil;
+}
+
+static VALUE
+custom_field_increment(VALUE self)
+{
+    return LONG2NUM(ATOMIC_ADD(*custom_field_handle_place(self), 1));
+}
+
+static VALUE
+custom_field_decrement(VALUE self)
+{
+    return LONG2NUM(ATOMIC_ADD(*custom_field_handle_place(self), -1));
+}
+
+static VALUE
+custom_field_add(VALUE self, VALUE val)
+{
     long lval = NUM2LONG(val);
-    *valp = lval;
+    return LONG2NUM(ATOMIC_ADD(*custom_field_handle_place(self), lval));
+}
+
+static VALUE
+custom_field_get(VALUE self)
+{
+    return LONG2NUM(ATOMIC_LOAD(*custom_field_handle_place(self)));
+}
+
+static VALUE
+custom_field_set(VALUE self, VALUE val)
+{
+    custom_field_record(custom_field_handle_slot(self), NUM2LONG(val));
     return val;
 }
 
+static VALUE
+custom_field_time_m(VALUE self)
+{
+    return custom_field_time(custom_field_handle_slot(self));
+}
+
+/* record time of the block (in units of ticks) into the field */
+static VALUE
+gc_tracer_time(VALUE self, VALUE name)
+{
+    int slot = rb_typeddata_is_kind_of(name, &custom_field_type) ? custom_field_handle_slot(name) : custom_field_slot(name);
+    return custom_field_time(slot);
+}
+
+static void
+Init_custom_field(VALUE mod)
+{
+    rb_cCustomField = rb_define_class_under(mod, "CustomField", rb_cObject);
+    rb_undef_alloc_func(rb_cCustomField);
+    rb_define_module_function(mod, "custom_field", gc_tracer_custom_field, 1);
+    rb_define_module_function(mod, "add_custom_field", gc_tracer_add_custom_field, -1);
+    rb_define_module_function(mod, "remove_custom_field", gc_tracer_remove_custom_field, 1);
+    rb_define_module_function(mod, "time", gc_tracer_time, 1);
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    rb_ext_ractor_safe(true);
+#endif
+    rb_define_method(rb_cCustomField, "index", custom_field_index_m, 0);
+    rb_define_method(rb_cCustomField, "increment", custom_field_increment, 0);
+    rb_define_method(rb_cCustomField, "decrement", custom_field_decrement, 0);
+    rb_define_method(rb_cCustomField, "add", custom_field_add, 1);
+    rb_define_method(rb_cCustomField, "value", custom_field_get, 0);
+    rb_define_method(rb_cCustomField, "value=", custom_field_set, 1);
+    rb_define_method(rb_cCustomField, "time", custom_field_time_m, 0);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    rb_ext_ractor_safe(false);
+#endif
+}
+
+/* open logging->out (opened by setup_logging_out) as configured and start writing */
+static void
+logging_open(struct gc_logging *logging)
+{
+#if USE_MMAP_OUTPUT
+    if (logging->config.mmap_size > 0) mmap_output_open(logging);
+#endif
+#if USE_LOG_ROTATION
+    if (logging->config.max_size > 0) rotating_output_open(logging);
+#endif
+    out_header(logging);
+#if USE_MMAP_OUTPUT
+    if (logging->mmap.map) fflush(logging->out);
+#endif
+#if USE_ASYNC_LOGGING
+    if (logging->config.async && !logging->flight_recording) {
+	async_writer_start(logging);
+	logging->async = 1;
+    }
+#endif
+}
+
+/*
+ * Custom fields are changed while logging: write buffered records
+ * in the previous layout and start the new layout with a new header.
+ * Binary logs also have a whole header (from the magic) in the middle.
+ * Hooks are disabled while rebuilding, because allocations here can
+ * invoke GC which would fill records in a freed layout.
+ */
+static void
+logging_change_layout(struct gc_logging *logging)
+{
+    struct binary_output *binary = &logging->binary;
+    int async = logging->async;
+
+    if (logging->enabled == 0 || logging->forked) return;
+
+    disable_gc_hooks(logging);
+
+#if USE_ASYNC_LOGGING
+    if (async) {
+	/* the writer flushes all records before exit */
+	async_writer_stop(logging);
+	logging->async = 0;
+    }
+#endif
+    logging_flush(logging);
+
+    buffer_free_records(logging);
+    buffer_setup_records(logging);
+    if (logging->format == LOG_FORMAT_BINARY_DELTA) {
+	int n = logging->layout.values_num + 1;
+	REALLOC_N(binary->prev_values, unsigned long long, n);
+	REALLOC_N(binary->chunk, unsigned char, 10 * (n + 1));
+	binary->records_from_keyframe = 0;
+    }
+
+    out_header(logging);
+#if USE_LOG_ROTATION
+    if (logging->rotate) rotating_output_render_header(logging);
+#endif
+#if USE_MMAP_OUTPUT
+    if (logging->mmap.map) fflush(logging->out);
+#endif
+#if USE_ASYNC_LOGGING
+    if (async) {
+	async_writer_start(logging);
+	logging->async = 1;
+    }
+#endif
+    enable_gc_hooks(logging);
+}
+
 static VALUE
 gc_tracer_start_logging(int argc, VALUE *argv, VALUE self)
 {
@@ -670,21 +3864,172 @@ gc_tracer_start_logging(int argc, VALUE *argv, VALUE self)
 
     if (logging->enabled == 0) {
 	logging->enabled = 1;
-	out_header(logging);
+	buffer_setup(logging);
+	sampler_setup(logging);
+	phase_reset(logging);
+	rates_reset(logging);
+	if (logging->layout.gc_stat_heap_num > 0) gc_stat_heap_refresh();
+	logging->format = logging->config.format;
+	binary_setup(logging);
+	logging_open(logging);
 	enable_gc_hooks(logging);
     }
 
     return self;
 }
 
+/*
+ * Fork support
+ *
+ * The parent flushes all records and stops the async writer before fork
+ * (and restarts it after fork), so a child inherits empty stdio buffers.
+ * The child ignores GC events until after_fork_ closes the inherited
+ * output without writing to it and opens its own output.
+ * Only positions of the record buffer are touched in the child, so that
+ * pages shared with the parent are not copied.
+ * Without pthread_atfork(), after_fork_ (only called in a child) marks it.
+ */
+#ifdef HAVE_PTHREAD_H
+static void
+logging_atfork_prepare(void)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (logging->enabled && !logging->forked) {
+#if USE_ASYNC_LOGGING
+	if (logging->async) {
+	    /* the writer flushes all records before exit */
+	    async_writer_stop_i(logging);
+	    async_writer_destroy(logging);
+	}
+	else
+#endif
+	if (logging->buffer.capacity > 0) {
+	    buffer_flush(logging);
+	}
+	out_flush(logging->out);
+    }
+}
+
+static void
+logging_atfork_parent(void)
+{
+#if USE_ASYNC_LOGGING
+    struct gc_logging *logging = &trace_logging;
+
+    if (logging->enabled && logging->async && async_writer_create(logging) != 0) {
+	/* records are written by buffer_flush() instead */
+	logging->async = 0;
+    }
+#endif
+}
+
+static void
+logging_atfork_child(void)
+{
+    struct gc_logging *logging = &trace_logging;
+
+    if (logging->enabled) {
+	logging->forked = 1;
+	logging->async = 0;
+    }
+}
+#endif
+
+/* close the output inherited from the parent without writing to it */
+static void
+logging_detach_output(struct gc_logging *logging)
+{
+    struct record_buffer *buffer = &logging->buffer;
+
+    buffer->pop_pos = logging->flight.release_pos = buffer->push_pos;
+    buffer->dropped = 0;
+
+#if USE_MMAP_OUTPUT
+    if (logging->mmap.map) {
+	munmap(logging->mmap.map, logging->mmap.capa + sizeof(struct mmap_trailer));
+	logging->mmap.map = NULL;
+	logging->mmap.capa = 0; /* drop all */
+    }
+#endif
+#if USE_LOG_ROTATION
+    if (logging->rotate) {
+#if USE_LOG_COMPRESSION
+	/* compression threads are not inherited */
+	logging->rotating.compressing = 0;
+	pthread_mutex_init(&logging->rotating.compress_lock, NULL);
+	pthread_cond_init(&logging->rotating.compress_cond, NULL);
+#endif
+	logging->rotating.pending = 0;
+	/* do not rotate the parent's file */
+	if (logging->rotating.fd >= 0) close(logging->rotating.fd);
+	logging->rotating.fd = -1;
+    }
+#endif
+    close_output(logging->out);
+#if USE_LOG_ROTATION
+    if (logging->rotate) rotating_output_free(logging);
+#endif
+    logging->out = stderr;
+    logging->forked = 0;
+}
+
+static VALUE
+gc_tracer_after_fork(VALUE self, VALUE filename)
+{
+    struct gc_logging *logging = &trace_logging;
+
+#ifndef HAVE_PTHREAD_H
+    if (logging->enabled) logging->forked = 1;
+#endif
+    if (logging->enabled && logging->forked) {
+	logging_detach_output(logging);
+	custom_fields_reset_values(&logging->custom_fields);
+	sampler_setup(logging);
+	binary_free(logging);
+	binary_setup(logging);
+
+	gc_tracer_setup_logging_out(self, filename);
+	logging_open(logging);
+    }
+    return self;
+}
+
 static VALUE
 gc_tracer_stop_logging(VALUE self)
 {
     struct gc_logging *logging = &trace_logging;
 
     if (logging->enabled) {
-	close_output(logging->out);
 	disable_gc_hooks(logging);
+	if (logging->forked) {
+	    /* the output is of the parent */
+	    logging_detach_output(logging);
+	    buffer_free(logging);
+	    binary_free(logging);
+	    logging->enabled = 0;
+	    return self;
+	}
+#if USE_ASYNC_LOGGING
+	if (logging->async) {
+	    /* the writer flushes all records before exit */
+	    async_writer_stop(logging);
+	    logging->async = 0;
+	}
+#endif
+	logging_flush(logging);
+	close_output(logging->out);
+#if USE_LOG_ROTATION
+	if (logging->rotate) rotating_output_free(logging);
+#endif
+	if (logging->buffer.dropped > 0) {
+	    rb_warn("gc_tracer: %"PRIuSIZE" records were dropped because the buffer was full.", logging->buffer.dropped);
+	}
+	if (value_syms_overflow) {
+	    rb_warn("gc_tracer: too many kinds of symbols in latest_gc_info values, some of them were written as \"?\".");
+	}
+	buffer_free(logging);
+	binary_free(logging);
 	logging->enabled = 0;
     }
 
@@ -697,7 +4042,7 @@ gc_tracer_flush_logging(VALUE self)
     struct gc_logging *logging = &trace_logging;
 
     if (logging->enabled) {
-	out_flush(logging->out);
+	logging_flush(logging);
     }
     else {
 	rb_raise(rb_eRuntimeError, "GC tracer is not enabled.");
@@ -705,6 +4050,24 @@ gc_tracer_flush_logging(VALUE self)
     return self;
 }
 
+static VALUE
+gc_tracer_dropped_records(VALUE self)
+{
+    struct gc_logging *logging = &trace_logging;
+    size_t dropped = logging->buffer.dropped;
+#if USE_MMAP_OUTPUT
+    dropped += logging->mmap.dropped;
+#endif
+    return SIZET2NUM(dropped);
+}
+
+static VALUE
+gc_tracer_logging_filename(VALUE self)
+{
+    struct gc_logging *logging = &trace_logging;
+    return logging->out_filename ? rb_str_new_cstr(logging->out_filename) : Qnil;
+}
+
 static VALUE
 gc_tracer_custom_event_logging(VALUE self, VALUE event_str)
 {
@@ -712,6 +4075,11 @@ gc_tracer_custom_event_logging(VALUE self, VALUE event_str)
     const char *str = StringValueCStr(event_str);
 
     if (logging->enabled) {
+	if (logging->forked) return self;
+	if (logging->async || logging->flight_recording || logging->format != LOG_FORMAT_TSV) {
+	    /* the name is referred after this call */
+	    str = intern_event_name(logging, str);
+	}
 	out_stat(logging, str);
     }
     else {
@@ -726,6 +4094,12 @@ Init_gc_tracer_logging(VALUE mod)
     rb_define_module_function(mod, "start_logging_", gc_tracer_start_logging, 0);
     rb_define_module_function(mod, "stop_logging", gc_tracer_stop_logging, 0);
     rb_define_module_function(mod, "flush_logging", gc_tracer_flush_logging, 0);
+    rb_define_module_function(mod, "dropped_records", gc_tracer_dropped_records, 0);
+    rb_define_module_function(mod, "logging_filename", gc_tracer_logging_filename, 0);
+#ifdef HAVE_CLOCK_GETTIME
+    rb_define_module_function(mod, "tsc_calibration", gc_tracer_tsc_calibration, 0);
+#endif
+    rb_define_module_function(mod, "after_fork_", gc_tracer_after_fork, 1);
 
     /* setup */
     rb_define_module_function(mod, "setup_logging_out", gc_tracer_setup_logging_out, 1);
@@ -734,6 +4108,20 @@ Init_gc_tracer_logging(VALUE mod)
     rb_define_module_function(mod, "setup_logging_gc_stat=", gc_tracer_setup_logging_gc_stat, 1);
     rb_define_module_function(mod, "setup_logging_gc_latest_gc_info=", gc_tracer_setup_logging_gc_latest_gc_info, 1);
     rb_define_module_function(mod, "setup_logging_rusage=", gc_tracer_setup_logging_rusage, 1);
+    rb_define_module_function(mod, "setup_logging_gc_stat_heap=", gc_tracer_setup_logging_gc_stat_heap, 1);
+    rb_define_module_function(mod, "setup_logging_buffer_size=", gc_tracer_setup_logging_buffer_size, 1);
+    rb_define_module_function(mod, "setup_logging_async=", gc_tracer_setup_logging_async, 1);
+    rb_define_module_function(mod, "setup_logging_format=", gc_tracer_setup_logging_format, 1);
+    rb_define_module_function(mod, "setup_logging_keyframe_interval=", gc_tracer_setup_logging_keyframe_interval, 1);
+    rb_define_module_function(mod, "setup_logging_sample_rate=", gc_tracer_setup_logging_sample_rate, 1);
+    rb_define_module_function(mod, "setup_logging_sampling=", gc_tracer_setup_logging_sampling, 1);
+    rb_define_module_function(mod, "setup_logging_phase_times=", gc_tracer_setup_logging_phase_times, 1);
+    rb_define_module_function(mod, "setup_logging_rates=", gc_tracer_setup_logging_rates, 1);
+    rb_define_module_function(mod, "rates", gc_tracer_rates, 0);
+    rb_define_module_function(mod, "setup_logging_flight_recorder", gc_tracer_setup_logging_flight_recorder, 3);
+    rb_define_module_function(mod, "flight_recorder_triggers", gc_tracer_flight_recorder_triggers, 0);
+    rb_define_module_function(mod, "setup_logging_mmap=", gc_tracer_setup_logging_mmap, 1);
+    rb_define_module_function(mod, "setup_logging_rotation", gc_tracer_setup_logging_rotation, 3);
 
     /* custom fields */
     rb_define_module_function(mod, "setup_logging_custom_fields=", gc_tracer_setup_logging_custom_fields, 1);
@@ -741,13 +4129,45 @@ Init_gc_tracer_logging(VALUE mod)
     rb_define_module_function(mod, "custom_field_decrement", gc_tracer_custom_field_decrement, 1);
     rb_define_module_function(mod, "custom_field_set", gc_tracer_custom_field_set, 2);
     rb_define_module_function(mod, "custom_field_get", gc_tracer_custom_field_get, 1);
+    Init_custom_field(mod);
 
     /* custom event */
     rb_define_module_function(mod, "custom_event_logging", gc_tracer_custom_event_logging, 1);
 
     /* setup data */
     setup_gc_trace_symbols();
+    setup_value_syms();
+    sym_phase_times[0] = ID2SYM(rb_intern("mark_time"));
+    sym_phase_times[1] = ID2SYM(rb_intern("sweep_time"));
+    sym_phase_times[2] = ID2SYM(rb_intern("total_pause"));
+    sym_phase_times[3] = ID2SYM(rb_intern("time_since_last_gc"));
+    sym_rates[0] = ID2SYM(rb_intern("allocation_rate"));
+    sym_rates[1] = ID2SYM(rb_intern("promotion"));
+    sym_total_allocated_objects = ID2SYM(rb_intern("total_allocated_objects"));
+    sym_old_objects = ID2SYM(rb_intern("old_objects"));
+    sym_major_gc_count = ID2SYM(rb_intern("major_gc_count"));
+#if HAVE_GETRUSAGE
+    setup_rusage_columns();
+#endif
+    rb_gc_register_address(&trace_logging.config.gc_stat_keys);
+    rb_gc_register_address(&trace_logging.config.gc_latest_gc_info_keys);
+    rb_gc_register_address(&trace_logging.config.rusage_keys);
+    rb_gc_register_address(&trace_logging.config.gc_stat_heap_keys);
+    setup_gc_stat_heap();
+    gc_stat_hash = create_stat_hash(gc_stat_func, &sym_gc_stat, &sym_gc_stat_num);
+    gc_latest_gc_info_hash = create_stat_hash(rb_gc_latest_gc_info, &sym_latest_gc_info, &sym_latest_gc_info_num);
     create_gc_hooks();
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    buffer_flush_job_handle = rb_postponed_job_preregister(0, buffer_flush_job, &trace_logging);
+    gc_stat_heap_job_handle = rb_postponed_job_preregister(0, gc_stat_heap_job, &trace_logging);
+#endif
+#if USE_LOG_COMPRESSION
+    pthread_mutex_init(&trace_logging.rotating.compress_lock, NULL);
+    pthread_cond_init(&trace_logging.rotating.compress_cond, NULL);
+#endif
+#ifdef HAVE_PTHREAD_H
+    pthread_atfork(logging_atfork_prepare, logging_atfork_parent, logging_atfork_child);
+#endif
     /* warm up */
     rb_gc_latest_gc_info(ID2SYM(rb_intern("gc_by")));
     rb_gc_stat(ID2SYM(rb_intern("count")));
@@ -759,5 +4179,13 @@ Init_gc_tracer_logging(VALUE mod)
     gc_tracer_setup_logging_gc_stat(Qnil, Qtrue);
     gc_tracer_setup_logging_gc_latest_gc_info(Qnil, Qtrue);
     gc_tracer_setup_logging_rusage(Qnil, Qfalse);
-    trace_logging.config.out_time_func = out_time_time;
+    gc_tracer_setup_logging_gc_stat_heap(Qnil, Qfalse);
+    gc_tracer_setup_logging_buffer_size(Qnil, Qnil);
+    gc_tracer_setup_logging_async(Qnil, Qfalse);
+    trace_logging.config.format = LOG_FORMAT_TSV;
+    gc_tracer_setup_logging_keyframe_interval(Qnil, Qnil);
+    gc_tracer_setup_logging_sample_rate(Qnil, Qnil);
+    gc_tracer_setup_logging_mmap(Qnil, Qfalse);
+    gc_tracer_setup_logging_rotation(Qnil, Qnil, Qnil, Qfalse);
+    trace_logging.config.get_time_func = get_time_time;
 }
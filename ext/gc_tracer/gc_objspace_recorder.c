@@ -0,0 +1,404 @@
+/*
+ * GC::Tracer.*_objspace_recording methods
+ *
+ * Write a snapshot of heap pages as a PPM image at each GC event
+ * (dirname/ppm/[GC count].[0: start, 1: end_mark, 2: end_sweep].ppm).
+ * Each row is a heap page and each pixel is a slot of BASE_SLOT_SIZE bytes
+ * (larger slots use several pixels). Colors are described in
+ * dirname/color_description.txt.
+ *
+ * Snapshots are taken in GC hooks by one pass over heap pages
+ * into a frame buffer reused between snapshots.
+ *
+ * With keyframe_interval, only every keyframe_interval-th frame is a PPM
+ * image and other frames are differences from the previous frame
+ * ([GC count].[phase].ppm.diff):
+ *
+ *   "GCTRDIFF" u32:width u32:rows
+ *   runs: (u32:zeros u32:length length * u8:xor)*
+ *
+ * where xor is (color index) ^ (color index of the previous frame, or 0),
+ * and color indexes are line numbers of color_description.txt.
+ * All numbers are little-endian.
+ */
+
+#include <ruby/ruby.h>
+#include <ruby/debug.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_RB_OBJSPACE_EACH_OBJECTS_WITHOUT_SETUP) && defined(HAVE_RB_OBJ_GC_FLAGS)
+#define USE_OBJSPACE_RECORDER 1
+#else
+#define USE_OBJSPACE_RECORDER 0
+#endif
+
+#if USE_OBJSPACE_RECORDER
+void rb_objspace_each_objects_without_setup(int (*callback)(void *, void *, size_t, void *), void *data);
+size_t rb_obj_gc_flags(VALUE obj, ID* flags, size_t max);
+
+enum slot_color {
+    COLOR_FREE,
+    COLOR_GARBAGE,
+    COLOR_OBJECT,
+    COLOR_OBJECT_OLD,
+    COLOR_CLASS,
+    COLOR_CLASS_OLD,
+    COLOR_STRING,
+    COLOR_STRING_OLD,
+    COLOR_ARRAY,
+    COLOR_ARRAY_OLD,
+    COLOR_HASH,
+    COLOR_HASH_OLD,
+    COLOR_DATA,
+    COLOR_DATA_OLD,
+    COLOR_IMEMO,
+    COLOR_IMEMO_OLD,
+    COLOR_OTHER,
+    COLOR_OTHER_OLD,
+    COLOR_OUT_OF_PAGE,
+    COLOR_NUM
+};
+
+static const struct slot_color_info {
+    const char *desc;
+    unsigned char rgb[3];
+} slot_colors[COLOR_NUM] = {
+    {"free slot",                       {0xff, 0xff, 0xff}},
+    {"garbage (unmarked at end_mark)",  {0xff, 0xff, 0x00}},
+    {"T_OBJECT",                        {0x80, 0xc0, 0xff}},
+    {"T_OBJECT (old)",                  {0x00, 0x40, 0xc0}},
+    {"T_CLASS/T_MODULE/T_ICLASS",       {0xc0, 0x80, 0xff}},
+    {"T_CLASS/T_MODULE/T_ICLASS (old)", {0x60, 0x00, 0xc0}},
+    {"T_STRING",                        {0x80, 0xff, 0x80}},
+    {"T_STRING (old)",                  {0x00, 0xa0, 0x00}},
+    {"T_ARRAY",                         {0xff, 0xc0, 0x80}},
+    {"T_ARRAY (old)",                   {0xc0, 0x60, 0x00}},
+    {"T_HASH",                          {0xff, 0x80, 0xc0}},
+    {"T_HASH (old)",                    {0xc0, 0x00, 0x60}},
+    {"T_DATA",                          {0x80, 0xff, 0xff}},
+    {"T_DATA (old)",                    {0x00, 0xa0, 0xa0}},
+    {"T_IMEMO",                         {0xc0, 0xc0, 0xc0}},
+    {"T_IMEMO (old)",                   {0x60, 0x60, 0x60}},
+    {"other types",                     {0xff, 0x80, 0x80}},
+    {"other types (old)",               {0xc0, 0x00, 0x00}},
+    {"out of page",                     {0x00, 0x00, 0x00}},
+};
+
+enum recorder_phase {
+    PHASE_START,
+    PHASE_END_MARK,
+    PHASE_END_SWEEP
+};
+
+struct objspace_recorder {
+    int enabled;
+    char *dirname;
+    int width;        /* pixels of a row */
+    size_t slot_size; /* bytes of a pixel */
+    enum recorder_phase phase;
+    int keyframe_interval;    /* 0: no diff frames */
+    int frames_from_keyframe;
+
+    unsigned char *frame; /* rows * width color indexes */
+    unsigned char *prev;  /* previous frame */
+    size_t rows;
+    size_t prev_rows;
+    size_t rows_capa;
+    unsigned char *rgb_row;
+
+    VALUE hooks[3];
+} objspace_recorder;
+
+static ID id_old, id_marked;
+
+static enum slot_color
+slot_color(struct objspace_recorder *rec, VALUE v)
+{
+    ID flags[8];
+    size_t i, n;
+    int old = 0, marked = 0;
+    enum slot_color color;
+
+    if (RBASIC(v)->flags == 0) return COLOR_FREE;
+
+    switch (BUILTIN_TYPE(v)) {
+      case T_NONE:
+	return COLOR_FREE;
+      case T_OBJECT:
+	color = COLOR_OBJECT; break;
+      case T_CLASS:
+      case T_MODULE:
+      case T_ICLASS:
+	color = COLOR_CLASS; break;
+      case T_STRING:
+	color = COLOR_STRING; break;
+      case T_ARRAY:
+	color = COLOR_ARRAY; break;
+      case T_HASH:
+	color = COLOR_HASH; break;
+      case T_DATA:
+	color = COLOR_DATA; break;
+#ifdef T_IMEMO
+      case T_IMEMO:
+	color = COLOR_IMEMO; break;
+#endif
+      default:
+	color = COLOR_OTHER; break;
+    }
+
+    n = rb_obj_gc_flags(v, flags, sizeof(flags)/sizeof(ID));
+    for (i=0; i<n; i++) {
+	if (flags[i] == id_old) old = 1;
+	else if (flags[i] == id_marked) marked = 1;
+    }
+
+    if (rec->phase == PHASE_END_MARK && !marked) return COLOR_GARBAGE;
+    return old ? color + 1 : color;
+}
+
+static int
+frame_reserve(struct objspace_recorder *rec, size_t rows)
+{
+    if (rows > rec->rows_capa) {
+	size_t capa = rec->rows_capa * 2 > rows ? rec->rows_capa * 2 : rows;
+	/* not ruby_xrealloc() (in GC) */
+	unsigned char *frame = realloc(rec->frame, capa * rec->width);
+	if (frame == NULL) return 0;
+	rec->frame = frame;
+	if ((frame = realloc(rec->prev, capa * rec->width)) == NULL) return 0;
+	rec->prev = frame;
+	rec->rows_capa = capa;
+    }
+    return 1;
+}
+
+static int
+record_page_i(void *vstart, void *vend, size_t stride, void *data)
+{
+    struct objspace_recorder *rec = (struct objspace_recorder *)data;
+    size_t pixels = stride / rec->slot_size, i;
+    unsigned char *p, *row_end;
+    VALUE v;
+
+    if (pixels == 0) pixels = 1;
+    if (!frame_reserve(rec, rec->rows + 1)) return 1; /* stop */
+
+    p = rec->frame + rec->rows * rec->width;
+    row_end = p + rec->width;
+
+    for (v = (VALUE)vstart; v < (VALUE)vend; v += stride) {
+	unsigned char color = (unsigned char)slot_color(rec, v);
+	for (i=0; i<pixels && p < row_end; i++) *p++ = color;
+    }
+    if (p < row_end) memset(p, COLOR_OUT_OF_PAGE, row_end - p);
+
+    rec->rows++;
+    return 0;
+}
+
+static void
+out_u32(FILE *fp, size_t v)
+{
+    unsigned char buf[4];
+    buf[0] = v & 0xff;
+    buf[1] = (v >> 8) & 0xff;
+    buf[2] = (v >> 16) & 0xff;
+    buf[3] = (v >> 24) & 0xff;
+    fwrite(buf, 4, 1, fp);
+}
+
+static void
+out_ppm(struct objspace_recorder *rec, FILE *fp)
+{
+    size_t row, i;
+
+    fprintf(fp, "P6\n%d %d\n255\n", rec->width, (int)rec->rows);
+    for (row=0; row<rec->rows; row++) {
+	const unsigned char *p = rec->frame + row * rec->width;
+	for (i=0; i<(size_t)rec->width; i++) {
+	    memcpy(rec->rgb_row + i * 3, slot_colors[p[i]].rgb, 3);
+	}
+	fwrite(rec->rgb_row, rec->width * 3, 1, fp);
+    }
+}
+
+static void
+out_diff(struct objspace_recorder *rec, FILE *fp)
+{
+    size_t n = rec->rows * rec->width;
+    size_t i, start, zeros;
+
+    /* rec->prev has room for rec->rows rows; pad it with 0 (free slots)
+     * and replace it with xor values (it is not used after this) */
+    if (rec->prev_rows < rec->rows) {
+	memset(rec->prev + rec->prev_rows * rec->width, 0, (rec->rows - rec->prev_rows) * rec->width);
+    }
+    for (i=0; i<n; i++) rec->prev[i] ^= rec->frame[i];
+
+    fwrite("GCTRDIFF", 8, 1, fp);
+    out_u32(fp, rec->width);
+    out_u32(fp, rec->rows);
+
+    for (i=0; i<n;) {
+	for (zeros = 0; i < n && rec->prev[i] == 0; i++) zeros++;
+	for (start = i; i < n && rec->prev[i] != 0; i++);
+	out_u32(fp, zeros);
+	out_u32(fp, i - start);
+	fwrite(rec->prev + start, 1, i - start, fp);
+    }
+}
+
+static void
+record_frame(struct objspace_recorder *rec, enum recorder_phase phase)
+{
+    char filename[FILENAME_MAX];
+    FILE *fp;
+    int keyframe;
+    unsigned char *tmp;
+
+    rec->phase = phase;
+    rec->rows = 0;
+    rb_objspace_each_objects_without_setup(record_page_i, rec);
+
+    keyframe = rec->keyframe_interval == 0 || rec->frames_from_keyframe == 0;
+    snprintf(filename, sizeof(filename), "%s/ppm/%08d.%d.ppm%s", rec->dirname, (int)rb_gc_count(), (int)phase, keyframe ? "" : ".diff");
+    if ((fp = fopen(filename, "wb")) != NULL) {
+	if (keyframe) {
+	    out_ppm(rec, fp);
+	}
+	else {
+	    out_diff(rec, fp);
+	}
+	fclose(fp);
+    }
+
+    if (rec->keyframe_interval > 0) {
+	if (++rec->frames_from_keyframe >= rec->keyframe_interval) rec->frames_from_keyframe = 0;
+    }
+
+    /* the current frame is the previous frame of the next one */
+    tmp = rec->prev;
+    rec->prev = rec->frame;
+    rec->frame = tmp;
+    rec->prev_rows = rec->rows;
+}
+
+#define DEFINE_RECORDER_HOOK(name, phase) \
+  static void objspace_recorder_##name(VALUE tpval, void *data) { \
+      record_frame((struct objspace_recorder *)data, phase); \
+  }
+
+DEFINE_RECORDER_HOOK(start, PHASE_START);
+DEFINE_RECORDER_HOOK(end_mark, PHASE_END_MARK);
+DEFINE_RECORDER_HOOK(end_sweep, PHASE_END_SWEEP);
+
+static void
+out_color_description(const char *dirname)
+{
+    char filename[FILENAME_MAX];
+    FILE *fp;
+    int i;
+
+    snprintf(filename, sizeof(filename), "%s/color_description.txt", dirname);
+    if ((fp = fopen(filename, "w")) == NULL) {
+	rb_sys_fail(filename);
+    }
+    for (i=0; i<COLOR_NUM; i++) {
+	const unsigned char *rgb = slot_colors[i].rgb;
+	fprintf(fp, "%s\t#%02x%02x%02x\n", slot_colors[i].desc, rgb[0], rgb[1], rgb[2]);
+    }
+    fclose(fp);
+}
+
+static VALUE
+gc_tracer_start_objspace_recording(VALUE self, VALUE dirname, VALUE width, VALUE slot_size, VALUE keyframe_interval)
+{
+    struct objspace_recorder *rec = &objspace_recorder;
+    int i;
+
+    if (rec->enabled) {
+	rb_raise(rb_eRuntimeError, "ObjectSpace recorder is already running.");
+    }
+
+    StringValueCStr(dirname);
+    rec->width = NUM2INT(width);
+    rec->slot_size = NUM2SIZET(slot_size);
+    if (rec->width <= 0 || rec->slot_size == 0) {
+	rb_raise(rb_eArgError, "width and slot_size should be positive.");
+    }
+    rec->keyframe_interval = NIL_P(keyframe_interval) ? 0 : NUM2INT(keyframe_interval);
+    if (rec->keyframe_interval < 0) {
+	rb_raise(rb_eArgError, "keyframe interval should not be negative: %d", rec->keyframe_interval);
+    }
+    rec->frames_from_keyframe = 0;
+
+    out_color_description(RSTRING_PTR(dirname));
+    rec->dirname = strdup(RSTRING_PTR(dirname));
+
+    /* reserve a frame for current heap pages (with some margin) */
+    rec->rows = rec->prev_rows = rec->rows_capa = 0;
+    if ((rec->rgb_row = malloc(rec->width * 3)) == NULL ||
+	!frame_reserve(rec, rb_gc_stat(ID2SYM(rb_intern("heap_allocated_pages"))) * 2 + 16)) {
+	free(rec->rgb_row);
+	free(rec->frame);
+	free(rec->prev);
+	free(rec->dirname);
+	rec->rgb_row = rec->frame = rec->prev = NULL;
+	rec->dirname = NULL;
+	rb_memerror();
+    }
+
+    if (rec->hooks[0] == 0) {
+	ID flags[8];
+
+	rec->hooks[0] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_START,     objspace_recorder_start,     rec);
+	rec->hooks[1] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_END_MARK,  objspace_recorder_end_mark,  rec);
+	rec->hooks[2] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_END_SWEEP, objspace_recorder_end_sweep, rec);
+	for (i=0; i<3; i++) rb_gc_register_mark_object(rec->hooks[i]);
+
+	/* rb_obj_gc_flags() interns flag names at the first call */
+	rb_obj_gc_flags(rec->hooks[0], flags, sizeof(flags)/sizeof(ID));
+	id_old = rb_intern("old");
+	id_marked = rb_intern("marked");
+    }
+
+    rec->enabled = 1;
+    for (i=0; i<3; i++) rb_tracepoint_enable(rec->hooks[i]);
+
+    return self;
+}
+
+static VALUE
+gc_tracer_stop_objspace_recording(VALUE self)
+{
+    struct objspace_recorder *rec = &objspace_recorder;
+    int i;
+
+    if (rec->enabled) {
+	for (i=0; i<3; i++) rb_tracepoint_disable(rec->hooks[i]);
+	rec->enabled = 0;
+
+	free(rec->frame);
+	free(rec->prev);
+	free(rec->rgb_row);
+	free(rec->dirname);
+	rec->frame = rec->prev = rec->rgb_row = NULL;
+	rec->dirname = NULL;
+	rec->rows = rec->prev_rows = rec->rows_capa = 0;
+    }
+
+    return self;
+}
+#endif /* USE_OBJSPACE_RECORDER */
+
+void
+Init_gc_tracer_objspace_recorder(VALUE mod)
+{
+#if USE_OBJSPACE_RECORDER
+    rb_define_module_function(mod, "start_objspace_recording_", gc_tracer_start_objspace_recording, 4);
+    rb_define_module_function(mod, "stop_objspace_recording", gc_tracer_stop_objspace_recording, 0);
+#endif
+}
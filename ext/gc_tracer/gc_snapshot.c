@@ -0,0 +1,120 @@
+/*
+ * GC::Tracer.gc_snapshot method
+ *
+ * A cheap snapshot of GC counters to attribute GC to requests, without
+ * GC.stat hashes:
+ *   [GC time (nsec), minor GC count, major GC count, allocated objects]
+ *
+ * GC time is summed by enter/exit hooks enabled at the first snapshot
+ * (GC before it is not counted). Without them, GC.stat(:time) (msec)
+ * is used if it is available.
+ */
+
+#include <ruby/ruby.h>
+#include <ruby/debug.h>
+
+#include <time.h>
+
+#define SNAPSHOT_VALUES 4
+
+#if defined(RUBY_INTERNAL_EVENT_GC_ENTER) && defined(HAVE_CLOCK_GETTIME)
+#define USE_GC_TIME_HOOKS 1
+#else
+#define USE_GC_TIME_HOOKS 0
+#endif
+
+static VALUE sym_time, sym_minor_gc_count, sym_major_gc_count, sym_total_allocated_objects;
+
+#if USE_GC_TIME_HOOKS
+static VALUE gc_time_hooks[2];
+static unsigned long long gc_time_total, gc_time_enter;
+
+static unsigned long long
+now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+gc_time_enter_i(VALUE tpval, void *data)
+{
+    gc_time_enter = now_nsec();
+}
+
+static void
+gc_time_exit_i(VALUE tpval, void *data)
+{
+    /* ignore GC entered before enabling */
+    if (gc_time_enter > 0) gc_time_total += now_nsec() - gc_time_enter;
+}
+
+static unsigned long long
+gc_time(void)
+{
+    if (gc_time_hooks[0] == 0) {
+	gc_time_hooks[0] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_ENTER, gc_time_enter_i, 0);
+	gc_time_hooks[1] = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_EXIT, gc_time_exit_i, 0);
+	rb_gc_register_mark_object(gc_time_hooks[0]);
+	rb_gc_register_mark_object(gc_time_hooks[1]);
+	rb_tracepoint_enable(gc_time_hooks[0]);
+	rb_tracepoint_enable(gc_time_hooks[1]);
+    }
+    return gc_time_total;
+}
+#else
+static int use_stat_time; /* GC.stat(:time) (msec) is available */
+
+static unsigned long long
+gc_time(void)
+{
+    if (use_stat_time) return (unsigned long long)rb_gc_stat(sym_time) * 1000000;
+    return 0;
+}
+#endif
+
+static VALUE
+gc_tracer_gc_snapshot(int argc, VALUE *argv, VALUE self)
+{
+    VALUE since;
+    unsigned long long values[SNAPSHOT_VALUES];
+    int i;
+
+    rb_scan_args(argc, argv, "01", &since);
+
+    values[0] = gc_time();
+    values[1] = rb_gc_stat(sym_minor_gc_count);
+    values[2] = rb_gc_stat(sym_major_gc_count);
+    values[3] = rb_gc_stat(sym_total_allocated_objects);
+
+    /* differences from the snapshot */
+    if (!NIL_P(since)) {
+	Check_Type(since, T_ARRAY);
+	if (RARRAY_LEN(since) != SNAPSHOT_VALUES) {
+	    rb_raise(rb_eArgError, "not a snapshot");
+	}
+	for (i=0; i<SNAPSHOT_VALUES; i++) {
+	    values[i] -= NUM2ULL(RARRAY_AREF(since, i));
+	}
+    }
+
+    return rb_ary_new_from_args(SNAPSHOT_VALUES,
+				ULL2NUM(values[0]), ULL2NUM(values[1]),
+				ULL2NUM(values[2]), ULL2NUM(values[3]));
+}
+
+void
+Init_gc_tracer_snapshot(VALUE mod)
+{
+    sym_time = ID2SYM(rb_intern("time"));
+    sym_minor_gc_count = ID2SYM(rb_intern("minor_gc_count"));
+    sym_major_gc_count = ID2SYM(rb_intern("major_gc_count"));
+    sym_total_allocated_objects = ID2SYM(rb_intern("total_allocated_objects"));
+
+#if !USE_GC_TIME_HOOKS
+    use_stat_time = RTEST(rb_hash_lookup2(rb_funcall(rb_mGC, rb_intern("stat"), 0), sym_time, Qfalse));
+#endif
+
+    rb_define_module_function(mod, "gc_snapshot", gc_tracer_gc_snapshot, -1);
+}
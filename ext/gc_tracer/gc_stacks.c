@@ -0,0 +1,268 @@
+/*
+ * GC::Tracer.*_gc_stack_sampling methods
+ *
+ * Sample Ruby-level backtraces of sites which trigger GC (at start and/or
+ * enter events) and aggregate them by stacks, to attribute GC to call
+ * sites without a profiler. Results are collapsed stacks for flamegraphs:
+ *
+ *   <main>;Foo#bar;Array#map 12
+ *
+ * Hooks only copy frames with rb_profile_frames() into buffers allocated
+ * at start: stacks are kept in a fixed-size linear probing table and
+ * samples of new stacks are counted as "(dropped)" when it is full.
+ * Frames are converted into names at stop.
+ */
+
+#include <ruby/ruby.h>
+#include <ruby/debug.h>
+
+#include <string.h>
+
+#define STACKS_DEFAULT_DEPTH 64
+#define STACKS_DEFAULT_SIZE  4096
+
+struct stack_entry {
+    unsigned long hash;
+    size_t count; /* 0: empty */
+    int depth;
+    VALUE *frames; /* leaf first, in the frame pool */
+};
+
+struct gc_stacks {
+    int running;
+    int max_depth;
+
+    struct stack_entry *entries;
+    unsigned long capa; /* power of 2 */
+    unsigned long num;
+    unsigned long limit; /* max number of stacks */
+    VALUE *pool;         /* frames of stacks (limit * max_depth) */
+    VALUE *buff;         /* frames of the current sample */
+    int *lines;
+
+    size_t dropped; /* samples of new stacks after the table is full */
+
+    VALUE start_hook;
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+    VALUE enter_hook;
+#endif
+} gc_stacks;
+
+static VALUE gc_stacks_obj; /* to mark frames */
+
+static unsigned long
+stack_hash(const VALUE *frames, int depth)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i=0; i<depth; i++) {
+	h = (h ^ frames[i]) * 0x100000001b3ULL;
+    }
+    /* finalizer of splitmix64 */
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (unsigned long)h;
+}
+
+/* hooks */
+
+static void
+sample_i(VALUE tpval, void *data)
+{
+    struct gc_stacks *gs = (struct gc_stacks *)data;
+    int depth = rb_profile_frames(0, gs->max_depth, gs->buff, gs->lines);
+    unsigned long hash = stack_hash(gs->buff, depth), i;
+    struct stack_entry *e;
+
+    for (i = hash & (gs->capa - 1); (e = &gs->entries[i])->count > 0; i = (i + 1) & (gs->capa - 1)) {
+	if (e->hash == hash && e->depth == depth &&
+	    memcmp(e->frames, gs->buff, sizeof(VALUE) * depth) == 0) {
+	    e->count++;
+	    return;
+	}
+    }
+
+    if (gs->num == gs->limit) {
+	gs->dropped++;
+	return;
+    }
+
+    e->frames = gs->pool + gs->num * gs->max_depth;
+    memcpy(e->frames, gs->buff, sizeof(VALUE) * depth);
+    e->depth = depth;
+    e->hash = hash;
+    e->count = 1;
+    gs->num++;
+}
+
+/* data object to mark frames */
+
+static void
+gc_stacks_mark(void *ptr)
+{
+    struct gc_stacks *gs = (struct gc_stacks *)ptr;
+    unsigned long i;
+    int j;
+
+    for (i=0; i<gs->capa; i++) {
+	struct stack_entry *e = &gs->entries[i];
+	if (e->count > 0) {
+	    for (j=0; j<e->depth; j++) rb_gc_mark(e->frames[j]);
+	}
+    }
+}
+
+static const rb_data_type_t gc_stacks_type = {
+    "GC::Tracer::gc_stacks",
+    {gc_stacks_mark, NULL, NULL, NULL, {0}},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+gc_stacks_free(struct gc_stacks *gs)
+{
+    free(gs->entries);
+    free(gs->pool);
+    free(gs->buff);
+    free(gs->lines);
+
+    gs->entries = NULL;
+    gs->pool = gs->buff = NULL;
+    gs->lines = NULL;
+    gs->capa = gs->num = gs->limit = 0;
+}
+
+/* methods */
+
+static VALUE
+gc_tracer_start_gc_stack_sampling(VALUE self, VALUE events, VALUE depth, VALUE size)
+{
+    struct gc_stacks *gs = &gc_stacks;
+    int max_depth = NIL_P(depth) ? STACKS_DEFAULT_DEPTH : NUM2INT(depth);
+    long limit = NIL_P(size) ? STACKS_DEFAULT_SIZE : NUM2LONG(size);
+    int start = 0, enter = 0;
+    unsigned long capa;
+    long i;
+
+    if (gs->running) {
+	rb_raise(rb_eRuntimeError, "GC stack sampling is already running.");
+    }
+    if (max_depth <= 0) {
+	rb_raise(rb_eArgError, "depth should be positive: %d", max_depth);
+    }
+    if (limit <= 0) {
+	rb_raise(rb_eArgError, "size should be positive: %ld", limit);
+    }
+
+    events = rb_check_array_type(events);
+    if (NIL_P(events)) {
+	rb_raise(rb_eArgError, "events should be an array of :start and :enter.");
+    }
+    for (i=0; i<RARRAY_LEN(events); i++) {
+	VALUE sym = RARRAY_AREF(events, i);
+
+	if (sym == ID2SYM(rb_intern("start"))) start = 1;
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+	else if (sym == ID2SYM(rb_intern("enter"))) enter = 1;
+#endif
+	else rb_raise(rb_eArgError, "unsupported event: %"PRIsVALUE, sym);
+    }
+
+    /* load factor <= 1/2 */
+    for (capa = 1; capa < (unsigned long)limit * 2; capa *= 2);
+
+    gs->entries = calloc(capa, sizeof(struct stack_entry));
+    gs->pool = malloc(sizeof(VALUE) * limit * max_depth);
+    gs->buff = malloc(sizeof(VALUE) * max_depth);
+    gs->lines = malloc(sizeof(int) * max_depth);
+    if (gs->entries == NULL || gs->pool == NULL || gs->buff == NULL || gs->lines == NULL) {
+	gc_stacks_free(gs);
+	rb_memerror();
+    }
+    gs->capa = capa;
+    gs->limit = (unsigned long)limit;
+    gs->num = 0;
+    gs->max_depth = max_depth;
+    gs->dropped = 0;
+
+    if (gs->start_hook == 0) {
+	gs->start_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_START, sample_i, gs);
+	rb_gc_register_mark_object(gs->start_hook);
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+	gs->enter_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_ENTER, sample_i, gs);
+	rb_gc_register_mark_object(gs->enter_hook);
+#endif
+    }
+
+    gs->running = 1;
+    if (start) rb_tracepoint_enable(gs->start_hook);
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+    if (enter) rb_tracepoint_enable(gs->enter_hook);
+#endif
+
+    return self;
+}
+
+static VALUE
+frame_name(VALUE frame)
+{
+    VALUE name = rb_profile_frame_full_label(frame);
+
+    if (NIL_P(name)) return rb_str_new_cstr("(unknown)");
+    /* ';' separates frames */
+    return rb_funcall(name, rb_intern("tr"), 2, rb_str_new_cstr(";"), rb_str_new_cstr(":"));
+}
+
+static VALUE
+gc_tracer_stop_gc_stack_sampling(VALUE self)
+{
+    struct gc_stacks *gs = &gc_stacks;
+    VALUE result;
+    unsigned long i;
+    int j;
+
+    if (gs->running == 0) {
+	rb_raise(rb_eRuntimeError, "GC stack sampling is not running.");
+    }
+
+    rb_tracepoint_disable(gs->start_hook);
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+    rb_tracepoint_disable(gs->enter_hook);
+#endif
+
+    /* names are allocated without hooks (frames are still marked) */
+    result = rb_str_new(0, 0);
+    for (i=0; i<gs->capa; i++) {
+	struct stack_entry *e = &gs->entries[i];
+
+	if (e->count == 0) continue;
+	if (e->depth == 0) {
+	    rb_str_cat_cstr(result, "(no frames)");
+	}
+	/* root first */
+	for (j=e->depth-1; j>=0; j--) {
+	    rb_str_append(result, frame_name(e->frames[j]));
+	    if (j > 0) rb_str_cat_cstr(result, ";");
+	}
+	rb_str_catf(result, " %"PRIuSIZE"\n", e->count);
+    }
+    if (gs->dropped > 0) {
+	rb_str_catf(result, "(dropped) %"PRIuSIZE"\n", gs->dropped);
+    }
+
+    gs->running = 0;
+    gc_stacks_free(gs);
+    return result;
+}
+
+void
+Init_gc_tracer_stacks(VALUE mod)
+{
+    rb_define_module_function(mod, "start_gc_stack_sampling_", gc_tracer_start_gc_stack_sampling, 3);
+    rb_define_module_function(mod, "stop_gc_stack_sampling", gc_tracer_stop_gc_stack_sampling, 0);
+
+    gc_stacks_obj = TypedData_Wrap_Struct(0, &gc_stacks_type, &gc_stacks);
+    rb_gc_register_mark_object(gc_stacks_obj);
+}
@@ -8,10 +8,22 @@
 #include <ruby/ruby.h>
 
 void Init_gc_tracer_logging(VALUE m_gc_tracer); /* in gc_logging.c */
+void Init_gc_tracer_histogram(VALUE m_gc_tracer); /* in gc_histogram.c */
+void Init_gc_tracer_allocation(VALUE m_gc_tracer); /* in gc_allocation.c */
+void Init_gc_tracer_objspace_recorder(VALUE m_gc_tracer); /* in gc_objspace_recorder.c */
+void Init_gc_tracer_snapshot(VALUE m_gc_tracer); /* in gc_snapshot.c */
+void Init_gc_tracer_exporter(VALUE m_gc_tracer); /* in gc_exporter.c */
+void Init_gc_tracer_stacks(VALUE m_gc_tracer); /* in gc_stacks.c */
 
 void
 Init_gc_tracer(void)
 {
     VALUE mod = rb_define_module_under(rb_mGC, "Tracer");
     Init_gc_tracer_logging(mod);
+    Init_gc_tracer_histogram(mod);
+    Init_gc_tracer_allocation(mod);
+    Init_gc_tracer_objspace_recorder(mod);
+    Init_gc_tracer_snapshot(mod);
+    Init_gc_tracer_exporter(mod);
+    Init_gc_tracer_stacks(mod);
 }
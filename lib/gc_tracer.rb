@@ -1,5 +1,9 @@
 require "gc_tracer/version"
 require 'gc_tracer/gc_tracer'
+require 'gc_tracer/binary_log'
+require 'gc_tracer/log_reader'
+require 'gc_tracer/objspace_frames'
+require 'fileutils'
 
 module GC
   module Tracer
@@ -15,13 +19,46 @@ module GC
                            filename: nil,
                            # event filter
                            events: %i(start end_mark end_sweep),
-                           # tick type (:hw_counter, :time, :user_time, :system_time)
+                           # tick type (:none, :hw_counter, :time, :nano_time, :tsc_ns)
                            tick_type: :time,
-                           # collect information
+                           # collect information (true, false or an array of keys)
                            gc_stat: true,
                            gc_latest_gc_info: true,
                            rusage: false,
-                           custom_fields: nil
+                           # GC.stat_heap of each size pool (Ruby 3.2+)
+                           gc_stat_heap: false,
+                           # names, or {name => kind} (kind: :counter, :max, :sum or :last)
+                           custom_fields: nil,
+                           # number of records kept in memory (nil: no buffering)
+                           buffer_size: nil,
+                           # write records by a native writer thread
+                           async: false,
+                           # output format (:tsv, :binary, :binary_delta)
+                           format: :tsv,
+                           # records between full records (only for :binary_delta)
+                           keyframe_interval: nil,
+                           # log 1 in sample_rate newobj/freeobj events (nil: all)
+                           sample_rate: nil,
+                           # intervals of sampling (:fixed or :poisson)
+                           sampling: :fixed,
+                           # columns of mark_time, sweep_time, total_pause and time_since_last_gc (in ticks)
+                           phase_times: false,
+                           # columns of allocation_rate and promotion, and GC::Tracer.rates
+                           # (true or time constant of moving averages in seconds)
+                           rates: false,
+                           # keep the last flight_recorder records in memory and write them
+                           # (and the next flight_recorder_after records) only when a GC
+                           # pauses longer than flight_recorder_pause msec (nil: disabled)
+                           flight_recorder: nil,
+                           flight_recorder_pause: 10,
+                           flight_recorder_after: 0,
+                           # write into a preallocated mmap-ed file (true or size in bytes)
+                           mmap: false,
+                           # rotate the file at max_size bytes and keep max_files old files (nil: all)
+                           max_size: nil,
+                           max_files: nil,
+                           # compress old files (true or :gzip)
+                           compress: false
                          )
       # setup
       raise "do not specify two fienames" if filename && filename_opt
@@ -31,8 +68,20 @@ module GC
       self.setup_logging_gc_stat = gc_stat
       self.setup_logging_gc_latest_gc_info = gc_latest_gc_info
       self.setup_logging_rusage = rusage
+      self.setup_logging_gc_stat_heap = gc_stat_heap
       self.setup_logging_tick_type = tick_type
       self.setup_logging_custom_fields = custom_fields
+      self.setup_logging_buffer_size = buffer_size
+      self.setup_logging_async = async
+      self.setup_logging_format = format
+      self.setup_logging_keyframe_interval = keyframe_interval
+      self.setup_logging_sample_rate = sample_rate
+      self.setup_logging_sampling = sampling
+      self.setup_logging_phase_times = phase_times
+      self.setup_logging_rates = rates
+      setup_logging_flight_recorder(flight_recorder, flight_recorder_pause, flight_recorder_after)
+      self.setup_logging_mmap = mmap
+      setup_logging_rotation(max_size, max_files, compress)
 
       if block_given?
         begin
@@ -45,5 +94,124 @@ module GC
         start_logging_
       end
     end
+
+    # A handle of a custom field (see GC::Tracer.custom_field)
+    class CustomField
+      attr_reader :name
+    end
+
+    # Reopen the log file in a forked child process as "filename-PID"
+    # and reset custom fields. Records are ignored in the child until
+    # this method is called, and logging is stopped at exit of the child.
+    # With Ruby 3.1 or later, it is called automatically by Process._fork.
+    def self.after_fork
+      if filename = logging_filename
+        filename = "#{filename.sub(/-#{Process.ppid}\z/, '')}-#{Process.pid}"
+      end
+      after_fork_(filename)
+      # the parent's block does not stop logging in the child
+      at_exit{ stop_logging }
+    end
+
+    module ForkHook
+      def _fork
+        pid = super
+        GC::Tracer.after_fork if pid == 0
+        pid
+      end
+    end
+    Process.singleton_class.prepend(ForkHook) if Process.respond_to?(:_fork)
+
+    # Write snapshots of heap pages into dirname/ppm/*.ppm at each GC event.
+    # With keyframe_interval, only every keyframe_interval-th snapshot is
+    # a full image and others are differences (*.ppm.diff).
+    # Use bin/objspace_recorder_convert.rb to see them.
+    def self.start_objspace_recording(dirname, keyframe_interval: nil)
+      FileUtils.mkdir_p("#{dirname}/ppm")
+      consts = GC::INTERNAL_CONSTANTS
+      start_objspace_recording_(dirname,
+                                consts[:HEAP_PAGE_OBJ_LIMIT] || consts[:HEAP_OBJ_LIMIT],
+                                consts[:BASE_SLOT_SIZE] || consts[:RVALUE_SIZE],
+                                keyframe_interval)
+
+      if block_given?
+        begin
+          yield
+        ensure
+          stop_objspace_recording
+        end
+      end
+    end
+
+    # Aggregate GC pause, marking and sweeping time (in nanoseconds)
+    # into histograms without logging.
+    #
+    # With a block, the block is called every `interval' seconds
+    # with a snapshot (see pause_histogram) and the histograms are reset.
+    def self.start_pause_histogram(interval: 60, &block)
+      start_pause_histogram_
+
+      if block
+        @pause_histogram_thread = Thread.new{
+          loop{
+            sleep interval
+            block.call(pause_histogram(reset: true))
+          }
+        }
+      end
+      self
+    end
+
+    def self.stop_pause_histogram
+      if th = @pause_histogram_thread
+        @pause_histogram_thread = nil
+        th.kill
+        th.join
+      end
+      stop_pause_histogram_
+    end
+
+    # Send GC metrics to a StatsD server by UDP from a native thread every
+    # `interval' seconds: "PREFIX.gc.count", "PREFIX.gc.gc_by.*" and
+    # "PREFIX.gc.major_by.*" counters, "PREFIX.gc.{pause,mark,sweep}.*" of
+    # pause histograms (with start_pause_histogram) and "PREFIX.custom.NAME"
+    # gauges of custom fields.
+    def self.start_exporter(host: '127.0.0.1', port: 8125, interval: 10, prefix: 'ruby', custom_fields: [])
+      start_exporter_(host, port, (interval * 1000).round, prefix, custom_fields.map(&:to_sym))
+
+      if block_given?
+        begin
+          yield
+        ensure
+          stop_exporter
+        end
+      else
+        self
+      end
+    end
+
+    # Sample backtraces (up to `depth' frames) at GC events (:start and/or
+    # :enter) and aggregate them by stacks (up to `size' stacks).
+    # stop_gc_stack_sampling returns collapsed stacks ("frame;frame;... count"
+    # lines) for flamegraph tools. With a block, they are returned at the end.
+    def self.start_gc_stack_sampling(events: %i(start), depth: 64, size: 4096)
+      start_gc_stack_sampling_(events, depth, size)
+
+      if block_given?
+        begin
+          yield
+        ensure
+          stacks = stop_gc_stack_sampling
+        end
+        stacks
+      else
+        self
+      end
+    end
+
+    # => {pause: {count:, total:, min:, max:, p50:, p90:, p99:, p999:}, mark: {...}, sweep: {...}}
+    def self.pause_histogram(reset: false)
+      pause_histogram_(reset)
+    end
   end
 end
@@ -0,0 +1,167 @@
+#
+# Decoder of GC::Tracer binary logs (format: :binary)
+#
+
+module GC
+  module Tracer
+    class BinaryLog
+      include Enumerable
+
+      MAGIC = "GCTRACER"
+      VERSION = 1
+      DELTA_VERSION = 2
+      MASK64 = (1 << 64) - 1
+
+      COLUMN_UNSIGNED = 0
+      COLUMN_VALUE    = 1
+      COLUMN_SIGNED   = 2
+
+      attr_reader :columns
+
+      def self.open(filename)
+        log = new(File.open(filename, 'rb'))
+        if block_given?
+          begin
+            yield log
+          ensure
+            log.close
+          end
+        else
+          log
+        end
+      end
+
+      def initialize(io)
+        @io = io
+        @events = []
+        @symbols = []
+        read_header
+      end
+
+      def close
+        @io.close
+      end
+
+      # names of columns including "type" and "tick"
+      def header
+        ['type', 'tick', *@columns.map(&:to_s)]
+      end
+
+      # yield [type, tick, value, ...]
+      # (columns can be changed in the middle of a log, see #columns)
+      def each_values
+        return enum_for(__method__) unless block_given?
+
+        while tag = @io.read(1)
+          case tag
+          when 'E'
+            id, name = read_name
+            @events[id] = name
+          when 'S'
+            id, name = read_name
+            @symbols[id] = name.to_sym
+          when 'R'
+            raw = read_bytes(@record_size).unpack(@unpack_format)
+            yield decode_values(raw.shift, raw)
+          when 'K'
+            raw = read_chunk.unpack('w*')
+            event_id = raw.shift
+            @prev = raw
+            yield decode_values(event_id, raw)
+          when 'D'
+            raw = read_chunk.unpack('w*')
+            event_id = raw.shift
+            @prev = @prev.each_with_index.map{|prev, i|
+              z = raw[i]
+              (prev + ((z >> 1) ^ -(z & 1))) & MASK64
+            }
+            yield decode_values(event_id, @prev)
+          when MAGIC[0]
+            # custom fields are changed
+            raise "broken header" unless read_bytes(MAGIC.size - 1) == MAGIC[1..]
+            read_columns
+          else
+            raise "unknown chunk: #{tag.inspect}"
+          end
+        end
+      end
+
+      # yield {type: type, tick: tick, column: value, ...}
+      def each
+        return enum_for(__method__) unless block_given?
+        each_values{|values|
+          yield @keys.zip(values).to_h
+        }
+      end
+
+      # output same text as format: :tsv
+      def write_tsv(out)
+        out.write tsv_line(header)
+        columns = @columns
+        each_values{|values|
+          out.write tsv_line(header) unless columns.equal?(@columns)
+          columns = @columns
+          out.write tsv_line(values)
+        }
+      end
+
+      private
+
+      def tsv_line(values)
+        values.map{|v| "#{v}\t"}.join << "\n"
+      end
+
+      def read_bytes(n)
+        str = @io.read(n)
+        raise "unexpected end of log" if str.nil? || str.bytesize < n
+        str
+      end
+
+      def read_chunk
+        read_bytes(read_bytes(4).unpack1('L<'))
+      end
+
+      def read_name
+        id, len = read_bytes(6).unpack('L<S<')
+        [id, read_bytes(len)]
+      end
+
+      def read_header
+        raise "not a gc_tracer binary log" unless read_bytes(8) == MAGIC
+        read_columns
+      end
+
+      def read_columns
+        version, n = read_bytes(8).unpack('L<L<')
+        raise "unsupported binary log version: #{version}" unless version == VERSION || version == DELTA_VERSION
+
+        @columns = []
+        @kinds = []
+        n.times{
+          kind, len = read_bytes(3).unpack('CS<')
+          @kinds << kind
+          @columns << read_bytes(len).to_sym
+        }
+        @keys = [:type, :tick, *@columns]
+        @record_size = 4 + 8 + 8 * n
+        @unpack_format = "L<Q<#{'Q<' * n}"
+      end
+
+      # raw: [tick, columns...] as unsigned 64 bit integers
+      def decode_values(event_id, raw)
+        values = [@events[event_id], raw[0]]
+        @kinds.each_with_index{|kind, i|
+          v = raw[i + 1]
+          case kind
+          when COLUMN_VALUE
+            v = (v & 1) == 1 ? @symbols[v >> 1] : v >> 1
+          when COLUMN_SIGNED
+            v -= 1 << 64 if v >= 1 << 63
+          end
+          values << v
+        }
+        values
+      end
+    end
+  end
+end
@@ -0,0 +1,124 @@
+#
+# Reader of GC::Tracer logs written by other threads or processes
+#
+
+module GC
+  module Tracer
+    class LogReader
+      MMAP_MAGIC = "GCTRMMAP"
+      MMAP_TRAILER_SIZE = 64
+      CHUNK_SIZE = 64 * 1024
+
+      # read all written data
+      def self.read(filename)
+        reader = new(filename)
+        reader.read_new
+      ensure
+        reader.close if reader
+      end
+
+      attr_reader :pos
+
+      def initialize(filename)
+        @io = File.open(filename, 'rb')
+        @pos = 0
+        @rest = String.new
+
+        # sparse index of lines: @index_lines[i] is the number of the line
+        # which starts at @index_offsets[i], for each chunk
+        @lines = 0
+        @indexed_pos = 0
+        @index_lines = []
+        @index_offsets = []
+        @header_lines = [] # numbers of header lines (the header can be changed while logging)
+      end
+
+      def close
+        @io.close
+      end
+
+      # bytes of written data (tail of mmap output or size of the file)
+      def tail
+        size = @io.size
+        if size >= MMAP_TRAILER_SIZE
+          trailer = @io.pread(MMAP_TRAILER_SIZE, size - MMAP_TRAILER_SIZE)
+          if trailer.start_with?(MMAP_MAGIC)
+            capa, tail = trailer.unpack('x8Q2')
+            return tail if capa + MMAP_TRAILER_SIZE == size
+          end
+        end
+        size
+      end
+
+      # read data written after the last read
+      def read_new
+        t = tail
+        return String.new if t <= @pos
+        data = @io.pread(t - @pos, @pos)
+        @pos += data.bytesize
+        data
+      end
+
+      # index lines written after the last call and return the number of lines
+      def update_index
+        t = tail
+        size = CHUNK_SIZE
+        while @indexed_pos < t
+          data = @io.pread([t - @indexed_pos, size].min, @indexed_pos)
+          unless last = data.rindex("\n")
+            break if @indexed_pos + data.bytesize >= t # incomplete line
+            size *= 2 # a line longer than the chunk
+            next
+          end
+          data = data.byteslice(0, last + 1)
+          @index_lines << @lines
+          @index_offsets << @indexed_pos
+          data.scan(/^type\t/){ @header_lines << @lines + $`.count("\n") }
+          @lines += data.count("\n")
+          @indexed_pos += last + 1
+          size = CHUNK_SIZE
+        end
+        @lines
+      end
+
+      # byte offset of the line (in indexed lines)
+      def line_offset(line)
+        return @indexed_pos if line >= @lines
+        i = (@index_lines.bsearch_index{|l| l > line} || @index_lines.size) - 1
+        stop = @index_offsets[i + 1] || @indexed_pos
+        data = @io.pread(stop - @index_offsets[i], @index_offsets[i])
+        pos = 0
+        (line - @index_lines[i]).times{ pos = data.index("\n", pos) + 1 }
+        @index_offsets[i] + pos
+      end
+
+      # number of the header line of the line (in indexed lines), or nil
+      def header_line(line)
+        i = (@header_lines.bsearch_index{|l| l > line} || @header_lines.size) - 1
+        i >= 0 ? @header_lines[i] : nil
+      end
+
+      # yield data between byte offsets (of line starts) in chunks of lines
+      def each_chunk(pos, stop)
+        return enum_for(__method__, pos, stop) unless block_given?
+        while pos < stop
+          data = @io.pread([stop - pos, CHUNK_SIZE].min, pos)
+          if pos + data.bytesize < stop && last = data.rindex("\n")
+            data = data.byteslice(0, last + 1)
+          end
+          yield data
+          pos += data.bytesize
+        end
+      end
+
+      # yield lines completed after the last read
+      def each_new_line
+        return enum_for(__method__) unless block_given?
+        @rest << read_new
+        while i = @rest.index("\n")
+          yield @rest.slice!(0, i + 1)
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,66 @@
+#
+# Reader of frames written by GC::Tracer.start_objspace_recording
+# (see gc_objspace_recorder.c for the format of *.ppm.diff)
+#
+# Frames are arrays of color indexes (line numbers of
+# color_description.txt) for each slot.
+#
+
+module GC
+  module Tracer
+    module ObjspaceFrames
+      DIFF_MAGIC = "GCTRDIFF"
+
+      # color index <-> RGB
+      def self.palette(dir)
+        File.read("#{dir}/color_description.txt").each_line.map{|line|
+          [line.chomp.split(/\t/)[1][1..-1]].pack('H*')
+        }
+      end
+
+      # => [width, rows, frame]
+      def self.read_ppm(file, palette_index)
+        data = File.binread(file)
+        header = data.slice!(0, data.index("\n255\n") + 5)
+        width, rows = header.split[1, 2].map(&:to_i)
+        [width, rows, data.scan(/.../m).map{|rgb| palette_index[rgb] || 0}]
+      end
+
+      # reconstruct a frame from a diff and the previous frame
+      # => [width, rows, frame]
+      def self.read_diff(file, prev)
+        data = File.binread(file)
+        raise "not a diff frame: #{file}" unless data[0, 8] == DIFF_MAGIC
+        width, rows = data[8, 8].unpack('VV')
+        n = width * rows
+        frame = Array.new(n){|i| prev[i] || 0}
+        pos = 16
+        i = 0
+        while i < n
+          zeros, len = data[pos, 8].unpack('VV')
+          pos += 8
+          i += zeros
+          data[pos, len].each_byte{|x| frame[i] ^= x; i += 1}
+          pos += len
+        end
+        [width, rows, frame]
+      end
+
+      # yields |file, width, rows, frame| for each frame in order
+      def self.each_frame(dir)
+        return enum_for(__method__, dir) unless block_given?
+
+        palette_index = palette(dir).each_with_index.to_h
+        prev = []
+        Dir.glob("#{dir}/ppm/*").sort.each{|file|
+          if file.end_with?('.diff')
+            width, rows, prev = read_diff(file, prev)
+          else
+            width, rows, prev = read_ppm(file, palette_index)
+          end
+          yield file, width, rows, prev
+        }
+      end
+    end
+  end
+end
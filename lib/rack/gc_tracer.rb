@@ -3,16 +3,25 @@
 #
 
 require 'gc_tracer'
+require 'uri'
 
 module Rack
   class GCTracerMiddleware
-    def initialize app, view_page_path: nil, filename: nil, logging_filename: nil, **kw
+    # GC during each request is stored into env['gc_tracer.request_gc']
+    # (see #request_gc). With gc_header: true, it is also returned as
+    # X-GC-Tracer header, and request_logger (an object which has `<<')
+    # receives a line for each request.
+    def initialize app, view_page_path: nil, filename: nil, logging_filename: nil,
+                   gc_header: false, request_logger: nil, **kw
       @app = app
+      @gc_header = gc_header
+      @request_logger = request_logger
       @view_page_path = view_page_path
       @logging_filename = filename || logging_filename || GC::Tracer.env_logging_filename
 
       if @logging_filename && view_page_path
         @view_page_pattern = /\A#{view_page_path}/
+        @view_lock = Mutex.new
       else
         @view_page_pattern = nil
       end
@@ -20,33 +29,91 @@ module Rack
       GC::Tracer.start_logging @logging_filename, rusage: true, custom_fields: %i(accesses), **kw
     end
 
-    def make_page
-      header = data = nil
-      open(@logging_filename){|f|
-        header = f.gets
-        data = f.readlines
+    # lines of the HTML page without a range query
+    DEFAULT_PAGE_LINES = 1_000
+
+    # A response body which reads the log in chunks
+    class LogBody
+      def initialize reader, ranges, html
+        @reader = reader
+        @ranges = ranges # [[start, stop], ...] byte offsets
+        @html = html
+      end
+
+      def each
+        yield "<table>\n" if @html
+        @ranges.each{|start, stop|
+          @reader.each_chunk(start, stop){|data|
+            yield @html ? to_rows(data) : data
+          }
+        }
+        yield "</table>" if @html
+      end
+
+      def to_rows data
+        data.each_line.map{|line|
+          tag = line.start_with?("type\t") ? 'th' : 'td'
+          "<tr>" + line.split(/\s+/).map{|e| "<#{tag}>#{e}</#{tag}>"}.join + "</tr>\n"
+        }.join
+      end
+    end
+
+    # Lines of the log are selected by a query:
+    # ?since=N (from the N-th line) or ?last=N (last N lines).
+    # The number of lines is returned as x-gc-tracer-next header,
+    # so that it can be used as "since" of the next request.
+    def view_response env, html
+      params = URI.decode_www_form(env["QUERY_STRING"] || '').to_h
+      reader, lines, ranges = @view_lock.synchronize{
+        @view_reader ||= GC::Tracer::LogReader.new(@logging_filename)
+        lines = @view_reader.update_index
+
+        if since = params['since']
+          from = since.to_i
+        elsif last = params['last'] || (DEFAULT_PAGE_LINES.to_s if html)
+          from = lines - last.to_i
+        else
+          from = 0
+        end
+        from = [[from, 0].max, lines].min
+
+        ranges = [[@view_reader.line_offset(from), @view_reader.line_offset(lines)]]
+        # the header of the first line
+        if from < lines && (header = @view_reader.header_line(from)) && header < from
+          ranges.unshift [@view_reader.line_offset(header), @view_reader.line_offset(header + 1)]
+        end
+        [@view_reader, lines, ranges]
       }
-      headers = "<tr>" + header.split(/\s+/).map{|e| "<th>#{e}</th>"}.join("\n") + "</tr>"
-      data = data.map{|line|
-        "<tr>" + line.split(/\s+/).map{|e| "<td>#{e}</td>"}.join + "</td>"
-      }.join("\n")
-      "<table>#{headers}\n#{data}</table>"
+      [200, {"content-type" => html ? "text/html" : "text/plain", "x-gc-tracer-next" => lines.to_s},
+       LogBody.new(reader, ranges, html)]
     end
 
     def call env
       if @view_page_pattern && @view_page_pattern =~ env["PATH_INFO"]
         GC::Tracer.flush_logging
-        p env["PATH_INFO"]
-        if env["PATH_INFO"] == @view_page_path + "/text"
-          [200, {"Content-Type" => "text/plain"}, [open(@logging_filename).read]]
-        else
-          [200, {"Content-Type" => "text/html"}, [make_page]]
-        end
+        view_response env, env["PATH_INFO"] != @view_page_path + "/text"
       else
         GC::Tracer.custom_field_increment(0)
-        @app.call(env)
+        snapshot = GC::Tracer.gc_snapshot
+        status, headers, body = @app.call(env)
+        gc = env['gc_tracer.request_gc'] = request_gc(GC::Tracer.gc_snapshot(snapshot))
+        headers['x-gc-tracer'] = gc_line(gc) if @gc_header
+        @request_logger << "#{env['REQUEST_METHOD']} #{env['PATH_INFO']}\t#{gc_line(gc)}\n" if @request_logger
+        [status, headers, body]
       end
     end
+
+    # GC in a request (GC in other threads at the same time is also counted):
+    # {time: nsec, minor_gc: count, major_gc: count, allocated_objects: count}
+    # It is taken when the app returns, so GC while the server iterates
+    # the body (e.g. streamed responses) is not counted.
+    def request_gc diff
+      {time: diff[0], minor_gc: diff[1], major_gc: diff[2], allocated_objects: diff[3]}
+    end
+
+    def gc_line gc
+      "gc_time=#{gc[:time] / 1_000}us minor_gc=#{gc[:minor_gc]} major_gc=#{gc[:major_gc]} allocated_objects=#{gc[:allocated_objects]}"
+    end
   end
 end
 
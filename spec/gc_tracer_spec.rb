@@ -1,6 +1,8 @@
 require 'spec_helper'
 require 'tmpdir'
 require 'fileutils'
+require 'stringio'
+require 'zlib'
 
 describe GC::Tracer do
   shared_examples "logging_test" do
@@ -28,6 +30,618 @@ describe GC::Tracer do
     it_behaves_like "logging_test"
   end
 
+  describe 'buffer_size' do
+    it 'should output all buffered records' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, buffer_size: 4){
+          10.times{
+            GC.start
+          }
+        }
+        lines = File.read(logfile).split(/\n/)
+        expect(lines.length).to be >= 10 * 3 + 1
+        expect(lines.map{|line| line.split(/\t/).size}.uniq.size).to be 1
+      }
+    end
+  end
+
+  describe 'buffer overflow' do
+    it 'should drop records instead of writing them in GC' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        stderr, $stderr = $stderr, StringIO.new
+        begin
+          GC::Tracer.start_logging(logfile, buffer_size: 2){
+            3.times{ GC.start }
+          }
+          warning = $stderr.string
+        ensure
+          $stderr = stderr
+        end
+        dropped = GC::Tracer.dropped_records
+        expect(dropped).to be > 0
+        expect(warning).to match /#{dropped} records were dropped/
+        expect(File.read(logfile).lines.size).to be 1 + 3 * 3 - dropped
+      }
+    end
+  end
+
+  describe 'async' do
+    it 'should output all records by the writer thread' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, async: true){
+          10.times{
+            GC.start
+          }
+          GC::Tracer.custom_event_logging("custom")
+          GC::Tracer.flush_logging
+          expect(File.read(logfile).split(/\n/).length).to be >= 10 * 3 + 2
+        }
+        expect(GC::Tracer.dropped_records).to be 0
+        expect(File.read(logfile)).to match /^custom\t/
+      }
+    end
+  end
+
+  describe 'binary format' do
+    it 'should be decoded into same columns as tsv' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, format: :binary, custom_fields: %i(a)){
+          GC::Tracer.custom_field_decrement(:a)
+          3.times{
+            GC.start
+          }
+          GC::Tracer.custom_event_logging("custom")
+        }
+        GC::Tracer::BinaryLog.open(logfile){|log|
+          records = log.to_a
+          expect(records.size).to be >= 3 * 3 + 1
+          expect(records.last[:type]).to eq "custom"
+          expect(records.last[:a]).to be -1
+          expect(records.last[:count]).to be_a Integer
+          expect(records.last[:gc_by]).to be_a Symbol
+        }
+        tsv = StringIO.new
+        GC::Tracer::BinaryLog.open(logfile){|log| log.write_tsv(tsv)}
+        expect(tsv.string.lines[0]).to start_with "type\ttick\tcount\t"
+        expect(tsv.string.lines.last).to match /^custom\t.+\t-1\t$/
+      }
+    end
+  end
+
+  describe 'binary_delta format' do
+    it 'should be decoded across keyframes' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, format: :binary_delta, keyframe_interval: 3, custom_fields: %i(a)){
+          10.times{|i|
+            GC::Tracer.custom_field_set(:a, 5 - i)
+            GC::Tracer.custom_event_logging("custom")
+          }
+        }
+        records = GC::Tracer::BinaryLog.open(logfile){|log| log.to_a}
+        expect(records.map{|r| r[:a]}).to eq (0...10).map{|i| 5 - i}
+        expect(records.map{|r| r[:type]}.uniq).to eq ["custom"]
+        counts = records.map{|r| r[:total_allocated_objects]}
+        expect(counts.each_cons(2).all?{|a, b| a <= b}).to be true
+      }
+    end
+  end
+
+  describe 'selected keys' do
+    it 'should output only selected keys' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, gc_stat: %i(heap_live_slots count), gc_latest_gc_info: %i(gc_by)){
+          GC.start
+        }
+        lines = File.read(logfile).lines
+        expect(lines[0]).to eq "type\ttick\theap_live_slots\tcount\tgc_by\t\n"
+        expect(lines[1].chomp.split(/\t/).size).to be 5
+      }
+    end
+
+    it 'should raise error for unknown keys' do
+      expect{GC::Tracer.start_logging(gc_stat: %i(xyzzy))}.to raise_error ArgumentError
+    end
+
+    it 'should output all keys of the running Ruby' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile){
+          GC.start
+        }
+        lines = File.read(logfile).lines.map{|line| line.chomp.split(/\t/)}
+        expect(lines[0]).to eq ['type', 'tick', *GC.stat.keys.map(&:to_s), *GC.latest_gc_info.keys.map(&:to_s)]
+        expect(lines[1].size).to eq lines[0].size
+      }
+    end
+  end
+
+  describe 'gc_stat_heap' do
+    it 'should output values of each size pool after GC' do
+      skip 'GC.stat_heap is not supported' unless GC.respond_to?(:stat_heap)
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, gc_stat: false, gc_latest_gc_info: false, gc_stat_heap: %i(heap_eden_slots)){
+          GC.start
+        }
+        pools = GC.stat_heap.size
+        lines = File.read(logfile).lines.map{|line| line.chomp.split(/\t/)}
+        expect(lines[0]).to eq ['type', 'tick', *pools.times.map{|i| "heap_eden_slots_#{i}"}]
+        expect(lines.map(&:first)).to eq %w(type start end_mark end_sweep stat_heap)
+        expect(lines.last.drop(2).map(&:to_i)).to eq pools.times.map{|i| GC.stat_heap(i, :heap_eden_slots)}
+      }
+    end
+
+    it 'should raise error for unknown keys' do
+      expect{ GC::Tracer.start_logging(gc_stat_heap: %i(unknown_key)) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'mmap' do
+    it 'should be read while logging' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, mmap: 1 << 20){
+          GC.start
+          reader = GC::Tracer::LogReader.new(logfile)
+          expect(reader.each_new_line.to_a.size).to be 4
+          GC.start
+          expect(reader.each_new_line.to_a.size).to be 3
+          reader.close
+        }
+        expect(File.read(logfile).lines.size).to be 7
+      }
+    end
+
+    it 'should drop records over the size' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, mmap: 1_000, gc_stat: false, gc_latest_gc_info: false){
+          100.times{ GC.start }
+        }
+        expect(File.size(logfile)).to be <= 1_000
+        expect(GC::Tracer.dropped_records).to be > 0
+      }
+    end
+
+    it 'should align the trailer' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, mmap: 1_001, gc_stat: false, gc_latest_gc_info: false){
+          GC.start
+          expect(File.size(logfile)).to be 1_008 + 64
+          reader = GC::Tracer::LogReader.new(logfile)
+          expect(reader.each_new_line.to_a.size).to be 4
+          reader.close
+        }
+      }
+    end
+  end
+
+  describe 'fork' do
+    it 'should write into a file for each child' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        pid = nil
+        GC::Tracer.start_logging(logfile, custom_fields: %i(a), buffer_size: 100){
+          GC::Tracer.custom_field_increment(:a)
+          GC.start
+          pid = fork{
+            exit!(1) unless GC::Tracer.custom_field_get(:a) == 0
+            GC.start
+          }
+          Process.wait pid
+          expect($?.success?).to be true
+          GC.start
+        }
+        parent = File.read(logfile).lines
+        child = File.read("#{logfile}-#{pid}").lines
+        expect(parent.size).to be 1 + 3 * 2
+        expect(child.size).to be 1 + 3
+        expect(child[0]).to eq parent[0]
+      }
+    end if Process.respond_to?(:_fork)
+  end
+
+  describe 'rotation' do
+    it 'should rotate files with headers' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, max_size: 2_000, max_files: 2){
+          50.times{ GC.start }
+        }
+        files = Dir["#{logfile}*"].sort
+        expect(files.size).to be 3
+        files.each{|file|
+          expect(File.read(file).lines.first).to start_with "type\ttick\t"
+        }
+      }
+    end
+
+    it 'should rotate files by the writer thread' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, max_size: 2_000, async: true){
+          50.times{ GC.start }
+        }
+        files = Dir["#{logfile}*"]
+        expect(files.size).to be > 1
+        expect(files.sum{|file| File.read(file).lines.grep_v(/^type\t/).size}).to be 50 * 3
+      }
+    end
+
+    it 'should be read binary files separately' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, max_size: 2_000, format: :binary_delta){
+          50.times{ GC.start }
+        }
+        files = Dir["#{logfile}*"]
+        expect(files.size).to be > 1
+        records = files.inject(0){|r, file|
+          r + GC::Tracer::BinaryLog.open(file){|log| log.map{|rec| expect(rec[:type]).not_to be_nil}.size}
+        }
+        expect(records).to be 50 * 3
+      }
+    end
+
+    it 'should compress rotated files' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, max_size: 2_000, compress: true){
+          50.times{ GC.start }
+        }
+        files = Dir["#{logfile}.*"]
+        expect(files.size).to be > 0
+        expect(files.all?{|file| file.end_with?('.gz')}).to be true
+        Zlib::GzipReader.open(files.first){|gz|
+          expect(gz.readline).to start_with "type\ttick\t"
+        }
+      }
+    end
+  end
+
+  describe 'sample_rate' do
+    %i(fixed poisson).each{|sampling|
+      it "should sample newobj events (#{sampling})" do
+        Dir.mktmpdir('gc_tracer'){|dir|
+          logfile = "#{dir}/logging"
+          GC::Tracer.start_logging(logfile, events: %i(newobj), gc_stat: false, gc_latest_gc_info: false,
+                                   sample_rate: 100, sampling: sampling){
+            100_000.times{ '' }
+          }
+          lines = File.read(logfile).lines
+          expect(lines[0]).to eq "type\ttick\tsample_weight\t\n"
+          expect(lines.size).to be < 100_000 / 10
+          weights = lines.drop(1).map{|line| line.split(/\t/)[2].to_i}
+          expect(weights.sum).to be_between(90_000, 110_000)
+        }
+      end
+    }
+  end
+
+  describe 'tsc_ns' do
+    it 'should output nanoseconds comparable with nano_time' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+        GC::Tracer.start_logging(logfile, tick_type: :tsc_ns, gc_stat: false, gc_latest_gc_info: false){
+          GC.start
+        }
+        t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+        ticks = File.read(logfile).lines.drop(1).map{|line| line.split(/\t/)[1].to_i}
+        expect(ticks.size).to be > 0
+        expect(ticks.all?{|t| t > t0 - 1_000_000 && t < t1 + 1_000_000}).to be true
+      }
+    end
+  end
+
+  describe 'phase_times' do
+    it 'should output times of phases on end_sweep' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, events: %i(start end_sweep), tick_type: :nano_time,
+                                 gc_stat: false, gc_latest_gc_info: false, phase_times: true){
+          3.times{ GC.start }
+        }
+        lines = File.read(logfile).lines
+        expect(lines[0]).to eq "type\ttick\tmark_time\tsweep_time\ttotal_pause\ttime_since_last_gc\t\n"
+        records = lines.drop(1).map{|line| type, *values = line.chomp.split(/\t/); [type, *values.map(&:to_i)]}
+        expect(records.size).to eq 6
+        records.each_slice(2).with_index{|((_, start_tick, *start_values), (type, end_tick, mark, sweep, pause, since)), i|
+          expect(type).to eq 'end_sweep'
+          expect(start_values).to eq [0, 0, 0, 0]
+          expect(mark).to be > 0
+          expect(mark + sweep).to be <= end_tick - start_tick
+          expect(pause).to be >= mark + sweep
+          expect(since).to be > 0 if i > 0
+        }
+      }
+    end
+  end
+
+  describe 'rates' do
+    it 'should output allocation rates and promotions' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        rates = nil
+        GC::Tracer.start_logging(logfile, gc_stat: %i(old_objects), gc_latest_gc_info: false, rates: 10){
+          3.times{ 10_000.times{ '' }; GC.start(full_mark: false) }
+          rates = GC::Tracer.rates
+        }
+        lines = File.read(logfile).lines.map{|line| line.chomp.split(/\t/)}
+        expect(lines[0]).to eq %w(type tick old_objects allocation_rate promotion)
+        starts = lines.select{|type, | type == 'start'}
+        expect(starts.drop(1).all?{|*, rate, _| rate.to_i > 0}).to be true
+        expect(rates[:allocation_samples]).to be >= 2 # with other GCs in the loop
+        expect(rates[:promotion_samples]).to be >= 3
+        expect(rates[:allocation_rate]).to be > 0
+        expect(rates[:window]).to eq 10.0
+      }
+      expect{ GC::Tracer.rates }.to raise_error(RuntimeError)
+    end
+  end
+
+  describe 'flight_recorder' do
+    it 'should write records only around slow GCs' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        logfile = "#{dir}/logging"
+        GC::Tracer.start_logging(logfile, gc_stat: false, gc_latest_gc_info: false,
+                                 flight_recorder: 16, flight_recorder_pause: 1_000_000){
+          3.times{ GC.start }
+          GC::Tracer.custom_event_logging("x")
+        }
+        expect(File.read(logfile).lines.size).to be 1
+        expect(GC::Tracer.flight_recorder_triggers).to be 0
+
+        GC.start # finish a lazy sweep of a previous GC
+        GC::Tracer.start_logging(logfile, gc_stat: false, gc_latest_gc_info: false,
+                                 flight_recorder: 4, flight_recorder_pause: 0, flight_recorder_after: 2){
+          GC.start
+          %w(a b c).each{|e| GC::Tracer.custom_event_logging(e)}
+        }
+        types = File.read(logfile).lines.drop(1).map{|line| line.split(/\t/).first}
+        expect(types).to eq %w(start end_mark end_sweep a b)
+        expect(GC::Tracer.flight_recorder_triggers).to be 1
+      }
+    end
+  end
+
+  describe 'pause_histogram' do
+    after{ GC::Tracer.stop_pause_histogram }
+
+    it 'should aggregate GC times' do
+      GC::Tracer.start_pause_histogram
+      3.times{ GC.start }
+      h = GC::Tracer.pause_histogram(reset: true)
+      expect(h.keys).to eq %i(pause mark sweep)
+      expect(h[:mark][:count]).to be >= 3
+      expect(h[:sweep][:count]).to be >= 3
+      expect(h[:pause][:min] <= h[:pause][:p50] && h[:pause][:p50] <= h[:pause][:max]).to be true
+      expect(GC::Tracer.pause_histogram[:mark][:count]).to be 0
+    end
+
+    it 'should call a block periodically' do
+      snapshots = Queue.new
+      GC::Tracer.start_pause_histogram(interval: 0.05){|h| snapshots << h}
+      GC.start
+      expect(snapshots.pop[:sweep][:count]).to be >= 1
+    end
+  end
+
+  describe 'exporter' do
+    it 'should send metrics by UDP' do
+      require 'socket'
+      server = UDPSocket.new
+      server.bind('127.0.0.1', 0)
+      begin
+        GC::Tracer.start_logging('/dev/null', gc_stat: false, gc_latest_gc_info: false, custom_fields: %i(requests)){
+          GC::Tracer.start_exporter(port: server.addr[1], interval: 60, prefix: 'test', custom_fields: %i(requests)){
+            3.times{ GC.start }
+            GC::Tracer.custom_field_set(:requests, 10)
+          }
+        }
+        metrics = []
+        while (datagram, = server.recvfrom_nonblock(2000, exception: false)) && datagram != :wait_readable
+          metrics.concat datagram.split("\n")
+        end
+        expect(metrics).to include 'test.gc.count:3|c'
+        expect(metrics).to include 'test.gc.gc_by.method:3|c'
+        expect(metrics).to include 'test.custom.requests:10|g'
+        expect(GC::Tracer.exporter_stats[:send_errors]).to eq 0
+      ensure
+        server.close
+      end
+    end
+
+    it 'should not send removed custom fields' do
+      require 'socket'
+      server = UDPSocket.new
+      server.bind('127.0.0.1', 0)
+      begin
+        GC::Tracer.start_logging('/dev/null', gc_stat: false, gc_latest_gc_info: false, custom_fields: %i(requests)){
+          GC::Tracer.start_exporter(port: server.addr[1], interval: 60, prefix: 'test', custom_fields: %i(requests)){
+            GC::Tracer.remove_custom_field(:requests)
+            GC::Tracer.add_custom_field(:other) # reuses the slot
+            GC::Tracer.custom_field_set(:other, 5)
+          }
+        }
+        metrics = []
+        while (datagram, = server.recvfrom_nonblock(2000, exception: false)) && datagram != :wait_readable
+          metrics.concat datagram.split("\n")
+        end
+        expect(metrics.grep(/custom/)).to eq []
+      ensure
+        server.close
+      end
+    end
+  end
+
+  describe 'gc stack sampling' do
+    def trigger_gc
+      3.times{ GC.start }
+    end
+
+    it 'should aggregate backtraces of GC sites' do
+      stacks = GC::Tracer.start_gc_stack_sampling{ trigger_gc }
+      line = stacks.lines.find{|l| l.include?('#trigger_gc;')}
+      expect(line.end_with?(" 3\n")).to be true
+      expect(line.split(';').last).to eq "GC.start 3\n"
+      expect{ GC::Tracer.stop_gc_stack_sampling }.to raise_error RuntimeError
+
+      stacks = GC::Tracer.start_gc_stack_sampling(size: 1){ trigger_gc; GC.start }
+      expect(stacks.lines.last).to eq "(dropped) 1\n"
+    end
+  end
+
+  describe 'allocation tracing' do
+    it 'should aggregate allocations by site' do
+      GC::Tracer.setup_allocation_tracing(%i(path line class))
+      GC::Tracer.start_allocation_tracing
+      line = __LINE__; 1_000.times{ '' }
+      GC.start
+      result = GC::Tracer.stop_allocation_tracing
+      expect(GC::Tracer.header_of_allocation_tracing).to eq %i(path line class count freed_count total_age min_age max_age
+                                                                   age_0 age_1 age_2 age_3 age_4_7 age_8_15 age_16_31 age_32_)
+      count, freed_count, total_age, min_age, max_age, *ages = result[[__FILE__, line, String]]
+      expect(count).to be 1_000
+      expect(freed_count).to be 1_000
+      expect(min_age).to be >= 1
+      expect(max_age).to be >= min_age
+      expect(total_age).to be >= freed_count
+      expect(ages.sum).to be freed_count
+    end
+
+    it 'should grow tables out of hooks' do
+      GC::Tracer.setup_allocation_tracing(%i(path line))
+      GC::Tracer.start_allocation_tracing
+      objs = []
+      line = __LINE__; 200_000.times{ objs << Object.new }
+      3_000.times{|i| objs << eval("Object.new", nil, __FILE__, 10_000 + i) }
+      GC.compact if GC.respond_to?(:compact)
+      stderr, $stderr = $stderr, StringIO.new
+      begin
+        result = GC::Tracer.stop_allocation_tracing
+        warning = $stderr.string
+      ensure
+        $stderr = stderr
+      end
+      expect(warning).to eq ''
+      expect(result[[__FILE__, line]][0]).to be >= 200_000
+      expect(result.keys.count{|_, l| l >= 10_000}).to be 3_000
+    end
+
+    it 'should raise error for unknown keys' do
+      expect{GC::Tracer.setup_allocation_tracing(%i(xyzzy))}.to raise_error ArgumentError
+    end
+  end
+
+  describe 'gc_snapshot' do
+    it 'should count GC and allocations' do
+      snapshot = GC::Tracer.gc_snapshot
+      GC.start
+      GC.start(full_mark: false)
+      100.times{ Object.new }
+      time, minor, major, allocated = GC::Tracer.gc_snapshot(snapshot)
+      expect(major).to be 1
+      expect(minor).to be 1
+      expect(allocated).to be >= 100
+      expect(time).to be > 0 if GC.respond_to?(:total_time)
+    end
+  end
+
+  describe 'Rack middleware' do
+    it 'should store GC of each request' do
+      require 'rack/gc_tracer'
+      Dir.mktmpdir('gc_tracer'){|dir|
+        log = StringIO.new
+        app = ->(env){ GC.start; [200, {}, ['ok']] }
+        mw = Rack::GCTracerMiddleware.new(app, filename: "#{dir}/logging", gc_header: true, request_logger: log)
+        begin
+          env = {'REQUEST_METHOD' => 'GET', 'PATH_INFO' => '/foo'}
+          status, headers, _ = mw.call(env)
+          expect(status).to be 200
+          expect(env['gc_tracer.request_gc'][:major_gc]).to be 1
+          expect(headers['x-gc-tracer']).to match /major_gc=1 /
+          expect(log.string).to match %r{\AGET /foo\tgc_time=}
+        ensure
+          GC::Tracer.stop_logging
+        end
+      }
+    end
+
+    it 'should return ranges of the log' do
+      require 'rack/gc_tracer'
+      Dir.mktmpdir('gc_tracer'){|dir|
+        app = ->(env){ [200, {}, ['ok']] }
+        mw = Rack::GCTracerMiddleware.new(app, filename: "#{dir}/logging", view_page_path: '/gc_tracer')
+        begin
+          5.times{ GC.start }
+          get = ->(path, query){
+            status, headers, body = mw.call('PATH_INFO' => path, 'QUERY_STRING' => query)
+            [headers['x-gc-tracer-next'].to_i, body.to_enum(:each).to_a.join]
+          }
+          next_line, text = get.('/gc_tracer/text', '')
+          expect(text.lines.size).to be next_line
+          expect(text.lines[0]).to start_with "type\t"
+
+          _, text = get.('/gc_tracer/text', 'last=2')
+          expect(text.lines.size).to be 3
+          expect(text.lines[0]).to start_with "type\t"
+
+          GC.start
+          n, text = get.('/gc_tracer/text', "since=#{next_line}")
+          expect(n).to be next_line + 3
+          expect(text.lines.size).to be 1 + 3
+
+          _, html = get.('/gc_tracer', 'last=1')
+          expect(html.scan('<tr>').size).to be 2
+
+          # a long line and a changed header
+          GC::Tracer.custom_event_logging('x' * 100_000)
+          GC::Tracer.add_custom_field(:b)
+          next_line, = get.('/gc_tracer/text', '')
+          GC.start
+          _, text = get.('/gc_tracer/text', "since=#{next_line}")
+          expect(text.lines.size).to be 1 + 3
+          expect(text.lines[0]).to start_with "type\t"
+          expect(text.lines[0]).to match /\taccesses\tb\t$/
+          _, text = get.('/gc_tracer/text', 'last=5')
+          expect(text.lines.size).to be 1 + 5
+          expect(text.lines[0]).to match /\taccesses\t$/ # the header of the long line
+          expect(text.lines[1]).to start_with 'x' * 100_000
+          expect(text.lines[2]).to match /\taccesses\tb\t$/
+        ensure
+          GC::Tracer.stop_logging
+        end
+      }
+    end
+  end
+
+  describe 'LogReader' do
+    it 'should find lines by index' do
+      Dir.mktmpdir('gc_tracer'){|dir|
+        file = "#{dir}/log"
+        lines = (0...20_000).map{|i| "line#{i}\n"}
+        File.write(file, lines.join)
+        reader = GC::Tracer::LogReader.new(file)
+        expect(reader.update_index).to be 20_000
+        [0, 1, 12_345, 19_999].each{|i|
+          expect(File.binread(file, lines[i].size, reader.line_offset(i))).to eq lines[i]
+        }
+        data = reader.each_chunk(reader.line_offset(100), reader.line_offset(20_000)).to_a
+        expect(data.all?{|chunk| chunk.end_with?("\n")}).to be true
+        expect(data.join).to eq lines[100..].join
+        reader.close
+      }
+    end
+  end
+
   describe 'custom fields' do
     describe 'manipulate values' do
       around 'open' do |example|
@@ -74,6 +688,156 @@ describe GC::Tracer do
         GC::Tracer.custom_field_set(2, 43)
         expect(GC::Tracer.custom_field_get(:c)).to be 43
       end
+
+      it 'should update values with handles' do
+        a = GC::Tracer.custom_field(:a)
+        c = GC::Tracer.custom_field(2)
+        expect(a.name).to be :a
+        expect(c.name).to be :c
+        expect(a.frozen?).to be true
+        expect(a.increment).to be 1
+        expect(a.add(10)).to be 11
+        expect(a.decrement).to be 10
+        c.value = 42
+        expect(GC::Tracer.custom_field_get(:a)).to be 10
+        expect(GC::Tracer.custom_field_get(:c)).to be 42
+        expect(c.value).to be 42
+        expect{GC::Tracer.custom_field(:xyzzy)}.to raise_error RuntimeError
+      end
+
+      it 'should count increments from threads' do
+        b = GC::Tracer.custom_field(:b)
+        4.times.map{ Thread.new{ 10_000.times{ b.increment } } }.each(&:join)
+        expect(b.value).to be 40_000
+      end
+    end
+
+    describe 'dynamic custom fields' do
+      it 'should add and remove fields while logging' do
+        Dir.mktmpdir('gc_tracer'){|dir|
+          logfile = "#{dir}/logging"
+          GC::Tracer.start_logging(logfile, events: [], gc_stat: false, gc_latest_gc_info: false,
+                                   buffer_size: 10, custom_fields: %i(a)) do
+            a = GC::Tracer.custom_field(:a)
+            a.value = 1
+            GC::Tracer.custom_event_logging("x")
+            GC::Tracer.add_custom_field(:b, :max)
+            GC::Tracer.custom_field_set(:b, 2)
+            GC::Tracer.custom_event_logging("y")
+            GC::Tracer.remove_custom_field(:a)
+            expect{a.increment}.to raise_error RuntimeError
+            GC::Tracer.add_custom_field(:c)
+            expect(GC::Tracer.custom_field(:c).index).to be 1
+            GC::Tracer.custom_event_logging("z")
+          end
+
+          lines = File.read(logfile).lines
+          expect(lines).to eq ["type\ttick\ta\t\n",
+                               lines[1],
+                               "type\ttick\ta\tb\t\n",
+                               lines[3],
+                               "type\ttick\tb\t\n",
+                               "type\ttick\tb\tc\t\n",
+                               lines[6]]
+          expect(lines[1].end_with?("\t1\t\n")).to be true
+          expect(lines[3].end_with?("\t1\t2\t\n")).to be true
+          expect(lines[6].end_with?("\t2\t0\t\n")).to be true
+        }
+      end
+
+      it 'should change fields under GC.stress' do
+        Dir.mktmpdir('gc_tracer'){|dir|
+          logfile = "#{dir}/logging"
+          GC::Tracer.start_logging(logfile, custom_fields: %i(a)) do
+            begin
+              GC.stress = true
+              GC::Tracer.add_custom_field(:b)
+              GC::Tracer.remove_custom_field(:a)
+              GC::Tracer.add_custom_field(:a)
+            ensure
+              GC.stress = false
+            end
+          end
+          header = nil
+          File.read(logfile).lines.map{|line| line.split(/\t/)}.each{|cols|
+            if cols[0] == 'type'
+              header = cols
+            else
+              expect(cols.size).to be header.size
+            end
+          }
+          expect(header.last(3)).to eq %W(b a \n)
+        }
+      end
+
+      it 'should resolve handles again after re-adding fields' do
+        GC::Tracer.start_logging('/dev/null', events: [], custom_fields: %i(a)) do
+          a = GC::Tracer.custom_field(:a)
+          GC::Tracer.remove_custom_field(:a)
+          expect{a.value = 1}.to raise_error RuntimeError
+          GC::Tracer.add_custom_field(:b)
+          GC::Tracer.add_custom_field(:a)
+          a.value = 2
+          expect(GC::Tracer.custom_field_get(:a)).to be 2
+          expect(GC::Tracer.custom_field_get(:b)).to be 0
+        end
+      end
+
+      it 'should read changed columns of binary logs' do
+        Dir.mktmpdir('gc_tracer'){|dir|
+          logfile = "#{dir}/logging"
+          GC.start # finish a lazy sweep of a previous GC
+          GC::Tracer.start_logging(logfile, format: :binary_delta, custom_fields: %i(a)) do
+            GC.start
+            GC::Tracer.add_custom_field(:b)
+            GC::Tracer.custom_field_set(:b, 3)
+            GC.start
+          end
+          records = GC::Tracer::BinaryLog.open(logfile){|log| log.to_a}
+          expect(records.size).to be 6
+          expect(records[0].key?(:b)).to be false
+          expect(records[5][:b]).to be 3
+        }
+      end
+
+      it 'should support many fields' do
+        names = (1..1_000).map{|i| :"f#{i}"}
+        GC::Tracer.setup_logging_custom_fields = names
+        expect(GC::Tracer.custom_field(:f1000).index).to be 999
+        GC::Tracer.setup_logging_custom_fields = nil
+      end
+    end
+
+    describe 'kinds of custom fields' do
+      it 'should aggregate values between records' do
+        Dir.mktmpdir('gc_tracer'){|dir|
+          logfile = "#{dir}/logging"
+          GC::Tracer.start_logging(logfile, events: [], gc_stat: false, gc_latest_gc_info: false,
+                                   custom_fields: {c: :counter, m: :max, s: :sum, l: :last}) do
+            %i(c m s l).each{|name|
+              GC::Tracer.custom_field_set(name, 5)
+              GC::Tracer.custom_field_set(name, 3)
+            }
+            GC::Tracer.custom_event_logging("a")
+            GC::Tracer.custom_event_logging("b")
+            expect(GC::Tracer.time(:s){ sleep 0.01; :ret }).to be :ret
+            GC::Tracer.custom_event_logging("c")
+            GC.start
+            GC::Tracer.custom_event_logging("d")
+          end
+
+          lines = File.read(logfile).lines.map{|line| line.split(/\t/)}
+          expect(lines[0][2, 4]).to eq %w(c m s l)
+          expect(lines[1][2, 4]).to eq %w(3 5 8 3)
+          expect(lines[2][2, 4]).to eq %w(3 5 8 3) # reset only after GC
+          expect(lines[3][4].to_i).to be >= 8 + 10_000 # usec
+          expect(lines.last[2, 4]).to eq %w(3 0 0 3)
+        }
+      end
+
+      it 'should raise error for unknown kinds' do
+        expect{GC::Tracer.start_logging(custom_fields: {a: :xyzzy})}.to raise_error ArgumentError
+      end
     end
 
     describe 'output custome fields' do
@@ -100,7 +864,6 @@ describe GC::Tracer do
   end
   
 
-=begin not supported now.
   shared_examples "objspace_recorder_test" do
     dirname = "gc_tracer_objspace_recorder_spec.#{$$}"
 
@@ -129,5 +892,44 @@ describe GC::Tracer do
     let(:count){2}
     it_behaves_like "objspace_recorder_test"
   end
-=end
+
+  it 'should output diff frames of objspace recorder' do
+    Dir.mktmpdir('gc_tracer'){|dir|
+      begin
+        GC::Tracer.start_objspace_recording(dir, keyframe_interval: 3){
+          2.times{ GC.start }
+        }
+        expect(Dir.glob("#{dir}/ppm/*.ppm").size).to be >= 2
+        diffs = Dir.glob("#{dir}/ppm/*.ppm.diff")
+        expect(diffs.size).to be >= 4
+        expect(File.binread(diffs.first, 8)).to eq "GCTRDIFF"
+      rescue NoMethodError
+        pending "start_objspace_recording requires MRI >= 2.2"
+      end
+    }
+  end
+
+  it 'should decode diff frames into the same frames as keyframes' do
+    Dir.mktmpdir('gc_tracer'){|dir|
+      begin
+        # nothing is allocated between end_sweep and the start of the next GC
+        GC::Tracer.start_objspace_recording(dir, keyframe_interval: 2){
+          4.times{ GC.start }
+        }
+      rescue NoMethodError
+        pending "start_objspace_recording requires MRI >= 2.2"
+        next
+      end
+      # decoded by the reader which bin/objspace_recorder_convert.rb uses
+      frames = GC::Tracer::ObjspaceFrames.each_frame(dir).map{|file, width, rows, frame|
+        expect(frame.size).to eq width * rows
+        [File.basename(file), frame]
+      }
+
+      # [GC count].2.ppm.diff followed by [GC count + 1].0.ppm
+      pairs = frames.each_cons(2).select{|(a, _), (b, _)| a.end_with?('.2.ppm.diff') && b.end_with?('.0.ppm')}
+      expect(pairs.size).to be >= 1
+      expect(pairs.any?{|(_, a), (_, b)| a == b}).to be true
+    }
+  end
 end